@@ -0,0 +1,559 @@
+// add_genome_delta.cpp
+// Add newly sequenced genome(s) to an existing shard set without rebuilding it.
+//
+// The FASTA input is k-merized exactly like build_kmer_shards (rolling 2-bit encoder, per-thread
+// per-shard partitions, radix sort + dedup). For every shard the genome touches, the k-mers that
+// are not already present (base shard OR existing delta layers) become a new delta layer
+//   <shards>/<name>/<shard file>
+// which is registered on that shard's index.json line as  "deltas": [..., "<name>/<file>"].
+// Both query tools OR the delta layers over the base shard at load time; compact_shard_layers
+// later folds them back into the base files.
+//
+// With --source <name> the genome's full k-mer set is also OR-ed into its colour layer
+//   <shards>/colors/<name>/<shard file>
+// and <name> is appended to the top-level "sources" list of index.json, so query_kmer_bitmap
+// --colors and the substring stream's --absent-in/--present-in can tell genomes apart. Running it
+// over a genome that is already in the base set writes only the colour layer.
+//
+// The absent GC histograms (--gc-hist, JSON or GCHISTv1, repeatable) are patched in place by
+// subtracting the GC counts of the newly present k-mers, so they stay exact. Only touched shards
+// are read or written: the work is proportional to the size of the added genome.
+//
+// The whole run holds an exclusive flock on <shards>/index.json.lock, the lock compact_shard_layers
+// takes around its own rewrite of index.json, so concurrent runs of either tool never lose an
+// update: the layer name, the novelty check and the index rewrite all see the same index.
+//
+// Compile:
+//   g++ -O3 -march=native -std=c++17 -pthread add_genome_delta.cpp -lroaring -lzstd -o add_genome_delta
+//
+// Example:
+//   ./add_genome_delta --shards shards_18 --fasta new_isolate.fa
+//     --gc-hist gc_hist_shards_18.json --gc-hist gc_hist_shards_18.bin --threads 16
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
+
+using Clock = std::chrono::steady_clock;
+using Sec   = std::chrono::duration<double>;
+
+static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return r.ru_maxrss; }
+
+struct Args {
+  std::string shards;
+  std::vector<std::string> fasta;
+  std::vector<std::string> gc_hist;  // files to patch (JSON or GCHISTv1)
+  std::string name;                  // delta layer directory (default delta_NNNN)
+  std::string source;                // colour layer to extend (optional)
+  int threads = 4;
+  bool both_strands = false;
+};
+
+static void usage(const char* prog) {
+  std::cerr << "Usage: " << prog
+            << " --shards <dir> --fasta <file> [--fasta <file> ...]"
+            << " [--gc-hist <json|bin> ...] [--name <layer>] [--source <name>]"
+            << " [--threads N] [--both-strands]\n";
+}
+
+static bool parse_args(int argc, char** argv, Args& a) {
+  for (int i = 1; i < argc; ++i) {
+    std::string s(argv[i]);
+    if (s == "--shards" && i + 1 < argc) a.shards = argv[++i];
+    else if (s == "--fasta" && i + 1 < argc) a.fasta.push_back(argv[++i]);
+    else if (s == "--gc-hist" && i + 1 < argc) a.gc_hist.push_back(argv[++i]);
+    else if (s == "--name" && i + 1 < argc) a.name = argv[++i];
+    else if (s == "--source" && i + 1 < argc) a.source = argv[++i];
+    else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else if (s == "--both-strands") a.both_strands = true;
+    else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
+  }
+  if (a.shards.empty() || a.fasta.empty()) {
+    std::cerr << "Error: --shards and --fasta are required\n";
+    return false;
+  }
+  if (a.name.find('/') != std::string::npos || a.name.find('"') != std::string::npos) {
+    std::cerr << "Error: --name must be a plain directory name\n";
+    return false;
+  }
+  if (a.source.find_first_of("/\",") != std::string::npos) {
+    std::cerr << "Error: --source must be a plain name (no '/', ',' or '\"')\n";
+    return false;
+  }
+  return true;
+}
+
+// ---------------- index.json (kept as lines; shard lines are edited in place) ----------------
+// Appends `path` to the shard line's "deltas" array (creating the field if needed).
+static void add_delta_to_line(std::string& line, const std::string& path) {
+  auto key = line.find("\"deltas\"");
+  if (key != std::string::npos) {
+    auto lb = line.find('[', key);
+    auto rb = line.find(']', lb);
+    const bool empty = line.find('"', lb) > rb;
+    line.insert(rb, (empty ? "\"" : ", \"") + path + "\"");
+    return;
+  }
+  auto close = line.rfind('}');
+  if (close == std::string::npos) return;
+  line.insert(close, ", \"deltas\": [\"" + path + "\"]");
+}
+
+static int find_shard(const std::vector<ShardInfo>& shards, uint64_t idx) {
+  size_t lo = 0;
+  size_t hi = shards.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const auto& s = shards[mid];
+    if (idx < s.start) hi = mid;
+    else if (idx >= s.end) lo = mid + 1;
+    else return (int)mid;
+  }
+  return -1;
+}
+
+// ---------------- GC histograms ----------------
+// Subtracts `removed[sid][g]` from the histogram file at `path` (JSON or GCHISTv1).
+static bool patch_gc_hist(const std::string& path, int k, const std::vector<std::vector<uint64_t>>& removed) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) { std::perror(("open gc-hist: " + path).c_str()); return false; }
+  std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  in.close();
+
+  if (data.size() >= 24 && std::memcmp(data.data(), "GCHISTv1", 8) == 0) {
+    const uint64_t hk = read_le64((const unsigned char*)data.data() + 8);
+    const uint64_t n = read_le64((const unsigned char*)data.data() + 16);
+    if ((int)hk != k || n != removed.size() || data.size() < 24 + n * (hk + 1) * 8) {
+      std::cerr << "Error: " << path << " does not match the shard set\n";
+      return false;
+    }
+    for (size_t sid = 0; sid < removed.size(); ++sid) {
+      for (int g = 0; g <= k; ++g) {
+        if (!removed[sid][(size_t)g]) continue;
+        unsigned char* p = (unsigned char*)&data[24 + (sid * (size_t)(k + 1) + (size_t)g) * 8];
+        write_le64(p, read_le64(p) - removed[sid][(size_t)g]);
+      }
+    }
+    return write_file_atomic(path, data);
+  }
+
+  int hk = 0;
+  std::vector<std::vector<uint64_t>> hists;
+  if (!load_gc_hist_json(path, hk, hists)) {
+    std::cerr << "Error: failed to parse gc histogram: " << path << "\n";
+    return false;
+  }
+  if (hk != k || hists.size() != removed.size()) {
+    std::cerr << "Error: " << path << " does not match the shard set\n";
+    return false;
+  }
+  for (size_t sid = 0; sid < removed.size(); ++sid) {
+    for (int g = 0; g <= k; ++g) hists[sid][(size_t)g] -= removed[sid][(size_t)g];
+  }
+  return write_file_atomic(path, format_gc_hist_json(k, hists));
+}
+
+// ---------------- Radix sort + dedup (same as build_kmer_shards) ----------------
+static void radix_sort_dedup(std::vector<uint64_t>& a, std::vector<uint64_t>& tmp,
+                             uint64_t base, int bits) {
+  if (a.size() < 256) {
+    std::sort(a.begin(), a.end());
+  } else {
+    tmp.resize(a.size());
+    uint64_t* src = a.data();
+    uint64_t* dst = tmp.data();
+    for (int shift = 0; shift < bits; shift += 8) {
+      size_t count[257] = {0};
+      for (size_t i = 0; i < a.size(); ++i) count[((src[i] - base) >> shift & 0xFF) + 1]++;
+      for (int b = 0; b < 256; ++b) count[b + 1] += count[b];
+      for (size_t i = 0; i < a.size(); ++i) dst[count[(src[i] - base) >> shift & 0xFF]++] = src[i];
+      std::swap(src, dst);
+    }
+    if (src != a.data()) std::memcpy(a.data(), src, a.size() * sizeof(uint64_t));
+  }
+  a.erase(std::unique(a.begin(), a.end()), a.end());
+}
+
+// ---------------- FASTA chunk queue (same as build_kmer_shards) ----------------
+struct SeqChunk {
+  std::string bases;
+};
+
+struct ChunkQueue {
+  std::mutex mu;
+  std::condition_variable not_empty, not_full;
+  std::deque<SeqChunk> q;
+  size_t capacity = 8;
+  bool closed = false;
+
+  void push(SeqChunk&& c) {
+    std::unique_lock<std::mutex> lk(mu);
+    not_full.wait(lk, [&] { return q.size() < capacity; });
+    q.push_back(std::move(c));
+    not_empty.notify_one();
+  }
+  bool pop(SeqChunk& c) {
+    std::unique_lock<std::mutex> lk(mu);
+    not_empty.wait(lk, [&] { return !q.empty() || closed; });
+    if (q.empty()) return false;
+    c = std::move(q.front());
+    q.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+  void close() {
+    std::lock_guard<std::mutex> lk(mu);
+    closed = true;
+    not_empty.notify_all();
+  }
+};
+
+static bool stream_fasta(const std::string& path, int k, size_t chunk_bases, ChunkQueue& q,
+                         uint64_t& bases_read) {
+  FILE* f = (path == "-") ? stdin : std::fopen(path.c_str(), "rb");
+  if (!f) { std::perror(("open fasta: " + path).c_str()); return false; }
+
+  std::vector<char> buf(1 << 20);
+  SeqChunk cur;
+  cur.bases.reserve(chunk_bases);
+  size_t overlap = 0;
+  // FASTQ (first byte '@'): a record is its header line, sequence lines up to the '+' line, then
+  // quality lines until they hold as many characters as the sequence, so quality strings (which
+  // may contain A/C/G/T or start with '@') are never read as bases or headers.
+  enum class Line { Seq, Header, Plus, Qual };
+  Line line = Line::Seq;
+  bool first = true, fastq = false;
+  uint64_t seq_len = 0, qual_len = 0;
+  bool at_line_start = true;
+
+  auto flush = [&](bool record_end) {
+    if (cur.bases.size() > overlap && (int)cur.bases.size() >= k) {
+      std::string tail;
+      if (!record_end) tail = cur.bases.substr(cur.bases.size() - (size_t)(k - 1));
+      q.push(std::move(cur));
+      cur = SeqChunk();
+      overlap = tail.size();
+      cur.bases = std::move(tail);
+      cur.bases.reserve(chunk_bases);
+    } else if (record_end) {
+      cur.bases.clear();
+      overlap = 0;
+    }
+  };
+
+  size_t n;
+  while ((n = std::fread(buf.data(), 1, buf.size(), f)) > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      const char c = buf[i];
+      if (first && c != '\n' && c != '\r') { fastq = c == '@'; first = false; }
+      if (c == '\n') {
+        if (line == Line::Header) line = Line::Seq;
+        else if (line == Line::Plus) line = Line::Qual;
+        at_line_start = true;
+        continue;
+      }
+      if (at_line_start) {
+        at_line_start = false;
+        if (line == Line::Qual && qual_len >= seq_len) line = Line::Seq;  // record complete
+        if (line == Line::Seq && c == (fastq ? '@' : '>')) {
+          flush(true);
+          line = Line::Header;
+          seq_len = 0;
+        } else if (line == Line::Seq && fastq && c == '+') {
+          line = Line::Plus;
+          qual_len = 0;
+        }
+      }
+      if (c == '\r') continue;
+      if (line != Line::Seq) {
+        if (line == Line::Qual) qual_len++;
+        continue;
+      }
+      cur.bases.push_back(c);
+      seq_len++;
+      bases_read++;
+      if (cur.bases.size() >= chunk_bases) flush(false);
+    }
+  }
+  flush(true);
+  if (f != stdin) std::fclose(f);
+  return true;
+}
+
+struct ShardAcc {
+  std::mutex mu;
+  roaring64_bitmap_t* bm = nullptr;
+};
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+
+  const int lock_fd = lock_index(args.shards);
+  if (lock_fd < 0) return 2;
+  IndexLines index;
+  uint64_t k_index = 0;
+  std::vector<ShardInfo> shards;
+  if (!read_index_shards(args.shards, k_index, shards, &index)) {
+    std::cerr << "Error: failed to read shards index: " << args.shards << "/index.json\n";
+    return 2;
+  }
+  const int k = (int)k_index;
+  if (k < 1 || k > 31) { std::cerr << "Error: unsupported k=" << k << "\n"; return 2; }
+  const uint64_t total_bits = 1ULL << (2 * k);
+  const uint64_t kmask = total_bits - 1ULL;
+  const size_t N = shards.size();
+
+  if (args.name.empty()) {
+    // Next free delta_NNNN, from the layers already registered in index.json and past any layer
+    // directory still on disk (merged layers wait out compact_shard_layers' grace period).
+    unsigned next = 1;
+    for (const auto& si : shards) {
+      for (const auto& d : si.deltas) {
+        unsigned n = 0;
+        if (std::sscanf(d.c_str(), "delta_%u/", &n) == 1) next = std::max(next, n + 1);
+      }
+    }
+    char tmp[32];
+    struct stat st;
+    for (;; ++next) {
+      std::snprintf(tmp, sizeof(tmp), "delta_%04u", next);
+      if (::stat((args.shards + "/" + tmp).c_str(), &st) != 0) break;
+    }
+    args.name = tmp;
+  }
+
+  uint64_t max_width = 1;
+  for (const auto& si : shards) max_width = std::max<uint64_t>(max_width, si.end - si.start);
+  int width_bits = 0;
+  while (width_bits < 64 && (1ULL << width_bits) < max_width) width_bits++;
+  const uint64_t part_cap = 1 << 14;
+
+  std::vector<ShardAcc> acc(N);
+  std::atomic<uint64_t> kmers_seen(0);
+  std::atomic<bool> out_of_range(false);
+
+  auto flush_partition = [&](size_t sid, std::vector<uint64_t>& part, std::vector<uint64_t>& scratch) {
+    if (part.empty()) return;
+    radix_sort_dedup(part, scratch, shards[sid].start, width_bits);
+    ShardAcc& a = acc[sid];
+    std::lock_guard<std::mutex> lk(a.mu);
+    if (!a.bm) a.bm = roaring64_bitmap_create();
+    roaring64_bitmap_add_many(a.bm, part.size(), part.data());
+    part.clear();
+  };
+
+  auto t0 = Clock::now();
+  ChunkQueue queue;
+  queue.capacity = (size_t)args.threads * 2;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < args.threads; ++t) {
+    workers.emplace_back([&]() {
+      std::vector<std::vector<uint64_t>> parts(N);
+      std::vector<uint64_t> scratch;
+      uint64_t local_seen = 0;
+
+      auto emit = [&](uint64_t v) {
+        const int sid = find_shard(shards, v);
+        if (sid < 0) { out_of_range = true; return; }
+        auto& p = parts[(size_t)sid];
+        p.push_back(v);
+        if (p.size() >= part_cap) flush_partition((size_t)sid, p, scratch);
+      };
+
+      SeqChunk chunk;
+      while (queue.pop(chunk)) {
+        uint64_t fw = 0, rc = 0;
+        int valid = 0;
+        for (char c : chunk.bases) {
+          int d;
+          switch (c) {
+            case 'A': case 'a': d = 0; break;
+            case 'C': case 'c': d = 1; break;
+            case 'G': case 'g': d = 2; break;
+            case 'T': case 't': d = 3; break;
+            default: d = -1; break;
+          }
+          if (d < 0) { valid = 0; fw = 0; rc = 0; continue; }
+          fw = ((fw << 2) | (uint64_t)d) & kmask;
+          rc = (rc >> 2) | ((uint64_t)(3 - d) << (2 * (k - 1)));
+          if (++valid < k) continue;
+          emit(fw);
+          if (args.both_strands) emit(rc);
+          local_seen++;
+        }
+      }
+      for (size_t sid = 0; sid < N; ++sid) flush_partition(sid, parts[sid], scratch);
+      kmers_seen += local_seen;
+    });
+  }
+
+  uint64_t bases_read = 0;
+  bool input_ok = true;
+  for (const auto& path : args.fasta) {
+    if (!stream_fasta(path, k, 4u << 20, queue, bases_read)) { input_ok = false; break; }
+  }
+  queue.close();
+  for (auto& th : workers) th.join();
+  if (!input_ok || out_of_range) {
+    if (out_of_range) std::cerr << "Error: k-mer index out of shard ranges\n";
+    for (auto& a : acc) if (a.bm) roaring64_bitmap_free(a.bm);
+    return 2;
+  }
+  auto t1 = Clock::now();
+
+  // Per touched shard: new = genome \ (base | deltas). Write it as a delta layer and collect the
+  // GC counts to subtract from the absent histograms.
+  const std::string layer_dir = args.shards + "/" + args.name;
+  ::mkdir(layer_dir.c_str(), 0755);
+  const std::string color_dir = args.shards + "/colors/" + args.source;
+  if (!args.source.empty()) {
+    ::mkdir((args.shards + "/colors").c_str(), 0755);
+    ::mkdir(color_dir.c_str(), 0755);
+  }
+
+  std::vector<std::string> new_delta(N);
+  std::vector<std::vector<uint64_t>> removed(N, std::vector<uint64_t>((size_t)k + 1, 0));
+  std::atomic<size_t> next_shard(0);
+  std::atomic<uint64_t> new_total(0), touched(0);
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> pool;
+  for (int t = 0; t < args.threads; ++t) {
+    pool.emplace_back([&]() {
+      std::vector<uint64_t> batch(1 << 16);
+      while (true) {
+        const size_t sid = next_shard.fetch_add(1);
+        if (sid >= N) break;
+        roaring64_bitmap_t* add = acc[sid].bm;
+        acc[sid].bm = nullptr;
+        if (!add) continue;
+        touched++;
+
+        if (!args.source.empty()) {
+          // Colour layer = previous colour layer | this genome (before the novelty filter below).
+          const std::string cpath = color_dir + "/" + shards[sid].file;
+          struct stat st;
+          roaring64_bitmap_t* color = nullptr;
+          if (::stat(cpath.c_str(), &st) == 0) {
+            color = load_kbit_portable(cpath);
+            if (!color) { failed = true; roaring64_bitmap_free(add); continue; }
+            roaring64_bitmap_or_inplace(color, add);
+          } else {
+            color = roaring64_bitmap_copy(add);
+          }
+          roaring64_bitmap_run_optimize(color);
+          if (!write_kbit_portable(cpath, color, total_bits, (uint64_t)k)) failed = true;
+          roaring64_bitmap_free(color);
+        }
+
+        roaring64_bitmap_t* base = load_kbit_portable(args.shards + "/" + shards[sid].file);
+        if (!base) { failed = true; roaring64_bitmap_free(add); continue; }
+        roaring64_bitmap_andnot_inplace(add, base);
+        roaring64_bitmap_free(base);
+        for (const auto& d : shards[sid].deltas) {
+          if (roaring64_bitmap_is_empty(add)) break;
+          roaring64_bitmap_t* layer = load_kbit_portable(args.shards + "/" + d);
+          if (!layer) { failed = true; break; }
+          roaring64_bitmap_andnot_inplace(add, layer);
+          roaring64_bitmap_free(layer);
+        }
+
+        if (!roaring64_bitmap_is_empty(add)) {
+          roaring64_bitmap_run_optimize(add);
+          const std::string rel = args.name + "/" + shards[sid].file;
+          if (!write_kbit_portable(args.shards + "/" + rel, add, total_bits, (uint64_t)k)) failed = true;
+          new_delta[sid] = rel;
+
+          roaring64_iterator_t* it = roaring64_iterator_create(add);
+          uint64_t got;
+          while ((got = roaring64_iterator_read(it, batch.data(), batch.size())) > 0) {
+            for (uint64_t i = 0; i < got; ++i) removed[sid][(size_t)gc_count(batch[i], k)]++;
+          }
+          roaring64_iterator_free(it);
+          new_total += roaring64_bitmap_get_cardinality(add);
+        }
+        roaring64_bitmap_free(add);
+      }
+    });
+  }
+  for (auto& th : pool) th.join();
+  if (failed) return 2;
+
+  // Histograms first, then index.json: a reader that sees the new layer also sees the new counts
+  // (histograms only drive skipping, so briefly undercounting absent k-mers is harmless).
+  for (const auto& path : args.gc_hist) {
+    if (!patch_gc_hist(path, k, removed)) return 2;
+  }
+
+  std::vector<std::string>& index_lines = index.lines;
+  size_t layers = 0;
+  for (size_t sid = 0; sid < N; ++sid) {
+    if (new_delta[sid].empty()) continue;
+    add_delta_to_line(index_lines[shards[sid].line_no], new_delta[sid]);
+    layers++;
+  }
+  bool new_source = false;
+  if (!args.source.empty() &&
+      std::find(index.sources.begin(), index.sources.end(), args.source) == index.sources.end()) {
+    new_source = true;
+    if (index.sources_line >= 0) {
+      std::string& l = index_lines[(size_t)index.sources_line];
+      auto rb = l.find(']', l.find("\"sources\""));
+      l.insert(rb, (index.sources.empty() ? "\"" : ", \"") + args.source + "\"");
+    } else if (index.shards_line >= 0) {
+      index_lines.insert(index_lines.begin() + index.shards_line, "  \"sources\": [\"" + args.source + "\"],");
+    } else {
+      std::cerr << "Error: no \"shards\" array in index.json\n";
+      return 2;
+    }
+  }
+  if (layers == 0) ::rmdir(layer_dir.c_str());
+  if (layers > 0 || new_source) {
+    std::string out;
+    for (const auto& l : index_lines) { out += l; out += '\n'; }
+    if (!write_file_atomic(args.shards + "/index.json", out)) return 2;
+  }
+  ::close(lock_fd);
+  auto t2 = Clock::now();
+
+  long pk = peak_rss_kb();
+  std::cerr << std::fixed << std::setprecision(6);
+  std::cerr << "[INFO] Shards dir           : " << args.shards << " (k=" << k << ")\n";
+  std::cerr << "[INFO] Delta layer          : " << args.name << "\n";
+  if (!args.source.empty()) std::cerr << "[INFO] Colour source        : " << args.source << (new_source ? " (new)" : "") << "\n";
+  std::cerr << "[INFO] Bases read           : " << bases_read << "\n";
+  std::cerr << "[INFO] K-mers seen          : " << kmers_seen.load() << "\n";
+  std::cerr << "[INFO] Shards touched       : " << touched.load() << "\n";
+  std::cerr << "[INFO] Delta shards written : " << layers << "\n";
+  std::cerr << "[INFO] New k-mers           : " << new_total.load() << "\n";
+  std::cerr << "[INFO] Scan time            : " << std::chrono::duration_cast<Sec>(t1 - t0).count() << " s\n";
+  std::cerr << "[INFO] Delta time           : " << std::chrono::duration_cast<Sec>(t2 - t1).count() << " s\n";
+  std::cerr << "[INFO] Peak RSS             : " << pk << " KB (" << (pk / 1024.0) << " MB)\n";
+  return 0;
+}
@@ -0,0 +1,529 @@
+// build_kmer_shards.cpp
+// Parallel KBITv1 shard builder: FASTA genomes -> shards_<k>/ + index.json + GC histogram JSON.
+//
+// Pipeline:
+// - The main thread streams FASTA (or FASTQ, quality lines skipped) records and hands fixed-size
+//   sequence chunks (with k-1 bases of overlap) to a pool of workers through a bounded queue.
+// - Each worker runs a rolling 2-bit encoder (N/IUPAC resets the window) and appends k-mer ids
+//   to per-thread, per-shard partition buffers.
+// - A full partition is radix-sorted and deduplicated, then merged into that shard's roaring64
+//   accumulator with add_many (sorted input is the fast path).
+// - When a shard accumulator grows past its share of --mem-mb, it is run-optimized and spilled
+//   to --tmp as a partial KBITv1 run; spilled runs are OR-ed back when the shard is finalized.
+// - Finalization (parallel across shards) writes run-optimized flags=2 shards, counts the GC
+//   histogram of PRESENT values, and subtracts it from the closed-form histogram of [start, end)
+//   to get the per-shard ABSENT histogram consumed by query_substring_bitmap_stream.
+//
+// Shard layout: uniform ranges of width ceil(4^k / num_shards); index.json lists explicit
+// start/end for every shard, one shard object per line (the format both query tools parse).
+//
+// Compile:
+//   g++ -O3 -march=native -std=c++17 -pthread build_kmer_shards.cpp -lroaring -lzstd -o build_kmer_shards
+//
+// Example:
+//   ./build_kmer_shards --fasta hg38.fa --fasta chm13.fa --k 18 --num-shards 4096
+//     --out shards_18 --gc-hist gc_hist_shards_18.json --threads 32 --mem-mb 32768
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
+
+using Clock = std::chrono::steady_clock;
+using Sec   = std::chrono::duration<double>;
+
+static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return r.ru_maxrss; }
+
+struct Args {
+  std::vector<std::string> fasta;
+  int k = -1;
+  unsigned num_shards = 4096;
+  std::string out;
+  std::string gc_hist;       // optional
+  std::string tmp;           // spill directory (default <out>/.build_tmp)
+  int threads = 4;
+  uint64_t mem_mb = 4096;
+  bool both_strands = false; // also index reverse-complement k-mers
+  std::string ends;          // optional run-tail side list for derive_shards
+  int ends_depth = 2;        // tails cover derived k-1 .. k-ends_depth
+};
+
+static void usage(const char* prog) {
+  std::cerr << "Usage: " << prog
+            << " --fasta <file> [--fasta <file> ...] --k K --out <dir>"
+            << " [--num-shards N] [--gc-hist <json>] [--threads N] [--mem-mb M]"
+            << " [--tmp <dir>] [--both-strands] [--ends <file> [--ends-depth D]]\n";
+}
+
+static bool parse_args(int argc, char** argv, Args& a) {
+  for (int i = 1; i < argc; ++i) {
+    std::string s(argv[i]);
+    if (s == "--fasta" && i + 1 < argc) a.fasta.push_back(argv[++i]);
+    else if (s == "--k" && i + 1 < argc) a.k = std::atoi(argv[++i]);
+    else if (s == "--num-shards" && i + 1 < argc) a.num_shards = (unsigned)std::max(1, std::atoi(argv[++i]));
+    else if (s == "--out" && i + 1 < argc) a.out = argv[++i];
+    else if (s == "--gc-hist" && i + 1 < argc) a.gc_hist = argv[++i];
+    else if (s == "--tmp" && i + 1 < argc) a.tmp = argv[++i];
+    else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else if (s == "--mem-mb" && i + 1 < argc) a.mem_mb = std::max<uint64_t>(64, std::strtoull(argv[++i], nullptr, 10));
+    else if (s == "--both-strands") a.both_strands = true;
+    else if (s == "--ends" && i + 1 < argc) a.ends = argv[++i];
+    else if (s == "--ends-depth" && i + 1 < argc) a.ends_depth = std::max(1, std::atoi(argv[++i]));
+    else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
+  }
+
+  if (a.fasta.empty() || a.out.empty()) {
+    std::cerr << "Error: --fasta and --out are required\n";
+    return false;
+  }
+  if (a.k < 1 || a.k > 31) {
+    std::cerr << "Error: --k must be in 1..31\n";
+    return false;
+  }
+  if (a.tmp.empty()) a.tmp = a.out + "/.build_tmp";
+  return true;
+}
+
+// ---------------- Radix sort + dedup ----------------
+// LSD radix sort on (v - base), 8 bits per pass; only the bits spanned by one shard are sorted.
+static void radix_sort_dedup(std::vector<uint64_t>& a, std::vector<uint64_t>& tmp,
+                             uint64_t base, int bits) {
+  if (a.size() < 256) {
+    std::sort(a.begin(), a.end());
+  } else {
+    tmp.resize(a.size());
+    uint64_t* src = a.data();
+    uint64_t* dst = tmp.data();
+    for (int shift = 0; shift < bits; shift += 8) {
+      size_t count[257] = {0};
+      for (size_t i = 0; i < a.size(); ++i) count[((src[i] - base) >> shift & 0xFF) + 1]++;
+      for (int b = 0; b < 256; ++b) count[b + 1] += count[b];
+      for (size_t i = 0; i < a.size(); ++i) dst[count[(src[i] - base) >> shift & 0xFF]++] = src[i];
+      std::swap(src, dst);
+    }
+    if (src != a.data()) std::memcpy(a.data(), src, a.size() * sizeof(uint64_t));
+  }
+  a.erase(std::unique(a.begin(), a.end()), a.end());
+}
+
+// ---------------- FASTA chunk queue ----------------
+struct SeqChunk {
+  std::string bases;
+  size_t overlap = 0;       // leading bases repeated from the previous chunk of the record
+  bool record_end = false;  // chunk ends its FASTA record
+};
+
+struct ChunkQueue {
+  std::mutex mu;
+  std::condition_variable not_empty, not_full;
+  std::deque<SeqChunk> q;
+  size_t capacity = 8;
+  bool closed = false;
+
+  void push(SeqChunk&& c) {
+    std::unique_lock<std::mutex> lk(mu);
+    not_full.wait(lk, [&] { return q.size() < capacity; });
+    q.push_back(std::move(c));
+    not_empty.notify_one();
+  }
+  bool pop(SeqChunk& c) {
+    std::unique_lock<std::mutex> lk(mu);
+    not_empty.wait(lk, [&] { return !q.empty() || closed; });
+    if (q.empty()) return false;
+    c = std::move(q.front());
+    q.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+  void close() {
+    std::lock_guard<std::mutex> lk(mu);
+    closed = true;
+    not_empty.notify_all();
+  }
+};
+
+// Reverse complement of an A/C/G/T string (either case; output upper case).
+static std::string revcomp(const std::string& s) {
+  std::string r(s.rbegin(), s.rend());
+  for (char& c : r) {
+    switch (c) {
+      case 'A': case 'a': c = 'T'; break;
+      case 'C': case 'c': c = 'G'; break;
+      case 'G': case 'g': c = 'C'; break;
+      default: c = 'A'; break;
+    }
+  }
+  return r;
+}
+
+// Streams every record of a FASTA or FASTQ file as chunks of at most `chunk_bases` bases. Consecutive
+// chunks of one record overlap by k-1 bases so no k-mer is lost at a chunk boundary; k-mers never
+// span two records. With `keep_short`, records shorter than k are still forwarded (their run
+// tails matter for --ends).
+static bool stream_fasta(const std::string& path, int k, size_t chunk_bases, bool keep_short,
+                         ChunkQueue& q, uint64_t& bases_read) {
+  FILE* f = (path == "-") ? stdin : std::fopen(path.c_str(), "rb");
+  if (!f) { std::perror(("open fasta: " + path).c_str()); return false; }
+
+  std::vector<char> buf(1 << 20);
+  SeqChunk cur;
+  cur.bases.reserve(chunk_bases);
+  // FASTQ (first byte '@'): a record is its header line, sequence lines up to the '+' line, then
+  // quality lines until they hold as many characters as the sequence, so quality strings (which
+  // may contain A/C/G/T or start with '@') are never read as bases or headers.
+  enum class Line { Seq, Header, Plus, Qual };
+  Line line = Line::Seq;
+  bool first = true, fastq = false;
+  uint64_t seq_len = 0, qual_len = 0;
+  bool at_line_start = true;
+
+  auto flush = [&](bool record_end) {
+    // An overlap-only chunk at record end carries no new k-mers, but still closes the record's
+    // last run, so it is forwarded when run tails are wanted.
+    const bool has_new = cur.bases.size() > cur.overlap ||
+                         (record_end && keep_short && cur.overlap > 0);
+    if (has_new && ((int)cur.bases.size() >= k || keep_short)) {
+      std::string tail;
+      if (!record_end) tail = cur.bases.substr(cur.bases.size() - (size_t)(k - 1));
+      cur.record_end = record_end;
+      q.push(std::move(cur));
+      cur = SeqChunk();
+      cur.overlap = tail.size();
+      cur.bases = std::move(tail);
+      cur.bases.reserve(chunk_bases);
+    } else if (record_end) {
+      cur.bases.clear();
+      cur.overlap = 0;
+    }
+  };
+
+  size_t n;
+  while ((n = std::fread(buf.data(), 1, buf.size(), f)) > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      const char c = buf[i];
+      if (first && c != '\n' && c != '\r') { fastq = c == '@'; first = false; }
+      if (c == '\n') {
+        if (line == Line::Header) line = Line::Seq;
+        else if (line == Line::Plus) line = Line::Qual;
+        at_line_start = true;
+        continue;
+      }
+      if (at_line_start) {
+        at_line_start = false;
+        if (line == Line::Qual && qual_len >= seq_len) line = Line::Seq;  // record complete
+        if (line == Line::Seq && c == (fastq ? '@' : '>')) {
+          flush(true);
+          line = Line::Header;
+          seq_len = 0;
+        } else if (line == Line::Seq && fastq && c == '+') {
+          line = Line::Plus;
+          qual_len = 0;
+        }
+      }
+      if (c == '\r') continue;
+      if (line != Line::Seq) {
+        if (line == Line::Qual) qual_len++;
+        continue;
+      }
+      cur.bases.push_back(c);
+      seq_len++;
+      bases_read++;
+      if (cur.bases.size() >= chunk_bases) flush(false);
+    }
+  }
+  flush(true);
+  if (f != stdin) std::fclose(f);
+  return true;
+}
+
+// ---------------- Shard accumulators ----------------
+struct ShardAcc {
+  std::mutex mu;
+  roaring64_bitmap_t* bm = nullptr;
+  uint64_t card = 0;
+  unsigned spills = 0;
+};
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+
+  const int k = args.k;
+  const uint64_t total_bits = 1ULL << (2 * k);
+  const unsigned N = (unsigned)std::min<uint64_t>(args.num_shards, total_bits);
+  const uint64_t width = (total_bits + N - 1) / N;
+  int width_bits = 0;
+  while (width_bits < 64 && (1ULL << width_bits) < width) width_bits++;
+  const uint64_t kmask = (k == 32) ? ~0ULL : ((1ULL << (2 * k)) - 1ULL);
+
+  ::mkdir(args.out.c_str(), 0755);
+  ::mkdir(args.tmp.c_str(), 0755);
+
+  // Memory budget: 1/4 for per-thread partition buffers, 1/2 for in-memory accumulators
+  // (estimated at 2 bytes per value, the array-container worst case), the rest for chunks,
+  // radix scratch and finalization.
+  const uint64_t budget = args.mem_mb << 20;
+  const uint64_t part_cap = std::max<uint64_t>(
+      64, std::min<uint64_t>(1 << 16, budget / 4 / ((uint64_t)args.threads * N * sizeof(uint64_t))));
+  const uint64_t acc_limit_card = std::max<uint64_t>(1 << 12, budget / 2 / 2 / N);
+
+  std::vector<ShardAcc> acc(N);
+  std::atomic<uint64_t> kmers_seen(0);
+  std::atomic<uint64_t> spill_count(0);
+  std::atomic<bool> failed(false);
+
+  auto shard_start = [&](unsigned sid) { return (uint64_t)sid * width; };
+  auto shard_end = [&](unsigned sid) { return std::min<uint64_t>(total_bits, (uint64_t)(sid + 1) * width); };
+  auto spill_path = [&](unsigned sid, unsigned run) {
+    char tmp[64];
+    std::snprintf(tmp, sizeof(tmp), "/shard_%04u.run%u.kbit", sid, run);
+    return args.tmp + tmp;
+  };
+
+  // Sort/dedup one partition and merge it into the shard accumulator; spill if over budget.
+  auto flush_partition = [&](unsigned sid, std::vector<uint64_t>& part, std::vector<uint64_t>& scratch) {
+    if (part.empty()) return;
+    radix_sort_dedup(part, scratch, shard_start(sid), width_bits);
+
+    ShardAcc& a = acc[sid];
+    std::lock_guard<std::mutex> lk(a.mu);
+    if (!a.bm) a.bm = roaring64_bitmap_create();
+    roaring64_bitmap_add_many(a.bm, part.size(), part.data());
+    a.card = roaring64_bitmap_get_cardinality(a.bm);
+    part.clear();
+
+    if (a.card > acc_limit_card) {
+      roaring64_bitmap_run_optimize(a.bm);
+      if (!write_kbit_portable(spill_path(sid, a.spills), a.bm, total_bits, (uint64_t)k)) failed = true;
+      a.spills++;
+      spill_count++;
+      roaring64_bitmap_free(a.bm);
+      a.bm = nullptr;
+      a.card = 0;
+    }
+  };
+
+  auto t0 = Clock::now();
+
+  // Run tails for derive_shards: the last min(len, k-1) bases of every ACGT run of length
+  // >= k - ends_depth. Those hold exactly the j-mers (j >= k - ends_depth) that are not a prefix
+  // of any present k-mer. With --both-strands the reverse strand's tails are the reverse
+  // complements of the run heads (first min(len, k-1) bases), which are listed as well.
+  const bool want_ends = !args.ends.empty();
+  const int ends_min_run = std::max(1, k - args.ends_depth);
+  std::mutex ends_mu;
+  std::vector<std::string> run_ends;
+
+  ChunkQueue queue;
+  queue.capacity = (size_t)args.threads * 2;
+
+  std::vector<std::thread> workers;
+  workers.reserve((size_t)args.threads);
+  for (int t = 0; t < args.threads; ++t) {
+    workers.emplace_back([&]() {
+      std::vector<std::vector<uint64_t>> parts(N);
+      std::vector<uint64_t> scratch;
+      std::vector<std::string> local_ends;
+      uint64_t local_seen = 0;
+
+      auto emit = [&](uint64_t v) {
+        const unsigned sid = (unsigned)(v / width);
+        auto& p = parts[sid];
+        if (p.capacity() == 0) p.reserve((size_t)part_cap);
+        p.push_back(v);
+        if (p.size() >= part_cap) flush_partition(sid, p, scratch);
+      };
+
+      SeqChunk chunk;
+      while (queue.pop(chunk)) {
+        uint64_t fw = 0, rc = 0;
+        int valid = 0;
+        const size_t n = chunk.bases.size();
+        for (size_t i = 0; i <= n; ++i) {
+          int d = -1;
+          if (i < n) {
+            switch (chunk.bases[i]) {
+              case 'A': case 'a': d = 0; break;
+              case 'C': case 'c': d = 1; break;
+              case 'G': case 'g': d = 2; break;
+              case 'T': case 't': d = 3; break;
+              default: break;
+            }
+          }
+          if (d < 0) {
+            // End of an ACGT run. Each run end is reported by exactly one chunk: the one in which
+            // it lies past the overlap prefix (or, at i == n, the chunk that closes the record).
+            if (want_ends && valid >= ends_min_run && i >= chunk.overlap && (i < n || chunk.record_end)) {
+              const size_t t = (size_t)std::min(valid, k - 1);
+              local_ends.push_back(chunk.bases.substr(i - t, t));
+              // A run shorter than k-1 is its own head.
+              if (args.both_strands && valid < k - 1) local_ends.push_back(revcomp(local_ends.back()));
+            }
+            valid = 0; fw = 0; rc = 0;
+            continue;
+          }
+          fw = ((fw << 2) | (uint64_t)d) & kmask;
+          rc = (rc >> 2) | ((uint64_t)(3 - d) << (2 * (k - 1)));
+          ++valid;
+          // The head of a run is reported by the chunk in which its (k-1)-th base lies past the
+          // overlap prefix; a run continuing from the previous chunk completes it inside the overlap.
+          if (want_ends && args.both_strands && valid == k - 1 && i >= chunk.overlap) {
+            local_ends.push_back(revcomp(chunk.bases.substr(i + 2 - (size_t)k, (size_t)k - 1)));
+          }
+          if (valid < k) continue;
+          emit(fw);
+          if (args.both_strands) emit(rc);
+          local_seen++;
+        }
+      }
+
+      for (unsigned sid = 0; sid < N; ++sid) flush_partition(sid, parts[sid], scratch);
+      kmers_seen += local_seen;
+      if (want_ends) {
+        std::lock_guard<std::mutex> lk(ends_mu);
+        for (auto& e : local_ends) run_ends.push_back(std::move(e));
+      }
+    });
+  }
+
+  uint64_t bases_read = 0;
+  const size_t chunk_bases = 4u << 20;
+  bool input_ok = true;
+  for (const auto& path : args.fasta) {
+    if (!stream_fasta(path, k, chunk_bases, want_ends, queue, bases_read)) { input_ok = false; break; }
+  }
+  queue.close();
+  for (auto& th : workers) th.join();
+  auto t1 = Clock::now();
+
+  if (!input_ok || failed) {
+    for (auto& a : acc) if (a.bm) roaring64_bitmap_free(a.bm);
+    return 2;
+  }
+
+  // Finalize shards: merge spilled runs, run-optimize, write, and compute absent GC histograms.
+  std::vector<uint64_t> ones(N, 0);
+  std::vector<std::vector<uint64_t>> gc_hists(N);
+  std::atomic<unsigned> next_shard(0);
+  std::vector<std::thread> pool;
+  for (int t = 0; t < args.threads; ++t) {
+    pool.emplace_back([&]() {
+      std::vector<uint64_t> batch(1 << 16);
+      while (true) {
+        const unsigned sid = next_shard.fetch_add(1);
+        if (sid >= N) break;
+
+        ShardAcc& a = acc[sid];
+        roaring64_bitmap_t* bm = a.bm ? a.bm : roaring64_bitmap_create();
+        a.bm = nullptr;
+        for (unsigned r = 0; r < a.spills; ++r) {
+          const std::string run = spill_path(sid, r);
+          roaring64_bitmap_t* part = load_kbit_portable(run);
+          if (!part) { failed = true; continue; }
+          roaring64_bitmap_or_inplace(bm, part);
+          roaring64_bitmap_free(part);
+          std::remove(run.c_str());
+        }
+        roaring64_bitmap_run_optimize(bm);
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "/shard_%04u.kbit", sid);
+        if (!write_kbit_portable(args.out + name, bm, total_bits, (uint64_t)k)) failed = true;
+
+        std::vector<uint64_t> h = range_gc_hist(shard_start(sid), shard_end(sid), k);
+        roaring64_iterator_t* it = roaring64_iterator_create(bm);
+        uint64_t got;
+        while ((got = roaring64_iterator_read(it, batch.data(), batch.size())) > 0) {
+          for (uint64_t i = 0; i < got; ++i) h[(size_t)gc_count(batch[i], k)]--;
+        }
+        roaring64_iterator_free(it);
+
+        ones[sid] = roaring64_bitmap_get_cardinality(bm);
+        gc_hists[sid] = std::move(h);
+        roaring64_bitmap_free(bm);
+      }
+    });
+  }
+  for (auto& th : pool) th.join();
+  ::rmdir(args.tmp.c_str());
+  if (failed) return 2;
+
+  // index.json: one shard object per line (parsed line-by-line by the query tools).
+  {
+    std::ofstream idx(args.out + "/index.json", std::ios::trunc);
+    if (!idx) { std::perror("open index.json"); return 2; }
+    idx << "{\n";
+    idx << "  \"k\": " << k << ",\n";
+    idx << "  \"num_shards\": " << N << ",\n";
+    idx << "  \"total_bits\": " << total_bits << ",\n";
+    if (args.both_strands) idx << "  \"both_strands\": true,\n";
+    idx << "  \"shards\": [\n";
+    for (unsigned sid = 0; sid < N; ++sid) {
+      char name[64];
+      std::snprintf(name, sizeof(name), "shard_%04u.kbit", sid);
+      idx << "    {\"file\": \"" << name << "\", \"start\": " << shard_start(sid)
+          << ", \"end\": " << shard_end(sid) << ", \"ones\": " << ones[sid] << "}"
+          << (sid + 1 < N ? "," : "") << "\n";
+    }
+    idx << "  ]\n}\n";
+  }
+
+  if (!args.gc_hist.empty()) {
+    std::ofstream gh(args.gc_hist, std::ios::trunc);
+    if (!gh) { std::perror("open gc-hist"); return 2; }
+    gh << format_gc_hist_json(k, gc_hists);
+  }
+  if (want_ends) {
+    std::sort(run_ends.begin(), run_ends.end());
+    run_ends.erase(std::unique(run_ends.begin(), run_ends.end()), run_ends.end());
+    std::ofstream ends(args.ends, std::ios::trunc);
+    if (!ends) { std::perror("open ends"); return 2; }
+    // Header read by derive_shards: which k, depth and strands the list covers.
+    ends << "#ends k=" << k << " depth=" << args.ends_depth << " both_strands=" << (args.both_strands ? 1 : 0) << "\n";
+    for (const auto& e : run_ends) ends << e << "\n";
+  }
+  auto t2 = Clock::now();
+
+  uint64_t total_ones = 0;
+  for (uint64_t o : ones) total_ones += o;
+
+  long pk = peak_rss_kb();
+  std::cerr << std::fixed << std::setprecision(6);
+  std::cerr << "[INFO] Output dir           : " << args.out << "\n";
+  std::cerr << "[INFO] k / shards           : " << k << " / " << N << "\n";
+  std::cerr << "[INFO] Threads              : " << args.threads << "\n";
+  std::cerr << "[INFO] Memory budget        : " << args.mem_mb << " MB\n";
+  std::cerr << "[INFO] Partition capacity   : " << part_cap << "\n";
+  std::cerr << "[INFO] Bases read           : " << bases_read << "\n";
+  std::cerr << "[INFO] K-mers seen          : " << kmers_seen.load() << "\n";
+  std::cerr << "[INFO] Distinct present     : " << total_ones << "\n";
+  std::cerr << "[INFO] Spilled runs         : " << spill_count.load() << "\n";
+  if (want_ends) std::cerr << "[INFO] Run tails written    : " << run_ends.size() << "\n";
+  std::cerr << "[INFO] Scan time            : " << std::chrono::duration_cast<Sec>(t1 - t0).count() << " s\n";
+  std::cerr << "[INFO] Finalize time        : " << std::chrono::duration_cast<Sec>(t2 - t1).count() << " s\n";
+  std::cerr << "[INFO] Peak RSS             : " << pk << " KB (" << (pk / 1024.0) << " MB)\n";
+  return 0;
+}
@@ -0,0 +1,266 @@
+// build_mmer_index.cpp
+// Offline m-mer chunk index for substring queries over a shard set.
+//
+// The k-mer space is cut into chunks of 2^--chunk-bits consecutive values. For every m-mer x
+// (m <= 8) the index stores the chunk ids holding at least one ABSENT k-mer that contains x, as a
+// roaring64 bitmap. query_substring_bitmap_stream intersects the bitmaps of the substring's
+// m-mers (union over the m-mers extending it when it is shorter than m, and the same for the
+// reverse complement), then scans only candidate chunks and skips shards with none.
+//
+// Chunks with more than --max-sparse absent values are not enumerated: they go to a "dense"
+// bitmap that every query treats as a candidate. In mostly-absent regions (large k) nearly every
+// m-mer occurs in such a chunk anyway, so the index pays off where absent k-mers are rare: small
+// k, or regions saturated by the genomes. Adding genomes (add_genome_delta) only removes absent
+// k-mers, so an older index stays a valid superset; rebuild it to regain selectivity. The index is
+// registered by re-reading index.json under <shards>/index.json.lock (see add_genome_delta).
+//
+// Output: <shards>/mmer_index.kmi, registered in index.json as  "mmer_index": "mmer_index.kmi"
+//   "KMIDXv1\0" | k u64 | m u64 | chunk_bits u64 | max_sparse u64 | n = 4^m + 1 (u64) |
+//   n+1 u64 file offsets | n portable roaring64 bitmaps (m-mers in 2-bit order, then "dense")
+//
+// Compile:
+//   g++ -O3 -march=native -std=c++17 -pthread build_mmer_index.cpp -lroaring -lzstd -o build_mmer_index
+//
+// Example:
+//   ./build_mmer_index --shards shards_12 --m 6 --threads 16
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
+
+using Clock = std::chrono::steady_clock;
+using Sec   = std::chrono::duration<double>;
+
+static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return r.ru_maxrss; }
+
+static const char* INDEX_NAME = "mmer_index.kmi";
+
+struct Args {
+  std::string shards;
+  int m = 8;
+  int chunk_bits = 16;
+  uint64_t max_sparse = 4096;  // chunks with more absent values are marked dense
+  int threads = 4;
+};
+
+static void usage(const char* prog) {
+  std::cerr << "Usage: " << prog
+            << " --shards <dir> [--m 1..8] [--chunk-bits B] [--max-sparse N] [--threads N]\n";
+}
+
+static bool parse_args(int argc, char** argv, Args& a) {
+  for (int i = 1; i < argc; ++i) {
+    std::string s(argv[i]);
+    if (s == "--shards" && i + 1 < argc) a.shards = argv[++i];
+    else if (s == "--m" && i + 1 < argc) a.m = std::atoi(argv[++i]);
+    else if (s == "--chunk-bits" && i + 1 < argc) a.chunk_bits = std::atoi(argv[++i]);
+    else if (s == "--max-sparse" && i + 1 < argc) a.max_sparse = std::strtoull(argv[++i], nullptr, 10);
+    else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
+  }
+  if (a.shards.empty()) { std::cerr << "Error: --shards is required\n"; return false; }
+  if (a.m < 1 || a.m > 8) { std::cerr << "Error: --m must be 1..8\n"; return false; }
+  if (a.chunk_bits < 6 || a.chunk_bits > 32) { std::cerr << "Error: --chunk-bits must be 6..32\n"; return false; }
+  return true;
+}
+
+// ---------------- KMIDXv1 ----------------
+static inline void push_le64(std::string& b, uint64_t x) {
+  for (int i = 0; i < 8; ++i) b.push_back((char)((x >> (8 * i)) & 0xFF));
+}
+
+// ---------------- Chunk scan ----------------
+// Per-thread chunk lists: lists[x] collects the chunk ids whose absent k-mers contain m-mer x.
+struct ChunkLists {
+  std::vector<std::vector<uint64_t>> lists;
+  std::vector<uint64_t> dense;
+  std::vector<uint8_t> seen;
+  std::vector<uint32_t> touched;
+  uint64_t sparse_chunks = 0;
+};
+
+static void index_shard(const roaring64_bitmap_t* bm, uint64_t start, uint64_t end, int k, int m,
+                        int chunk_bits, uint64_t max_sparse, ChunkLists& out) {
+  if (end <= start) return;
+  const uint64_t mmask = (1ULL << (2 * m)) - 1ULL;
+  const int positions = k - m + 1;
+  std::vector<uint64_t> present;
+  for (uint64_t c = start >> chunk_bits; c <= (end - 1) >> chunk_bits; ++c) {
+    const uint64_t lo = std::max(start, c << chunk_bits);
+    const uint64_t hi = std::min(end, (c + 1) << chunk_bits);
+    const uint64_t absent = (hi - lo) - roaring64_bitmap_range_cardinality(bm, lo, hi);
+    if (absent == 0) continue;
+    if (absent > max_sparse) { out.dense.push_back(c); continue; }
+    out.sparse_chunks++;
+
+    // Present values of the chunk; the gaps between them are the absent k-mers.
+    present.clear();
+    roaring64_iterator_t* it = roaring64_iterator_create(bm);
+    if (roaring64_iterator_move_equalorlarger(it, lo)) {
+      while (roaring64_iterator_has_value(it)) {
+        const uint64_t v = roaring64_iterator_value(it);
+        if (v >= hi) break;
+        present.push_back(v);
+        roaring64_iterator_advance(it);
+      }
+    }
+    roaring64_iterator_free(it);
+    present.push_back(hi);
+
+    uint64_t v = lo;
+    for (uint64_t p : present) {
+      for (; v < p; ++v) {
+        for (int pos = 0; pos < positions; ++pos) {
+          const uint32_t x = (uint32_t)((v >> (2 * pos)) & mmask);
+          if (!out.seen[x]) { out.seen[x] = 1; out.touched.push_back(x); }
+        }
+      }
+      v = p + 1;
+    }
+    for (uint32_t x : out.touched) { out.lists[x].push_back(c); out.seen[x] = 0; }
+    out.touched.clear();
+  }
+}
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+
+  uint64_t k_index = 0;
+  std::vector<ShardInfo> shards;
+  IndexLines index;
+  if (!read_index_shards(args.shards, k_index, shards, &index)) {
+    std::cerr << "Error: failed to read shards index: " << args.shards << "/index.json\n";
+    return 2;
+  }
+  const int k = (int)k_index;
+  if (k < args.m || k > 31) { std::cerr << "Error: need m <= k <= 31 (k=" << k << ")\n"; return 2; }
+  const size_t N = shards.size();
+  const size_t num_mmers = (size_t)1 << (2 * args.m);
+
+  auto t0 = Clock::now();
+  const int T = std::min<int>(args.threads, (int)N);
+  std::vector<ChunkLists> per_thread((size_t)T);
+  std::atomic<size_t> next_shard(0);
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> pool;
+  for (int t = 0; t < T; ++t) {
+    pool.emplace_back([&, t]() {
+      ChunkLists& cl = per_thread[(size_t)t];
+      cl.lists.resize(num_mmers);
+      cl.seen.assign(num_mmers, 0);
+      while (true) {
+        const size_t sid = next_shard.fetch_add(1);
+        if (sid >= N || failed) break;
+        roaring64_bitmap_t* bm = load_kbit_portable(args.shards + "/" + shards[sid].file);
+        if (!bm) { failed = true; break; }
+        for (const auto& d : shards[sid].deltas) {
+          roaring64_bitmap_t* layer = load_kbit_portable(args.shards + "/" + d);
+          if (!layer) { failed = true; break; }
+          roaring64_bitmap_or_inplace(bm, layer);
+          roaring64_bitmap_free(layer);
+        }
+        if (!failed) {
+          index_shard(bm, shards[sid].start, shards[sid].end, k, args.m, args.chunk_bits, args.max_sparse, cl);
+        }
+        roaring64_bitmap_free(bm);
+      }
+    });
+  }
+  for (auto& th : pool) th.join();
+  if (failed) return 2;
+  auto t1 = Clock::now();
+
+  // Merge the per-thread lists into one bitmap per m-mer (plus "dense") and serialize.
+  std::string body;
+  std::vector<uint64_t> offsets;
+  offsets.reserve(num_mmers + 2);
+  uint64_t sparse_chunks = 0, dense_chunks = 0, entries = 0;
+  for (const auto& cl : per_thread) { sparse_chunks += cl.sparse_chunks; dense_chunks += cl.dense.size(); }
+  const uint64_t data_start = 8 + 5 * 8 + (uint64_t)(num_mmers + 2) * 8;
+  std::vector<char> blob;
+  for (size_t x = 0; x <= num_mmers; ++x) {
+    roaring64_bitmap_t* bm = roaring64_bitmap_create();
+    for (auto& cl : per_thread) {
+      auto& v = (x < num_mmers) ? cl.lists[x] : cl.dense;
+      roaring64_bitmap_add_many(bm, v.size(), v.data());
+      entries += v.size();
+      std::vector<uint64_t>().swap(v);
+    }
+    roaring64_bitmap_run_optimize(bm);
+    blob.resize(roaring64_bitmap_portable_size_in_bytes(bm));
+    roaring64_bitmap_portable_serialize(bm, blob.data());
+    roaring64_bitmap_free(bm);
+    offsets.push_back(data_start + body.size());
+    body.append(blob.data(), blob.size());
+  }
+  offsets.push_back(data_start + body.size());
+
+  std::string out;
+  out.reserve((size_t)data_start + body.size());
+  out.append("KMIDXv1\0", 8);
+  push_le64(out, (uint64_t)k);
+  push_le64(out, (uint64_t)args.m);
+  push_le64(out, (uint64_t)args.chunk_bits);
+  push_le64(out, args.max_sparse);
+  push_le64(out, (uint64_t)num_mmers + 1);
+  for (uint64_t o : offsets) push_le64(out, o);
+  out += body;
+  if (!write_file_atomic(args.shards + "/" + INDEX_NAME, out)) return 2;
+
+  // Register the index in index.json (top-level, before "shards"), re-read under the lock.
+  const int lock_fd = lock_index(args.shards);
+  if (lock_fd < 0) return 2;
+  if (!read_index_shards(args.shards, k_index, shards, &index)) {
+    std::cerr << "Error: failed to re-read shards index: " << args.shards << "/index.json\n";
+    return 2;
+  }
+  bool registered = false;
+  for (const auto& l : index.lines) if (l.find("\"mmer_index\"") != std::string::npos) registered = true;
+  if (!registered) {
+    auto it = std::find_if(index.lines.begin(), index.lines.end(),
+                           [](const std::string& l) { return l.find("\"shards\"") != std::string::npos; });
+    if (it == index.lines.end()) { std::cerr << "Error: no \"shards\" array in index.json\n"; return 2; }
+    index.lines.insert(it, std::string("  \"mmer_index\": \"") + INDEX_NAME + "\",");
+    std::string idx;
+    for (const auto& l : index.lines) { idx += l; idx += '\n'; }
+    if (!write_file_atomic(args.shards + "/index.json", idx)) return 2;
+  }
+  ::close(lock_fd);
+  auto t2 = Clock::now();
+
+  long pk = peak_rss_kb();
+  std::cerr << std::fixed << std::setprecision(6);
+  std::cerr << "[INFO] Shards dir           : " << args.shards << "\n";
+  std::cerr << "[INFO] k / m / chunk bits   : " << k << " / " << args.m << " / " << args.chunk_bits << "\n";
+  std::cerr << "[INFO] Threads              : " << T << "\n";
+  std::cerr << "[INFO] Sparse chunks        : " << sparse_chunks << "\n";
+  std::cerr << "[INFO] Dense chunks         : " << dense_chunks << "\n";
+  std::cerr << "[INFO] Chunk entries        : " << entries << "\n";
+  std::cerr << "[INFO] Index bytes          : " << out.size() << "\n";
+  std::cerr << "[INFO] Scan time            : " << std::chrono::duration_cast<Sec>(t1 - t0).count() << " s\n";
+  std::cerr << "[INFO] Write time           : " << std::chrono::duration_cast<Sec>(t2 - t1).count() << " s\n";
+  std::cerr << "[INFO] Peak RSS             : " << pk << " KB (" << (pk / 1024.0) << " MB)\n";
+  return 0;
+}
@@ -0,0 +1,231 @@
+// compact_shard_layers.cpp
+// Fold the delta layers written by add_genome_delta back into the base shard files.
+//
+// For each shard with "deltas" in index.json: load the base shard, OR every delta layer into it,
+// run_optimize, and write the base file back (tmp + rename). Once all shards are done, index.json
+// is re-read and rewritten under <shards>/index.json.lock (the lock add_genome_delta holds while
+// it runs): only the delta names that were merged are dropped and "ones" is updated, so layers or
+// sources registered while compaction ran are kept. The merged delta files are removed after
+// --grace-sec so queries that already read the old index can finish, again under the lock, so an
+// add_genome_delta run that still lists them in its snapshot is not cut short.
+//
+// The merged bitmap is identical to what the query tools compute on the fly, and the absent GC
+// histograms were already patched when the deltas were added, so they need no update here.
+// Meant to run in the background: --threads defaults to 1 and --nice lowers the CPU priority.
+//
+// Compile:
+//   g++ -O3 -march=native -std=c++17 -pthread compact_shard_layers.cpp -lroaring -lzstd -o compact_shard_layers
+//
+// Example:
+//   ./compact_shard_layers --shards shards_18 --threads 2 --nice 19
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
+
+using Clock = std::chrono::steady_clock;
+using Sec   = std::chrono::duration<double>;
+
+static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return r.ru_maxrss; }
+
+struct Args {
+  std::string shards;
+  int threads = 1;
+  int nice = 10;
+  int grace_sec = 300;  // delay before deleting merged delta files
+};
+
+static void usage(const char* prog) {
+  std::cerr << "Usage: " << prog
+            << " --shards <dir> [--threads N] [--nice N] [--grace-sec S]\n";
+}
+
+static bool parse_args(int argc, char** argv, Args& a) {
+  for (int i = 1; i < argc; ++i) {
+    std::string s(argv[i]);
+    if (s == "--shards" && i + 1 < argc) a.shards = argv[++i];
+    else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else if (s == "--nice" && i + 1 < argc) a.nice = std::atoi(argv[++i]);
+    else if (s == "--grace-sec" && i + 1 < argc) a.grace_sec = std::max(0, std::atoi(argv[++i]));
+    else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
+  }
+  if (a.shards.empty()) {
+    std::cerr << "Error: --shards is required\n";
+    return false;
+  }
+  return true;
+}
+
+// ---------------- index.json (kept as lines; shard lines are edited in place) ----------------
+// Drops the merged delta names from a shard line's "deltas" field (the whole field once none is
+// left) and rewrites its "ones" count.
+static void compact_line(std::string& line, const std::vector<std::string>& merged, uint64_t ones) {
+  auto key = line.find("\"deltas\"");
+  if (key != std::string::npos) {
+    std::vector<std::string> kept;
+    parse_string_array_field(line, "\"deltas\"", kept);
+    kept.erase(std::remove_if(kept.begin(), kept.end(), [&](const std::string& d) {
+                 return std::find(merged.begin(), merged.end(), d) != merged.end();
+               }), kept.end());
+    auto rb = line.find(']', key);
+    if (kept.empty()) {
+      size_t from = key;
+      auto comma = line.rfind(',', key);
+      if (comma != std::string::npos && line.find_first_not_of(" \t", comma + 1) == key) from = comma;
+      line.erase(from, rb + 1 - from);
+    } else {
+      auto lb = line.find('[', key);
+      std::string list;
+      for (const auto& d : kept) list += (list.empty() ? "\"" : ", \"") + d + "\"";
+      line.replace(lb + 1, rb - lb - 1, list);
+    }
+  }
+  auto op = line.find("\"ones\"");
+  if (op == std::string::npos) return;
+  auto p = line.find(':', op);
+  if (p == std::string::npos) return;
+  p++;
+  while (p < line.size() && (line[p] == ' ' || line[p] == '\t')) p++;
+  auto e = line.find_first_of(",}", p);
+  if (e == std::string::npos) return;
+  line.replace(p, e - p, std::to_string(ones));
+}
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+  if (args.nice > 0 && ::nice(args.nice) == -1) std::perror("nice");
+
+  IndexLines index;
+  uint64_t k = 0;
+  std::vector<ShardInfo> shards;
+  if (!read_index_lines(args.shards, index, k, shards)) {
+    std::cerr << "Error: failed to read shards index: " << args.shards << "/index.json\n";
+    return 2;
+  }
+  const uint64_t total_bits = 1ULL << (2 * k);
+
+  std::vector<size_t> todo;
+  for (size_t i = 0; i < shards.size(); ++i) if (!shards[i].deltas.empty()) todo.push_back(i);
+  if (todo.empty()) {
+    std::cerr << "[INFO] No delta layers to compact in " << args.shards << "\n";
+    return 0;
+  }
+
+  auto t0 = Clock::now();
+  std::atomic<size_t> next(0);
+  std::atomic<uint64_t> merged_layers(0);
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> pool;
+  for (int t = 0; t < args.threads; ++t) {
+    pool.emplace_back([&]() {
+      while (true) {
+        const size_t j = next.fetch_add(1);
+        if (j >= todo.size() || failed) break;
+        ShardInfo& si = shards[todo[j]];
+        roaring64_bitmap_t* base = load_kbit_portable(args.shards + "/" + si.file);
+        if (!base) { failed = true; break; }
+        for (const auto& d : si.deltas) {
+          roaring64_bitmap_t* layer = load_kbit_portable(args.shards + "/" + d);
+          if (!layer) { failed = true; break; }
+          roaring64_bitmap_or_inplace(base, layer);
+          roaring64_bitmap_free(layer);
+          merged_layers++;
+        }
+        if (!failed) {
+          roaring64_bitmap_run_optimize(base);
+          si.ones = roaring64_bitmap_get_cardinality(base);
+          if (!write_kbit_portable(args.shards + "/" + si.file, base, total_bits, k)) failed = true;
+        }
+        roaring64_bitmap_free(base);
+      }
+    });
+  }
+  for (auto& th : pool) th.join();
+  // A failure leaves index.json untouched: rewritten base files are supersets of the old ones and
+  // ORing the still-registered deltas over them is a no-op, so the set stays consistent.
+  if (failed) return 2;
+
+  const int lock_fd = lock_index(args.shards);
+  if (lock_fd < 0) return 2;
+  {
+    // Re-read under the lock: add_genome_delta may have registered layers or sources meanwhile.
+    IndexLines now_index;
+    uint64_t k_now = 0;
+    std::vector<ShardInfo> now;
+    if (!read_index_lines(args.shards, now_index, k_now, now) || k_now != k) {
+      std::cerr << "Error: failed to re-read shards index: " << args.shards << "/index.json\n";
+      ::close(lock_fd);
+      return 2;
+    }
+    for (size_t i : todo) {
+      auto it = std::find_if(now.begin(), now.end(),
+                             [&](const ShardInfo& n) { return n.file == shards[i].file; });
+      if (it != now.end()) compact_line(now_index.lines[it->line_no], shards[i].deltas, shards[i].ones);
+    }
+    index.lines.swap(now_index.lines);
+  }
+  {
+    std::string out;
+    for (const auto& l : index.lines) { out += l; out += '\n'; }
+    if (!write_file_atomic(args.shards + "/index.json", out)) { ::close(lock_fd); return 2; }
+  }
+  ::close(lock_fd);
+  auto t1 = Clock::now();
+
+  if (args.grace_sec > 0) std::this_thread::sleep_for(std::chrono::seconds(args.grace_sec));
+  const int remove_fd = lock_index(args.shards);
+  if (remove_fd < 0) return 2;
+  // A layer registered again since the rewrite (same name reused) is live: leave it in place.
+  std::set<std::string> live;
+  {
+    IndexLines now_index;
+    uint64_t k_now = 0;
+    std::vector<ShardInfo> now;
+    if (read_index_lines(args.shards, now_index, k_now, now)) {
+      for (const auto& n : now) live.insert(n.deltas.begin(), n.deltas.end());
+    }
+  }
+  std::set<std::string> layer_dirs;
+  for (size_t i : todo) {
+    for (const auto& d : shards[i].deltas) {
+      if (live.count(d)) continue;
+      std::remove((args.shards + "/" + d).c_str());
+      auto slash = d.rfind('/');
+      if (slash != std::string::npos) layer_dirs.insert(d.substr(0, slash));
+    }
+  }
+  for (const auto& d : layer_dirs) ::rmdir((args.shards + "/" + d).c_str());  // only if now empty
+  ::close(remove_fd);
+
+  long pk = peak_rss_kb();
+  std::cerr << std::fixed << std::setprecision(6);
+  std::cerr << "[INFO] Shards dir        : " << args.shards << " (k=" << k << ")\n";
+  std::cerr << "[INFO] Shards compacted  : " << todo.size() << "\n";
+  std::cerr << "[INFO] Layers merged     : " << merged_layers.load() << "\n";
+  std::cerr << "[INFO] Compaction time   : " << std::chrono::duration_cast<Sec>(t1 - t0).count() << " s\n";
+  std::cerr << "[INFO] Peak RSS          : " << pk << " KB (" << (pk / 1024.0) << " MB)\n";
+  return 0;
+}
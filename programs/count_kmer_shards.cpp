@@ -0,0 +1,453 @@
+// count_kmer_shards.cpp
+// Occurrence-count layer for an existing shard set.
+//
+// For every shard, writes shard_XXXX.kcnt next to the .kbit file: one saturating 8-bit count per
+// PRESENT k-mer, indexed by its rank in the shard bitmap (base OR delta layers), so the layer
+// adds one byte per present k-mer and needs no second copy of the keys:
+//   "KCNTv1\0\0" | n (u64, = shard cardinality) | width (u64, = 8) | max (u64, = 255) | n bytes
+// and records it on the shard's index.json line as  "counts": "shard_XXXX.kcnt".
+//
+// The FASTA input is k-merized like build_kmer_shards (rolling 2-bit encoder, per-thread
+// per-shard partitions, radix sort); equal ids are run-length counted before they are added to
+// the shard's count array. Shards are processed in groups whose count arrays fit in --mem-mb,
+// re-reading the FASTA once per group. K-mers missing from the shard set are ignored (counted in
+// the stats): count the same genomes the shards were built from.
+//
+// Thresholds are applied at query time (query_kmer_bitmap --counts/--min-count/--max-count,
+// query_substring_bitmap_stream --min-count/--max-count). A count layer is tied to the shard
+// cardinality it was built for; after add_genome_delta, rerun this tool for the touched shards.
+// index.json is re-read and rewritten under <shards>/index.json.lock (see add_genome_delta), so
+// layers registered while counting ran are not lost.
+//
+// Compile:
+//   g++ -O3 -march=native -std=c++17 -pthread count_kmer_shards.cpp -lroaring -lzstd -o count_kmer_shards
+//
+// Example:
+//   ./count_kmer_shards --shards shards_18 --fasta hg38.fa --fasta chm13.fa
+//     --threads 32 --mem-mb 16384
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
+
+using Clock = std::chrono::steady_clock;
+using Sec   = std::chrono::duration<double>;
+
+static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return r.ru_maxrss; }
+
+struct Args {
+  std::string shards;
+  std::vector<std::string> fasta;
+  int threads = 4;
+  uint64_t mem_mb = 4096;     // count arrays held per FASTA pass
+  bool both_strands = false;  // count reverse-complement k-mers too (match the build)
+};
+
+static void usage(const char* prog) {
+  std::cerr << "Usage: " << prog
+            << " --shards <dir> --fasta <file> [--fasta <file> ...]"
+            << " [--threads N] [--mem-mb M] [--both-strands]\n";
+}
+
+static bool parse_args(int argc, char** argv, Args& a) {
+  for (int i = 1; i < argc; ++i) {
+    std::string s(argv[i]);
+    if (s == "--shards" && i + 1 < argc) a.shards = argv[++i];
+    else if (s == "--fasta" && i + 1 < argc) a.fasta.push_back(argv[++i]);
+    else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else if (s == "--mem-mb" && i + 1 < argc) a.mem_mb = std::max<uint64_t>(16, std::strtoull(argv[++i], nullptr, 10));
+    else if (s == "--both-strands") a.both_strands = true;
+    else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
+  }
+  if (a.shards.empty() || a.fasta.empty()) {
+    std::cerr << "Error: --shards and --fasta are required\n";
+    return false;
+  }
+  return true;
+}
+
+// ---------------- index.json (kept as lines; shard lines are edited in place) ----------------
+// Index of the shard whose [start, end) holds idx, or -1.
+static int find_shard(const std::vector<ShardInfo>& shards, uint64_t idx) {
+  size_t lo = 0;
+  size_t hi = shards.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const auto& s = shards[mid];
+    if (idx < s.start) hi = mid;
+    else if (idx >= s.end) lo = mid + 1;
+    else return (int)mid;
+  }
+  return -1;
+}
+
+// Sets (or replaces) the shard line's "counts" field.
+static void set_counts_on_line(std::string& line, const std::string& file) {
+  auto key = line.find("\"counts\"");
+  if (key != std::string::npos) {
+    auto q1 = line.find('"', line.find(':', key));
+    auto q2 = line.find('"', q1 + 1);
+    line.replace(q1 + 1, q2 - q1 - 1, file);
+    return;
+  }
+  auto close = line.rfind('}');
+  if (close == std::string::npos) return;
+  line.insert(close, ", \"counts\": \"" + file + "\"");
+}
+
+static bool write_kcnt(const std::string& path, const std::vector<uint8_t>& counts) {
+  std::string data(32, '\0');
+  std::memcpy(&data[0], "KCNTv1\0", 8);
+  write_le64((unsigned char*)&data[8], counts.size());
+  write_le64((unsigned char*)&data[16], 8);
+  write_le64((unsigned char*)&data[24], 255);
+  data.append((const char*)counts.data(), counts.size());
+  return write_file_atomic(path, data);
+}
+
+// ---------------- Radix sort (build_kmer_shards' radix_sort_dedup, duplicates kept) ----------------
+static void radix_sort_keep(std::vector<uint64_t>& a, std::vector<uint64_t>& tmp,
+                             uint64_t base, int bits) {
+  if (a.size() < 256) {
+    std::sort(a.begin(), a.end());
+  } else {
+    tmp.resize(a.size());
+    uint64_t* src = a.data();
+    uint64_t* dst = tmp.data();
+    for (int shift = 0; shift < bits; shift += 8) {
+      size_t count[257] = {0};
+      for (size_t i = 0; i < a.size(); ++i) count[((src[i] - base) >> shift & 0xFF) + 1]++;
+      for (int b = 0; b < 256; ++b) count[b + 1] += count[b];
+      for (size_t i = 0; i < a.size(); ++i) dst[count[(src[i] - base) >> shift & 0xFF]++] = src[i];
+      std::swap(src, dst);
+    }
+    if (src != a.data()) std::memcpy(a.data(), src, a.size() * sizeof(uint64_t));
+  }
+}
+
+// ---------------- FASTA chunk queue (same as build_kmer_shards) ----------------
+struct SeqChunk {
+  std::string bases;
+};
+
+struct ChunkQueue {
+  std::mutex mu;
+  std::condition_variable not_empty, not_full;
+  std::deque<SeqChunk> q;
+  size_t capacity = 8;
+  bool closed = false;
+
+  void push(SeqChunk&& c) {
+    std::unique_lock<std::mutex> lk(mu);
+    not_full.wait(lk, [&] { return q.size() < capacity; });
+    q.push_back(std::move(c));
+    not_empty.notify_one();
+  }
+  bool pop(SeqChunk& c) {
+    std::unique_lock<std::mutex> lk(mu);
+    not_empty.wait(lk, [&] { return !q.empty() || closed; });
+    if (q.empty()) return false;
+    c = std::move(q.front());
+    q.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+  void close() {
+    std::lock_guard<std::mutex> lk(mu);
+    closed = true;
+    not_empty.notify_all();
+  }
+};
+
+static bool stream_fasta(const std::string& path, int k, size_t chunk_bases, ChunkQueue& q,
+                         uint64_t& bases_read) {
+  FILE* f = (path == "-") ? stdin : std::fopen(path.c_str(), "rb");
+  if (!f) { std::perror(("open fasta: " + path).c_str()); return false; }
+
+  std::vector<char> buf(1 << 20);
+  SeqChunk cur;
+  cur.bases.reserve(chunk_bases);
+  size_t overlap = 0;
+  // FASTQ (first byte '@'): a record is its header line, sequence lines up to the '+' line, then
+  // quality lines until they hold as many characters as the sequence, so quality strings (which
+  // may contain A/C/G/T or start with '@') are never read as bases or headers.
+  enum class Line { Seq, Header, Plus, Qual };
+  Line line = Line::Seq;
+  bool first = true, fastq = false;
+  uint64_t seq_len = 0, qual_len = 0;
+  bool at_line_start = true;
+
+  auto flush = [&](bool record_end) {
+    if (cur.bases.size() > overlap && (int)cur.bases.size() >= k) {
+      std::string tail;
+      if (!record_end) tail = cur.bases.substr(cur.bases.size() - (size_t)(k - 1));
+      q.push(std::move(cur));
+      cur = SeqChunk();
+      overlap = tail.size();
+      cur.bases = std::move(tail);
+      cur.bases.reserve(chunk_bases);
+    } else if (record_end) {
+      cur.bases.clear();
+      overlap = 0;
+    }
+  };
+
+  size_t n;
+  while ((n = std::fread(buf.data(), 1, buf.size(), f)) > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      const char c = buf[i];
+      if (first && c != '\n' && c != '\r') { fastq = c == '@'; first = false; }
+      if (c == '\n') {
+        if (line == Line::Header) line = Line::Seq;
+        else if (line == Line::Plus) line = Line::Qual;
+        at_line_start = true;
+        continue;
+      }
+      if (at_line_start) {
+        at_line_start = false;
+        if (line == Line::Qual && qual_len >= seq_len) line = Line::Seq;  // record complete
+        if (line == Line::Seq && c == (fastq ? '@' : '>')) {
+          flush(true);
+          line = Line::Header;
+          seq_len = 0;
+        } else if (line == Line::Seq && fastq && c == '+') {
+          line = Line::Plus;
+          qual_len = 0;
+        }
+      }
+      if (c == '\r') continue;
+      if (line != Line::Seq) {
+        if (line == Line::Qual) qual_len++;
+        continue;
+      }
+      cur.bases.push_back(c);
+      seq_len++;
+      bases_read++;
+      if (cur.bases.size() >= chunk_bases) flush(false);
+    }
+  }
+  flush(true);
+  if (f != stdin) std::fclose(f);
+  return true;
+}
+
+struct ShardCounts {
+  std::mutex mu;
+  roaring64_bitmap_t* bm = nullptr;  // base | deltas
+  std::vector<uint8_t> counts;       // by rank
+};
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+
+  IndexLines index;
+  uint64_t k_index = 0;
+  std::vector<ShardInfo> shards;
+  if (!read_index_shards(args.shards, k_index, shards, &index)) {
+    std::cerr << "Error: failed to read shards index: " << args.shards << "/index.json\n";
+    return 2;
+  }
+  const int k = (int)k_index;
+  if (k < 1 || k > 31) { std::cerr << "Error: unsupported k=" << k << "\n"; return 2; }
+  const uint64_t kmask = (1ULL << (2 * k)) - 1ULL;
+  const size_t N = shards.size();
+
+  // Base shard OR-ed with its delta layers: count ranks refer to this bitmap.
+  auto load_layers = [&](size_t sid) -> roaring64_bitmap_t* {
+    roaring64_bitmap_t* bm = load_kbit_portable(args.shards + "/" + shards[sid].file);
+    if (!bm) return nullptr;
+    for (const auto& d : shards[sid].deltas) {
+      roaring64_bitmap_t* layer = load_kbit_portable(args.shards + "/" + d);
+      if (!layer) { roaring64_bitmap_free(bm); return nullptr; }
+      roaring64_bitmap_or_inplace(bm, layer);
+      roaring64_bitmap_free(layer);
+    }
+    return bm;
+  };
+
+  uint64_t max_width = 1;
+  for (const auto& si : shards) max_width = std::max<uint64_t>(max_width, si.end - si.start);
+  int width_bits = 0;
+  while (width_bits < 64 && (1ULL << width_bits) < max_width) width_bits++;
+  const uint64_t part_cap = 1 << 14;
+  const uint64_t budget = args.mem_mb << 20;
+
+  std::vector<ShardCounts> acc(N);
+  std::vector<std::string> kcnt_files(N);
+  uint64_t bases_read_total = 0, passes = 0, counted_total = 0;
+  std::atomic<uint64_t> unknown(0), saturated(0);
+  bool failed = false;
+
+  auto t0 = Clock::now();
+  size_t g0 = 0;
+  while (g0 < N && !failed) {
+    // Next group of shards whose count arrays (+ bitmaps) fit the budget; at least one shard.
+    size_t g1 = g0;
+    uint64_t used = 0;
+    while (g1 < N) {
+      roaring64_bitmap_t* bm = load_layers(g1);
+      if (!bm) { failed = true; break; }
+      const uint64_t card = roaring64_bitmap_get_cardinality(bm);
+      const uint64_t cost = card + roaring64_bitmap_portable_size_in_bytes(bm);
+      if (g1 > g0 && used + cost > budget) { roaring64_bitmap_free(bm); break; }
+      acc[g1].bm = bm;
+      acc[g1].counts.assign(card, 0);
+      used += cost;
+      g1++;
+    }
+    if (failed) break;
+    const uint64_t lo = shards[g0].start;
+    const uint64_t hi = shards[g1 - 1].end;
+
+    auto flush_partition = [&](size_t sid, std::vector<uint64_t>& part, std::vector<uint64_t>& scratch) {
+      if (part.empty()) return;
+      radix_sort_keep(part, scratch, shards[sid].start, width_bits);
+      ShardCounts& a = acc[sid];
+      std::lock_guard<std::mutex> lk(a.mu);
+      for (size_t i = 0; i < part.size();) {
+        size_t j = i + 1;
+        while (j < part.size() && part[j] == part[i]) j++;
+        const uint64_t v = part[i];
+        if (!roaring64_bitmap_contains(a.bm, v)) {
+          unknown += j - i;
+        } else {
+          uint8_t& c = a.counts[roaring64_bitmap_rank(a.bm, v) - 1];
+          const uint64_t sum = (uint64_t)c + (j - i);
+          if (sum > 255 && c < 255) saturated++;
+          c = (uint8_t)std::min<uint64_t>(255, sum);
+        }
+        i = j;
+      }
+      part.clear();
+    };
+
+    ChunkQueue queue;
+    queue.capacity = (size_t)args.threads * 2;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < args.threads; ++t) {
+      workers.emplace_back([&]() {
+        std::vector<std::vector<uint64_t>> parts(g1 - g0);
+        std::vector<uint64_t> scratch;
+
+        auto emit = [&](uint64_t v) {
+          if (v < lo || v >= hi) return;
+          const int sid = find_shard(shards, v);
+          if (sid < 0) { unknown++; return; }
+          auto& p = parts[(size_t)sid - g0];
+          p.push_back(v);
+          if (p.size() >= part_cap) flush_partition((size_t)sid, p, scratch);
+        };
+
+        SeqChunk chunk;
+        while (queue.pop(chunk)) {
+          uint64_t fw = 0, rc = 0;
+          int valid = 0;
+          for (char c : chunk.bases) {
+            int d;
+            switch (c) {
+              case 'A': case 'a': d = 0; break;
+              case 'C': case 'c': d = 1; break;
+              case 'G': case 'g': d = 2; break;
+              case 'T': case 't': d = 3; break;
+              default: d = -1; break;
+            }
+            if (d < 0) { valid = 0; fw = 0; rc = 0; continue; }
+            fw = ((fw << 2) | (uint64_t)d) & kmask;
+            rc = (rc >> 2) | ((uint64_t)(3 - d) << (2 * (k - 1)));
+            if (++valid < k) continue;
+            emit(fw);
+            if (args.both_strands) emit(rc);
+          }
+        }
+        for (size_t i = 0; i < parts.size(); ++i) flush_partition(g0 + i, parts[i], scratch);
+      });
+    }
+
+    uint64_t bases_read = 0;
+    bool input_ok = true;
+    for (const auto& path : args.fasta) {
+      if (!stream_fasta(path, k, 4u << 20, queue, bases_read)) { input_ok = false; break; }
+    }
+    queue.close();
+    for (auto& th : workers) th.join();
+    if (!input_ok) { failed = true; break; }
+    bases_read_total = bases_read;
+    passes++;
+
+    for (size_t sid = g0; sid < g1; ++sid) {
+      std::string name = shards[sid].file;
+      auto dot = name.rfind(".kbit");
+      if (dot != std::string::npos) name.erase(dot);
+      name += ".kcnt";
+      if (!write_kcnt(args.shards + "/" + name, acc[sid].counts)) failed = true;
+      kcnt_files[sid] = name;
+      counted_total += acc[sid].counts.size();
+      roaring64_bitmap_free(acc[sid].bm);
+      acc[sid].bm = nullptr;
+      std::vector<uint8_t>().swap(acc[sid].counts);
+    }
+    g0 = g1;
+  }
+  for (auto& a : acc) if (a.bm) roaring64_bitmap_free(a.bm);
+  if (failed) return 2;
+
+  const int lock_fd = lock_index(args.shards);
+  if (lock_fd < 0) return 2;
+  {
+    // Re-read under the lock: add_genome_delta or compact_shard_layers may have run meanwhile.
+    IndexLines now;
+    uint64_t k_now = 0;
+    std::vector<ShardInfo> now_shards;
+    if (!read_index_lines(args.shards, now, k_now, now_shards) || k_now != k_index) {
+      std::cerr << "Error: failed to re-read shards index: " << args.shards << "/index.json\n";
+      return 2;
+    }
+    for (size_t sid = 0; sid < N; ++sid) {
+      for (const auto& n : now_shards) {
+        if (n.file == shards[sid].file) { set_counts_on_line(now.lines[n.line_no], kcnt_files[sid]); break; }
+      }
+    }
+    std::string out;
+    for (const auto& l : now.lines) { out += l; out += '\n'; }
+    if (!write_file_atomic(args.shards + "/index.json", out)) return 2;
+  }
+  ::close(lock_fd);
+  auto t1 = Clock::now();
+
+  long pk = peak_rss_kb();
+  std::cerr << std::fixed << std::setprecision(6);
+  std::cerr << "[INFO] Shards dir           : " << args.shards << " (k=" << k << ")\n";
+  std::cerr << "[INFO] Bases read           : " << bases_read_total << " (x" << passes << " passes)\n";
+  std::cerr << "[INFO] Counted k-mers       : " << counted_total << "\n";
+  std::cerr << "[INFO] Saturated (255)      : " << saturated.load() << "\n";
+  std::cerr << "[INFO] Not in shard set     : " << unknown.load() << "\n";
+  std::cerr << "[INFO] Count time           : " << std::chrono::duration_cast<Sec>(t1 - t0).count() << " s\n";
+  std::cerr << "[INFO] Peak RSS             : " << pk << " KB (" << (pk / 1024.0) << " MB)\n";
+  return 0;
+}
@@ -0,0 +1,310 @@
+// derive_shards.cpp
+// Derive a shorter-k shard set (e.g. shards_17 / shards_16) from an existing k-shard set
+// (e.g. shards_18) without re-reading the genomes.
+//
+// Every j-mer (j < k) of a sequence is the j-prefix of some k-mer of that sequence, except the
+// j-mers that start within the last k-1 bases of an ACGT run. So
+//   present_j = { v >> 2(k-j) : v in present_k }  U  { j-mers of the run tails }
+// where the run tails are the side list written by `build_kmer_shards --ends`. Its header line
+// records the k, depth and strandedness it was built for; j must be >= k - depth, and for a
+// --both-strands source the list also carries the reverse-complemented run heads (the tails of
+// the reverse strand).
+//
+// The projection is monotone, so each output shard [s, e) is produced by streaming the source
+// range [s << 2(k-j), e << 2(k-j)) in order with a roaring64 iterator and dropping repeats
+// (shift-dedup). Output shards are processed in parallel; the source shards they need are
+// loaded on demand, with their delta layers (add_genome_delta) OR-ed in. Writes KBITv1 flags=2
+// shards, index.json and (optionally) the absent GC histogram JSON, in the same formats as
+// build_kmer_shards.
+//
+// Compile:
+//   g++ -O3 -march=native -std=c++17 -pthread derive_shards.cpp -lroaring -lzstd -o derive_shards
+//
+// Example:
+//   ./derive_shards --from shards_18 --target-k 17 --out shards_17
+//     --ends ends_18.txt --gc-hist gc_hist_shards_17.json --threads 16
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
+
+using Clock = std::chrono::steady_clock;
+using Sec   = std::chrono::duration<double>;
+
+static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return r.ru_maxrss; }
+
+struct Args {
+  std::string from;
+  int target_k = -1;
+  std::string out;
+  std::string ends;     // optional run-tail side list
+  std::string gc_hist;  // optional
+  unsigned num_shards = 0;  // 0 => same as source
+  int threads = 4;
+};
+
+static void usage(const char* prog) {
+  std::cerr << "Usage: " << prog
+            << " --from <dir> --target-k J --out <dir>"
+            << " [--ends <file>] [--gc-hist <json>] [--num-shards N] [--threads N]\n";
+}
+
+static bool parse_args(int argc, char** argv, Args& a) {
+  for (int i = 1; i < argc; ++i) {
+    std::string s(argv[i]);
+    if (s == "--from" && i + 1 < argc) a.from = argv[++i];
+    else if (s == "--target-k" && i + 1 < argc) a.target_k = std::atoi(argv[++i]);
+    else if (s == "--out" && i + 1 < argc) a.out = argv[++i];
+    else if (s == "--ends" && i + 1 < argc) a.ends = argv[++i];
+    else if (s == "--gc-hist" && i + 1 < argc) a.gc_hist = argv[++i];
+    else if (s == "--num-shards" && i + 1 < argc) a.num_shards = (unsigned)std::max(1, std::atoi(argv[++i]));
+    else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
+  }
+  if (a.from.empty() || a.out.empty() || a.target_k < 1) {
+    std::cerr << "Error: --from, --target-k and --out are required\n";
+    return false;
+  }
+  return true;
+}
+
+// ---------------- Run tails ----------------
+static inline int base4_digit(char c) {
+  switch (c) {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return 1;
+    case 'G': case 'g': return 2;
+    case 'T': case 't': return 3;
+    default: return -1;
+  }
+}
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+
+  uint64_t k_src = 0;
+  std::vector<ShardInfo> src;
+  IndexLines src_idx;
+  if (!read_index_shards(args.from, k_src, src, &src_idx)) {
+    std::cerr << "Error: failed to read shards index: " << args.from << "/index.json\n";
+    return 2;
+  }
+  const int K = (int)k_src;
+  const bool src_both = src_idx.both_strands;
+  const int J = args.target_k;
+  if (K > 31) {
+    std::cerr << "Error: unsupported source k=" << K << " (max 31)\n";
+    return 2;
+  }
+  if (J >= K) {
+    std::cerr << "Error: --target-k must be smaller than the source k=" << K << "\n";
+    return 1;
+  }
+  const int shift = 2 * (K - J);
+
+  const uint64_t total_bits = 1ULL << (2 * J);
+  const unsigned N = (unsigned)std::min<uint64_t>(args.num_shards ? args.num_shards : src.size(), total_bits);
+  const uint64_t width = (total_bits + N - 1) / N;
+  auto out_start = [&](unsigned j) { return (uint64_t)j * width; };
+  auto out_end = [&](unsigned j) { return std::min<uint64_t>(total_bits, (uint64_t)(j + 1) * width); };
+
+  // Side list: every J-mer inside a run tail, bucketed by output shard.
+  std::vector<std::vector<uint64_t>> tail_vals(N);
+  uint64_t tails_read = 0;
+  if (!args.ends.empty()) {
+    std::ifstream in(args.ends);
+    if (!in) { std::perror(("open ends: " + args.ends).c_str()); return 2; }
+    // "#ends k=K depth=D both_strands=B" (see build_kmer_shards).
+    std::string line;
+    int ends_k = -1, ends_depth = -1, ends_both = -1;
+    if (std::getline(in, line)) {
+      std::sscanf(line.c_str(), "#ends k=%d depth=%d both_strands=%d", &ends_k, &ends_depth, &ends_both);
+    }
+    if (ends_k < 0 || ends_depth < 0 || ends_both < 0) {
+      std::cerr << "Error: " << args.ends << " has no #ends header; regenerate it with build_kmer_shards --ends\n";
+      return 1;
+    }
+    if (ends_k != K || (ends_both != 0) != src_both) {
+      std::cerr << "Error: " << args.ends << " was written for k=" << ends_k
+                << (ends_both ? " --both-strands" : "") << ", but " << args.from << " has k=" << K
+                << (src_both ? " --both-strands" : "") << "\n";
+      return 1;
+    }
+    if (J < K - ends_depth) {
+      std::cerr << "Error: " << args.ends << " covers --target-k >= " << K - ends_depth
+                << " (built with --ends-depth " << ends_depth << ")\n";
+      return 1;
+    }
+    while (std::getline(in, line)) {
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      if ((int)line.size() < J) continue;
+      tails_read++;
+      uint64_t v = 0;
+      int valid = 0;
+      for (char c : line) {
+        const int d = base4_digit(c);
+        if (d < 0) { valid = 0; v = 0; continue; }
+        v = ((v << 2) | (uint64_t)d) & (total_bits - 1);
+        if (++valid >= J) tail_vals[(size_t)(v / width)].push_back(v);
+      }
+    }
+  }
+
+  ::mkdir(args.out.c_str(), 0755);
+
+  auto t0 = Clock::now();
+  std::vector<uint64_t> ones(N, 0);
+  std::vector<std::vector<uint64_t>> gc_hists(N);
+  std::atomic<unsigned> next_shard(0);
+  std::atomic<bool> failed(false);
+
+  std::vector<std::thread> pool;
+  for (int t = 0; t < args.threads; ++t) {
+    pool.emplace_back([&]() {
+      std::vector<uint64_t> batch(1 << 16);
+      std::vector<uint64_t> projected;
+      projected.reserve(1 << 16);
+      // Source shards are visited in order; keep the last one, since consecutive output shards
+      // usually project from the same source shard.
+      size_t cached_idx = SIZE_MAX;
+      roaring64_bitmap_t* cached = nullptr;
+
+      while (true) {
+        const unsigned j = next_shard.fetch_add(1);
+        if (j >= N) break;
+
+        const uint64_t lo = out_start(j) << shift;
+        const uint64_t hi = out_end(j) << shift;  // J < K <= 31, so no overflow
+        roaring64_bitmap_t* out = roaring64_bitmap_create();
+
+        auto first = std::upper_bound(src.begin(), src.end(), lo,
+                                      [](uint64_t v, const ShardInfo& s) { return v < s.end; });
+        for (auto it = first; it != src.end() && it->start < hi; ++it) {
+          const size_t si = (size_t)(it - src.begin());
+          if (si != cached_idx) {
+            if (cached) roaring64_bitmap_free(cached);
+            cached = load_kbit_portable(args.from + "/" + it->file);
+            for (const auto& d : it->deltas) {
+              if (!cached) break;
+              roaring64_bitmap_t* layer = load_kbit_portable(args.from + "/" + d);
+              if (!layer) { roaring64_bitmap_free(cached); cached = nullptr; break; }
+              roaring64_bitmap_or_inplace(cached, layer);
+              roaring64_bitmap_free(layer);
+            }
+            cached_idx = cached ? si : SIZE_MAX;
+            if (!cached) { failed = true; break; }
+          }
+
+          roaring64_iterator_t* rit = roaring64_iterator_create(cached);
+          uint64_t last = UINT64_MAX;
+          bool done = !roaring64_iterator_move_equalorlarger(rit, lo);
+          while (!done) {
+            const uint64_t got = roaring64_iterator_read(rit, batch.data(), batch.size());
+            if (got == 0) break;
+            for (uint64_t b = 0; b < got; ++b) {
+              if (batch[b] >= hi) { done = true; break; }
+              const uint64_t p = batch[b] >> shift;
+              if (p == last) continue;
+              last = p;
+              projected.push_back(p);
+            }
+            if (projected.size() >= batch.size()) {
+              roaring64_bitmap_add_many(out, projected.size(), projected.data());
+              projected.clear();
+            }
+          }
+          roaring64_iterator_free(rit);
+          roaring64_bitmap_add_many(out, projected.size(), projected.data());
+          projected.clear();
+        }
+
+        auto& tv = tail_vals[j];
+        if (!tv.empty()) {
+          std::sort(tv.begin(), tv.end());
+          roaring64_bitmap_add_many(out, tv.size(), tv.data());
+          std::vector<uint64_t>().swap(tv);
+        }
+        roaring64_bitmap_run_optimize(out);
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "/shard_%04u.kbit", j);
+        if (!write_kbit_portable(args.out + name, out, total_bits, (uint64_t)J)) failed = true;
+
+        std::vector<uint64_t> h = range_gc_hist(out_start(j), out_end(j), J);
+        roaring64_iterator_t* oit = roaring64_iterator_create(out);
+        uint64_t got;
+        while ((got = roaring64_iterator_read(oit, batch.data(), batch.size())) > 0) {
+          for (uint64_t b = 0; b < got; ++b) h[(size_t)gc_count(batch[b], J)]--;
+        }
+        roaring64_iterator_free(oit);
+
+        ones[j] = roaring64_bitmap_get_cardinality(out);
+        gc_hists[j] = std::move(h);
+        roaring64_bitmap_free(out);
+      }
+      if (cached) roaring64_bitmap_free(cached);
+    });
+  }
+  for (auto& th : pool) th.join();
+  if (failed) return 2;
+
+  {
+    std::ofstream idx(args.out + "/index.json", std::ios::trunc);
+    if (!idx) { std::perror("open index.json"); return 2; }
+    idx << "{\n";
+    idx << "  \"k\": " << J << ",\n";
+    idx << "  \"num_shards\": " << N << ",\n";
+    idx << "  \"total_bits\": " << total_bits << ",\n";
+    if (src_both) idx << "  \"both_strands\": true,\n";
+    idx << "  \"shards\": [\n";
+    for (unsigned j = 0; j < N; ++j) {
+      char name[64];
+      std::snprintf(name, sizeof(name), "shard_%04u.kbit", j);
+      idx << "    {\"file\": \"" << name << "\", \"start\": " << out_start(j)
+          << ", \"end\": " << out_end(j) << ", \"ones\": " << ones[j] << "}"
+          << (j + 1 < N ? "," : "") << "\n";
+    }
+    idx << "  ]\n}\n";
+  }
+
+  if (!args.gc_hist.empty()) {
+    std::ofstream gh(args.gc_hist, std::ios::trunc);
+    if (!gh) { std::perror("open gc-hist"); return 2; }
+    gh << format_gc_hist_json(J, gc_hists);
+  }
+  auto t1 = Clock::now();
+
+  uint64_t total_ones = 0;
+  for (uint64_t o : ones) total_ones += o;
+
+  long pk = peak_rss_kb();
+  std::cerr << std::fixed << std::setprecision(6);
+  std::cerr << "[INFO] Source dir           : " << args.from << " (k=" << K << ")\n";
+  std::cerr << "[INFO] Output dir           : " << args.out << " (k=" << J << ")\n";
+  std::cerr << "[INFO] Output shards        : " << N << "\n";
+  std::cerr << "[INFO] Run tails            : " << tails_read << "\n";
+  std::cerr << "[INFO] Distinct present     : " << total_ones << "\n";
+  std::cerr << "[INFO] Derive time          : " << std::chrono::duration_cast<Sec>(t1 - t0).count() << " s\n";
+  std::cerr << "[INFO] Peak RSS             : " << pk << " KB (" << (pk / 1024.0) << " MB)\n";
+  return 0;
+}
@@ -0,0 +1,287 @@
+// dilate_shards.cpp
+// Write the Hamming-1 dilation of a shard set: every k-mer within one substitution of a present
+// k-mer (the present k-mers included), as a sibling shard set over the same shard ranges. Its
+// absent k-mers are exactly the k-mers whose whole 1-mismatch neighbourhood is absent, so
+// `query_substring_bitmap_stream --shards <out>` streams them as fast as plain absent k-mers,
+// without the per-candidate neighbourhood walk of `--robust 1`.
+//
+// The dilation is the union of the present set and its 3k variants P ^ (x << 2g) (x = 1..3 turns
+// base g into each other base). Each output shard is split into aligned blocks of 4^m values; a
+// substitution below base m maps a block onto itself, one at or above base m maps a whole source
+// block onto it. So a block is built by streaming its own present k-mers once (adding their 3m
+// in-block variants) and, for each higher base and substitution, the source block it is mapped
+// from, which arrives in order. Every present k-mer is read 3k + 1 times in total. Output shards
+// are processed in parallel; the source shards they need are loaded on demand and each thread
+// keeps the last --cache of them. Writes KBITv1 flags=2 shards, index.json and (optionally) the
+// absent GC histogram JSON, in the same formats as build_kmer_shards.
+//
+// Each shard line of the output index.json records the source shard's present count as
+// "source_ones"; the server compares it with the base set's current "ones" and falls back to
+// --robust 1 once the base set has changed (new delta layers, compaction, a rebuild).
+//
+// Only base shard files are read: compact delta layers first (compact_shard_layers). Source and
+// count layers are not carried over, so --absent-in / --present-in / --min-count do not apply to
+// the dilated set.
+//
+// Compile:
+//   g++ -O3 -march=native -std=c++17 -pthread dilate_shards.cpp -lroaring -lzstd -o dilate_shards
+//
+// Example:
+//   ./dilate_shards --from shards_18 --out shards_18_d1 --gc-hist gc_hist_shards_18_d1.json --threads 16
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
+
+using Clock = std::chrono::steady_clock;
+using Sec   = std::chrono::duration<double>;
+
+static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return r.ru_maxrss; }
+
+struct Args {
+  std::string from;
+  std::string out;
+  std::string gc_hist;  // optional
+  int threads = 4;
+  int cache = 16;       // source shard bitmaps held per thread
+};
+
+static void usage(const char* prog) {
+  std::cerr << "Usage: " << prog
+            << " --from <dir> --out <dir> [--gc-hist <json>] [--threads N] [--cache N]\n";
+}
+
+static bool parse_args(int argc, char** argv, Args& a) {
+  for (int i = 1; i < argc; ++i) {
+    std::string s(argv[i]);
+    if (s == "--from" && i + 1 < argc) a.from = argv[++i];
+    else if (s == "--out" && i + 1 < argc) a.out = argv[++i];
+    else if (s == "--gc-hist" && i + 1 < argc) a.gc_hist = argv[++i];
+    else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else if (s == "--cache" && i + 1 < argc) a.cache = std::max(1, std::atoi(argv[++i]));
+    else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
+  }
+  if (a.from.empty() || a.out.empty()) {
+    std::cerr << "Error: --from and --out are required\n";
+    return false;
+  }
+  if (a.from == a.out) {
+    std::cerr << "Error: --out must differ from --from\n";
+    return false;
+  }
+  return true;
+}
+
+// ---------------- GC helpers ----------------
+// Splits [s, e) into maximal aligned blocks [lo, lo + 4^m), returned as (lo, m).
+static std::vector<std::pair<uint64_t, int>> aligned_blocks(uint64_t s, uint64_t e, int k) {
+  std::vector<std::pair<uint64_t, int>> out;
+  while (s < e) {
+    int m = 0;
+    while (m < k && (s & ((1ULL << (2 * (m + 1))) - 1)) == 0 && s + (1ULL << (2 * (m + 1))) <= e) ++m;
+    out.push_back({s, m});
+    s += 1ULL << (2 * m);
+  }
+  return out;
+}
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+
+  uint64_t k_src = 0;
+  std::vector<ShardInfo> src;
+  if (!read_index_shards(args.from, k_src, src)) {
+    std::cerr << "Error: failed to read shards index: " << args.from << "/index.json\n";
+    return 2;
+  }
+  if (std::any_of(src.begin(), src.end(), [](const ShardInfo& s) { return !s.deltas.empty(); })) {
+    std::cerr << "Error: " << args.from << " has delta layers; run compact_shard_layers first\n";
+    return 1;
+  }
+  const int K = (int)k_src;
+  if (K > 31) {
+    std::cerr << "Error: k=" << K << " is not supported (k <= 31)\n";
+    return 1;
+  }
+  const uint64_t total_bits = 1ULL << (2 * K);
+  const unsigned N = (unsigned)src.size();
+
+  ::mkdir(args.out.c_str(), 0755);
+
+  auto t0 = Clock::now();
+  std::vector<uint64_t> ones(N, 0);
+  std::vector<uint64_t> source_ones(N, 0);
+  std::vector<std::vector<uint64_t>> gc_hists(N);
+  std::atomic<unsigned> next_shard(0);
+  std::atomic<bool> failed(false);
+  std::atomic<uint64_t> shard_loads(0);
+
+  std::vector<std::thread> pool;
+  for (int t = 0; t < args.threads; ++t) {
+    pool.emplace_back([&]() {
+      std::vector<uint64_t> batch(1 << 16);
+      std::vector<uint64_t> vals;
+      vals.reserve(1 << 20);
+      // Source shards recently used by this thread, most recent last.
+      std::vector<std::pair<size_t, roaring64_bitmap_t*>> cached;
+      auto source = [&](size_t si)->roaring64_bitmap_t* {
+        for (size_t c = 0; c < cached.size(); ++c) {
+          if (cached[c].first != si) continue;
+          std::rotate(cached.begin() + c, cached.begin() + c + 1, cached.end());
+          return cached.back().second;
+        }
+        roaring64_bitmap_t* bm = load_kbit_portable(args.from + "/" + src[si].file);
+        if (!bm) return nullptr;
+        shard_loads++;
+        if ((int)cached.size() >= args.cache) {
+          roaring64_bitmap_free(cached.front().second);
+          cached.erase(cached.begin());
+        }
+        cached.push_back({si, bm});
+        return bm;
+      };
+      // Calls f(v) for each present k-mer in [lo, hi), in order.
+      auto for_range = [&](uint64_t lo, uint64_t hi, auto&& f)->bool {
+        auto first = std::upper_bound(src.begin(), src.end(), lo,
+                                      [](uint64_t v, const ShardInfo& s) { return v < s.end; });
+        for (auto it = first; it != src.end() && it->start < hi; ++it) {
+          roaring64_bitmap_t* bm = source((size_t)(it - src.begin()));
+          if (!bm) return false;
+          roaring64_iterator_t* rit = roaring64_iterator_create(bm);
+          bool done = !roaring64_iterator_move_equalorlarger(rit, lo);
+          while (!done) {
+            const uint64_t got = roaring64_iterator_read(rit, batch.data(), batch.size());
+            if (got == 0) break;
+            for (uint64_t b = 0; b < got; ++b) {
+              if (batch[b] >= hi) { done = true; break; }
+              f(batch[b]);
+            }
+          }
+          roaring64_iterator_free(rit);
+        }
+        return true;
+      };
+
+      while (true) {
+        const unsigned j = next_shard.fetch_add(1);
+        if (j >= N) break;
+
+        roaring64_bitmap_t* out = roaring64_bitmap_create();
+        auto flush = [&]() {
+          std::sort(vals.begin(), vals.end());
+          vals.erase(std::unique(vals.begin(), vals.end()), vals.end());
+          roaring64_bitmap_add_many(out, vals.size(), vals.data());
+          vals.clear();
+        };
+        bool ok = true;
+        for (const auto& blk : aligned_blocks(src[j].start, src[j].end, K)) {
+          const uint64_t lo = blk.first, size = 1ULL << (2 * blk.second);
+          const int m = blk.second;
+          // The block's own k-mers and their in-block variants.
+          ok = ok && for_range(lo, lo + size, [&](uint64_t v) {
+            source_ones[j]++;
+            vals.push_back(v);
+            for (int g = 0; g < m; ++g) {
+              for (uint64_t x = 1; x < 4; ++x) vals.push_back(v ^ (x << (2 * g)));
+            }
+            if (vals.size() >= (1u << 20)) flush();
+          });
+          // Variants from the blocks differing from this one at base g >= m.
+          for (int g = m; ok && g < K; ++g) {
+            for (uint64_t x = 1; ok && x < 4; ++x) {
+              const uint64_t c = x << (2 * g), from = lo ^ c;
+              ok = for_range(from, from + size, [&](uint64_t v) {
+                vals.push_back(v ^ c);
+                if (vals.size() >= (1u << 20)) flush();
+              });
+            }
+          }
+          if (!ok) break;
+        }
+        if (!ok) { failed = true; roaring64_bitmap_free(out); break; }
+        flush();
+        roaring64_bitmap_run_optimize(out);
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "/shard_%04u.kbit", j);
+        if (!write_kbit_portable(args.out + name, out, total_bits, (uint64_t)K)) failed = true;
+
+        std::vector<uint64_t> h = range_gc_hist(src[j].start, src[j].end, K);
+        roaring64_iterator_t* oit = roaring64_iterator_create(out);
+        uint64_t got;
+        while ((got = roaring64_iterator_read(oit, batch.data(), batch.size())) > 0) {
+          for (uint64_t b = 0; b < got; ++b) h[(size_t)gc_count(batch[b], K)]--;
+        }
+        roaring64_iterator_free(oit);
+
+        ones[j] = roaring64_bitmap_get_cardinality(out);
+        gc_hists[j] = std::move(h);
+        roaring64_bitmap_free(out);
+      }
+      for (auto& c : cached) roaring64_bitmap_free(c.second);
+    });
+  }
+  for (auto& th : pool) th.join();
+  if (failed) return 2;
+
+  {
+    std::ofstream idx(args.out + "/index.json", std::ios::trunc);
+    if (!idx) { std::perror("open index.json"); return 2; }
+    idx << "{\n";
+    idx << "  \"k\": " << K << ",\n";
+    idx << "  \"num_shards\": " << N << ",\n";
+    idx << "  \"total_bits\": " << total_bits << ",\n";
+    idx << "  \"shards\": [\n";
+    for (unsigned j = 0; j < N; ++j) {
+      char name[64];
+      std::snprintf(name, sizeof(name), "shard_%04u.kbit", j);
+      idx << "    {\"file\": \"" << name << "\", \"start\": " << src[j].start
+          << ", \"end\": " << src[j].end << ", \"ones\": " << ones[j]
+          << ", \"source_ones\": " << source_ones[j] << "}"
+          << (j + 1 < N ? "," : "") << "\n";
+    }
+    idx << "  ]\n}\n";
+  }
+
+  if (!args.gc_hist.empty()) {
+    std::ofstream gh(args.gc_hist, std::ios::trunc);
+    if (!gh) { std::perror("open gc-hist"); return 2; }
+    gh << format_gc_hist_json(K, gc_hists);
+  }
+  auto t1 = Clock::now();
+
+  uint64_t total_ones = 0;
+  for (uint64_t o : ones) total_ones += o;
+
+  long pk = peak_rss_kb();
+  std::cerr << std::fixed << std::setprecision(6);
+  std::cerr << "[INFO] Source dir           : " << args.from << " (k=" << K << ")\n";
+  std::cerr << "[INFO] Output dir           : " << args.out << "\n";
+  std::cerr << "[INFO] Output shards        : " << N << "\n";
+  std::cerr << "[INFO] Dilated present      : " << total_ones << " (absent " << (total_bits - total_ones) << ")\n";
+  std::cerr << "[INFO] Source shard loads   : " << shard_loads.load() << "\n";
+  std::cerr << "[INFO] Dilate time          : " << std::chrono::duration_cast<Sec>(t1 - t0).count() << " s\n";
+  std::cerr << "[INFO] Peak RSS             : " << pk << " KB (" << (pk / 1024.0) << " MB)\n";
+  return 0;
+}
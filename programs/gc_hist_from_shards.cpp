@@ -0,0 +1,243 @@
+// gc_hist_from_shards.cpp
+// Recompute the per-shard ABSENT GC histograms directly from a shard set, so the histogram file
+// is consistent with the shards by construction.
+//
+// For each shard [start, end) the complement of the present set is walked in 64-value words:
+// a word covers the 4^3 values sharing all but the last three digits, so its GC count is
+// gc(high digits) + gc(low 3 digits). Present values are OR-ed into the word, the absent word is
+// ~present & valid, and popcount(absent & LOW3_GC_MASK[g]) is added to hist[gc_high + g].
+// Runs of words with no present value are counted without touching the bitmap (4 adds per word,
+// or the closed-form range histogram for long gaps). Shards are processed in parallel; a shard's
+// delta layers (add_genome_delta) are OR-ed over its base file first.
+//
+// Output:
+//   --json : the existing gc_hist_shards_<k>.json schema
+//            {"k": K, "num_shards": N, "shards": [{"shard": i, "gc_hist": [...]}, ...]}
+//   --bin  : binary manifest read by query_substring_bitmap_stream --gc-hist
+//            magic "GCHISTv1" | k (u64) | num_shards (u64) | num_shards * (k+1) u64 counts (LE)
+//
+// Compile:
+//   g++ -O3 -march=native -std=c++17 -pthread gc_hist_from_shards.cpp -lroaring -lzstd -o gc_hist_from_shards
+//
+// Example:
+//   ./gc_hist_from_shards --shards shards_18 --json gc_hist_shards_18.json
+//     --bin gc_hist_shards_18.bin --threads 32
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
+
+using Clock = std::chrono::steady_clock;
+using Sec   = std::chrono::duration<double>;
+
+static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return r.ru_maxrss; }
+
+struct Args {
+  std::string shards;
+  std::string json;
+  std::string bin;
+  int threads = 4;
+};
+
+static void usage(const char* prog) {
+  std::cerr << "Usage: " << prog
+            << " --shards <dir> [--json <file>] [--bin <file>] [--threads N]\n";
+}
+
+static bool parse_args(int argc, char** argv, Args& a) {
+  for (int i = 1; i < argc; ++i) {
+    std::string s(argv[i]);
+    if (s == "--shards" && i + 1 < argc) a.shards = argv[++i];
+    else if (s == "--json" && i + 1 < argc) a.json = argv[++i];
+    else if (s == "--bin" && i + 1 < argc) a.bin = argv[++i];
+    else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
+  }
+  if (a.shards.empty()) { std::cerr << "Error: --shards is required\n"; return false; }
+  if (a.json.empty() && a.bin.empty()) { std::cerr << "Error: give --json and/or --bin\n"; return false; }
+  return true;
+}
+
+// ---------------- GC helpers ----------------
+// LOW3_GC_MASK[g]: bit i set iff the 3-digit value i has exactly g GC digits.
+struct Low3Masks {
+  uint64_t m[4] = {0, 0, 0, 0};
+  Low3Masks() { for (uint64_t i = 0; i < 64; ++i) m[gc_count(i, 3)] |= 1ULL << i; }
+};
+static const Low3Masks LOW3_GC_MASK;
+
+// Absent-value histogram of one shard, walking the complement word by word.
+static std::vector<uint64_t> absent_gc_hist(const roaring64_bitmap_t* bm, uint64_t start, uint64_t end, int k) {
+  std::vector<uint64_t> hist((size_t)k + 1, 0);
+  if (end <= start) return hist;
+
+  if (k < 3) {
+    for (uint64_t v = start; v < end; ++v) {
+      if (!roaring64_bitmap_contains(bm, v)) hist[(size_t)gc_count(v, k)]++;
+    }
+    return hist;
+  }
+
+  const int kh = k - 3;
+  const uint64_t b_first = start >> 6;
+  const uint64_t b_last = (end - 1) >> 6;
+
+  auto valid_mask = [&](uint64_t b) -> uint64_t {
+    const uint64_t lo = std::max(start, b << 6) - (b << 6);
+    const uint64_t hi = std::min(end, (b + 1) << 6) - (b << 6);
+    const uint64_t upto = (hi >= 64) ? ~0ULL : ((1ULL << hi) - 1ULL);
+    return upto & ~((1ULL << lo) - 1ULL);
+  };
+  auto flush_word = [&](uint64_t b, uint64_t present) {
+    const uint64_t absent = ~present & valid_mask(b);
+    if (!absent) return;
+    const int gh = gc_count(b, kh);
+    for (int g = 0; g < 4; ++g) hist[(size_t)(gh + g)] += (uint64_t)__builtin_popcountll(absent & LOW3_GC_MASK.m[g]);
+  };
+  // Words [b1, b2) lie strictly inside the shard and hold no present value.
+  auto add_empty_words = [&](uint64_t b1, uint64_t b2) {
+    if (b2 <= b1) return;
+    if (b2 - b1 >= 64) {
+      add_prefix_gc_hist(b2 << 6, k, hist, +1);
+      add_prefix_gc_hist(b1 << 6, k, hist, -1);
+      return;
+    }
+    for (uint64_t b = b1; b < b2; ++b) {
+      const int gh = gc_count(b, kh);
+      hist[(size_t)gh] += 8; hist[(size_t)gh + 1] += 24; hist[(size_t)gh + 2] += 24; hist[(size_t)gh + 3] += 8;
+    }
+  };
+
+  uint64_t cur = b_first;
+  uint64_t word = 0;
+  std::vector<uint64_t> batch(1 << 16);
+  roaring64_iterator_t* it = roaring64_iterator_create(bm);
+  bool more = roaring64_iterator_move_equalorlarger(it, start);
+  while (more) {
+    const uint64_t got = roaring64_iterator_read(it, batch.data(), batch.size());
+    if (got == 0) break;
+    for (uint64_t i = 0; i < got; ++i) {
+      const uint64_t v = batch[i];
+      if (v >= end) { more = false; break; }
+      const uint64_t b = v >> 6;
+      if (b != cur) {
+        flush_word(cur, word);
+        add_empty_words(cur + 1, b);
+        cur = b;
+        word = 0;
+      }
+      word |= 1ULL << (v & 63);
+    }
+  }
+  roaring64_iterator_free(it);
+
+  flush_word(cur, word);
+  if (b_last > cur) {
+    add_empty_words(cur + 1, b_last);
+    flush_word(b_last, 0);
+  }
+  return hist;
+}
+
+static inline void push_le64(std::string& b, uint64_t x) {
+  for (int i = 0; i < 8; ++i) b.push_back((char)((x >> (8 * i)) & 0xFF));
+}
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+
+  uint64_t k_index = 0;
+  std::vector<ShardInfo> shards;
+  if (!read_index_shards(args.shards, k_index, shards)) {
+    std::cerr << "Error: failed to read shards index: " << args.shards << "/index.json\n";
+    return 2;
+  }
+  const int k = (int)k_index;
+  if (k < 1 || k > 31) { std::cerr << "Error: unsupported k=" << k << "\n"; return 2; }
+  const size_t N = shards.size();
+
+  auto t0 = Clock::now();
+  std::vector<std::vector<uint64_t>> hists(N);
+  std::atomic<size_t> next_shard(0);
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> pool;
+  const int T = std::min<int>(args.threads, (int)N);
+  for (int t = 0; t < T; ++t) {
+    pool.emplace_back([&]() {
+      while (true) {
+        const size_t sid = next_shard.fetch_add(1);
+        if (sid >= N) break;
+        roaring64_bitmap_t* bm = load_kbit_portable(args.shards + "/" + shards[sid].file);
+        if (!bm) { failed = true; continue; }
+        bool layers_ok = true;
+        for (const auto& d : shards[sid].deltas) {
+          roaring64_bitmap_t* layer = load_kbit_portable(args.shards + "/" + d);
+          if (!layer) { layers_ok = false; break; }
+          roaring64_bitmap_or_inplace(bm, layer);
+          roaring64_bitmap_free(layer);
+        }
+        if (!layers_ok) { roaring64_bitmap_free(bm); failed = true; continue; }
+        hists[sid] = absent_gc_hist(bm, shards[sid].start, shards[sid].end, k);
+        roaring64_bitmap_free(bm);
+      }
+    });
+  }
+  for (auto& th : pool) th.join();
+  if (failed) return 2;
+  auto t1 = Clock::now();
+
+  if (!args.json.empty()) {
+    if (!write_file_atomic(args.json, format_gc_hist_json(k, hists))) return 2;
+  }
+
+  if (!args.bin.empty()) {
+    std::string b;
+    b.reserve(24 + N * (size_t)(k + 1) * 8);
+    b.append("GCHISTv1", 8);
+    push_le64(b, (uint64_t)k);
+    push_le64(b, (uint64_t)N);
+    for (size_t sid = 0; sid < N; ++sid) {
+      for (int g = 0; g <= k; ++g) push_le64(b, hists[sid][(size_t)g]);
+    }
+    const std::string tmp = args.bin + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+      if (!out) { std::perror(("open " + tmp).c_str()); return 2; }
+      out.write(b.data(), (std::streamsize)b.size());
+      if (!out) { std::cerr << "Error: short write to " << tmp << "\n"; return 2; }
+    }
+    if (std::rename(tmp.c_str(), args.bin.c_str()) != 0) { std::perror("rename bin"); return 2; }
+  }
+
+  uint64_t absent_total = 0;
+  for (const auto& h : hists) for (uint64_t c : h) absent_total += c;
+
+  long pk = peak_rss_kb();
+  std::cerr << std::fixed << std::setprecision(6);
+  std::cerr << "[INFO] Shards dir           : " << args.shards << "\n";
+  std::cerr << "[INFO] k / shards           : " << k << " / " << N << "\n";
+  std::cerr << "[INFO] Threads              : " << T << "\n";
+  std::cerr << "[INFO] Absent total         : " << absent_total << "\n";
+  std::cerr << "[INFO] Histogram time       : " << std::chrono::duration_cast<Sec>(t1 - t0).count() << " s\n";
+  std::cerr << "[INFO] Peak RSS             : " << pk << " KB (" << (pk / 1024.0) << " MB)\n";
+  return 0;
+}
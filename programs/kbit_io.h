@@ -0,0 +1,510 @@
+// kbit_io.h
+// Helpers shared by the shard tools: KBITv1 shard I/O (plain and zstd-framed cold-tier payloads),
+// index.json parsing and locking, and the per-shard GC histograms (closed form and JSON/GCHISTv1).
+//
+// Header-only; every function is static inline so each tool compiles it with its own flags and
+// unused helpers cost nothing. Needs roaring64 and zstd, like the tools that include it.
+
+#ifndef BARCODESDB_KBIT_IO_H
+#define BARCODESDB_KBIT_IO_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+// ---------------- KBITv1 ----------------
+// 64-byte header: "KBITv1\0\0" | total_bits | ones | k | seed | flags | payload_len | reserved,
+// all u64 little-endian; flags=2 is a portable roaring64 payload, flags=3 the same zstd-framed.
+static inline uint64_t read_le64(const unsigned char* p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i) v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+static inline void write_le64(unsigned char* p, uint64_t v) {
+  for (int i = 0; i < 8; ++i) p[i] = (unsigned char)((v >> (8 * i)) & 0xFF);
+}
+
+// flags=3 (cold tier, written by tier_shards): the portable payload is zstd-compressed in
+// independent frames behind a frame index, so it is decompressed one frame at a time:
+//   raw_len u64 | frame_raw u64 | nframes u64 | nframes x compressed size u64 | frames
+static inline bool read_zstd_frames(std::istream& in, uint64_t payload_len, std::vector<char>& out) {
+  // The payload must lie in the file, so no size below is allocated beyond what it can back.
+  const auto start = in.tellg();
+  in.seekg(0, std::ios::end);
+  const auto stop = in.tellg();
+  in.seekg(start);
+  if (start < 0 || stop < start || payload_len > (uint64_t)(stop - start)) return false;
+  unsigned char fh[24];
+  in.read(reinterpret_cast<char*>(fh), 24);
+  if (!in) return false;
+  const uint64_t raw_len = read_le64(fh), frame_raw = read_le64(fh + 8), nframes = read_le64(fh + 16);
+  if (payload_len < 24 || frame_raw == 0 || nframes != (raw_len + frame_raw - 1) / frame_raw ||
+      nframes > (payload_len - 24) / 8) return false;
+  std::vector<unsigned char> sizes(8 * nframes);
+  in.read(reinterpret_cast<char*>(sizes.data()), (std::streamsize)sizes.size());
+  if (!in) return false;
+  // Every frame must fit in the payload, and no zstd block (3-byte header, at most
+  // ZSTD_BLOCKSIZE_MAX raw bytes) expands further, which bounds raw_len before allocating it.
+  uint64_t used = 24 + sizes.size();
+  for (uint64_t f = 0; f < nframes; ++f) {
+    const uint64_t cs = read_le64(sizes.data() + 8 * f);
+    const uint64_t want = std::min(frame_raw, raw_len - f * frame_raw);
+    if (cs > payload_len - used || want > cs / 3 * ZSTD_BLOCKSIZE_MAX) return false;
+    used += cs;
+  }
+  out.resize(raw_len);
+  std::vector<char> comp;
+  ZSTD_DCtx* dctx = ZSTD_createDCtx();
+  bool ok = dctx != nullptr;
+  for (uint64_t f = 0; ok && f < nframes; ++f) {
+    const uint64_t cs = read_le64(sizes.data() + 8 * f);
+    const uint64_t off = f * frame_raw, want = std::min(frame_raw, raw_len - off);
+    comp.resize(cs);
+    in.read(comp.data(), (std::streamsize)cs);
+    if ((uint64_t)in.gcount() != cs) { ok = false; break; }
+    const size_t r = ZSTD_decompressDCtx(dctx, out.data() + off, want, comp.data(), cs);
+    ok = !ZSTD_isError(r) && r == want;
+  }
+  ZSTD_freeDCtx(dctx);
+  return ok;
+}
+
+// Loads a flags=2 or flags=3 shard (or delta layer) into a fresh bitmap; nullptr on error.
+static inline roaring64_bitmap_t* load_kbit_portable(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) { std::perror(("open shard: " + path).c_str()); return nullptr; }
+  unsigned char hdr[64];
+  in.read(reinterpret_cast<char*>(hdr), 64);
+  if (!in || std::memcmp(hdr, "KBITv1\0", 8) != 0) {
+    std::cerr << "Error: bad magic (not a KBITv1 file): " << path << "\n";
+    return nullptr;
+  }
+  const uint64_t flags = read_le64(hdr + 40);
+  if (flags != 2 && flags != 3) {
+    std::cerr << "Error: expected roaring payload (flags=2 or 3) in " << path << "\n";
+    return nullptr;
+  }
+  std::vector<char> payload;
+  if (flags == 3) {
+    if (!read_zstd_frames(in, read_le64(hdr + 48), payload)) {
+      std::cerr << "Error: corrupt compressed payload in " << path << "\n";
+      return nullptr;
+    }
+  } else {
+    payload.resize(read_le64(hdr + 48));
+    in.read(payload.data(), (std::streamsize)payload.size());
+    if ((uint64_t)in.gcount() != payload.size()) {
+      std::cerr << "Error: truncated payload in " << path << "\n";
+      return nullptr;
+    }
+  }
+  roaring64_bitmap_t* bm = roaring64_bitmap_portable_deserialize_safe(payload.data(), payload.size());
+  if (!bm) std::cerr << "Error: deserialization failed for " << path << "\n";
+  return bm;
+}
+
+// Serializes `bm` as a flags=2 KBITv1 file. Writes to <path>.tmp and renames, so readers
+// never observe a half-written shard.
+static inline bool write_kbit_portable(const std::string& path, const roaring64_bitmap_t* bm,
+                                       uint64_t total_bits, uint64_t k) {
+  const size_t n = roaring64_bitmap_portable_size_in_bytes(bm);
+  std::vector<char> payload(n);
+  if (roaring64_bitmap_portable_serialize(bm, payload.data()) != n) {
+    std::cerr << "Error: serialization failed for " << path << "\n";
+    return false;
+  }
+
+  unsigned char hdr[64];
+  std::memset(hdr, 0, sizeof(hdr));
+  std::memcpy(hdr, "KBITv1\0", 8);
+  write_le64(hdr + 8, total_bits);
+  write_le64(hdr + 16, roaring64_bitmap_get_cardinality(bm));
+  write_le64(hdr + 24, k);
+  write_le64(hdr + 40, 2);
+  write_le64(hdr + 48, (uint64_t)n);
+
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out) { std::perror(("open " + tmp).c_str()); return false; }
+    out.write(reinterpret_cast<const char*>(hdr), sizeof(hdr));
+    out.write(payload.data(), (std::streamsize)payload.size());
+    if (!out) { std::cerr << "Error: short write to " << tmp << "\n"; return false; }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) { std::perror(("rename " + path).c_str()); return false; }
+  return true;
+}
+
+// Writes <path>.tmp and renames it over `path`.
+static inline bool write_file_atomic(const std::string& path, const std::string& data) {
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out) { std::perror(("open " + tmp).c_str()); return false; }
+    out.write(data.data(), (std::streamsize)data.size());
+    if (!out) { std::cerr << "Error: short write to " << tmp << "\n"; return false; }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) { std::perror(("rename " + path).c_str()); return false; }
+  return true;
+}
+
+// ---------------- index.json ----------------
+// Every writer puts one shard object per line, so the index is parsed (and edited) line by line.
+struct ShardInfo {
+  uint64_t start = 0;
+  uint64_t end = 0;
+  bool has_range = false;           // "start"/"end" present
+  std::string file;
+  std::vector<std::string> deltas;  // delta layers (add_genome_delta), OR-ed over the base file
+  std::string counts;               // optional .kcnt count layer (count_kmer_shards)
+  std::string node;                 // worker address when the shard lives on another node
+  size_t line_no = 0;               // line of index.json holding this shard
+  uint64_t ones = 0;
+};
+
+static inline void parse_string_array_field(const std::string& s, const std::string& key,
+                                            std::vector<std::string>& out) {
+  auto pos = s.find(key);
+  if (pos == std::string::npos) return;
+  auto lb = s.find('[', pos);
+  if (lb == std::string::npos) return;
+  auto rb = s.find(']', lb);
+  if (rb == std::string::npos) return;
+  size_t i = lb + 1;
+  while (true) {
+    auto q1 = s.find('"', i);
+    if (q1 == std::string::npos || q1 > rb) break;
+    auto q2 = s.find('"', q1 + 1);
+    if (q2 == std::string::npos || q2 > rb) break;
+    out.push_back(s.substr(q1 + 1, q2 - (q1 + 1)));
+    i = q2 + 1;
+  }
+}
+
+// Value of `"key": "value"` on one index.json line.
+static inline bool parse_string_field(const std::string& s, const std::string& key, std::string& out) {
+  auto pos = s.find(key);
+  if (pos == std::string::npos) return false;
+  auto colon = s.find(':', pos);
+  if (colon == std::string::npos) return false;
+  auto q1 = s.find('"', colon);
+  if (q1 == std::string::npos) return false;
+  auto q2 = s.find('"', q1 + 1);
+  if (q2 == std::string::npos) return false;
+  out = s.substr(q1 + 1, q2 - (q1 + 1));
+  return true;
+}
+
+struct IndexLines {
+  std::vector<std::string> lines;
+  std::vector<std::string> sources;
+  long sources_line = -1;  // line holding "sources", if any
+  long shards_line = -1;   // line opening the "shards" array
+  bool both_strands = false;
+};
+
+// Reads <dir>/index.json keeping its lines; shards are listed in file order.
+static inline bool read_index_lines(const std::string& dir, IndexLines& idx, uint64_t& k_out,
+                                    std::vector<ShardInfo>& shards) {
+  std::ifstream in(dir + "/index.json");
+  if (!in) return false;
+  std::vector<std::string>& lines = idx.lines;
+  lines.clear();
+  idx.sources.clear();
+  idx.sources_line = idx.shards_line = -1;
+  idx.both_strands = false;
+  shards.clear();
+  k_out = 0;
+  unsigned numShards = 0;
+
+  auto parse_u64_field = [&](const std::string& s, const std::string& key, uint64_t& out)->bool {
+    auto pos = s.find(key);
+    if (pos == std::string::npos) return false;
+    pos = s.find(':', pos);
+    if (pos == std::string::npos) return false;
+    pos++;
+    while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t')) pos++;
+    size_t end = s.find_first_of(",}", pos);
+    if (end == std::string::npos || end <= pos) return false;
+    out = std::stoull(s.substr(pos, end - pos));
+    return true;
+  };
+
+  std::string line;
+  while (std::getline(in, line)) {
+    lines.push_back(line);
+    auto fpos = line.find("\"file\"");
+    if (fpos == std::string::npos) {
+      if (line.find("\"num_shards\"") != std::string::npos) {
+        auto p = line.find(':');
+        if (p != std::string::npos) numShards = (unsigned)std::stoul(line.substr(p+1));
+      }
+      if (line.find("\"k\"") != std::string::npos && line.find("\"seed\"") == std::string::npos) {
+        auto p = line.find(':');
+        if (p != std::string::npos) k_out = (uint64_t)std::stoull(line.substr(p+1));
+      }
+      if (line.find("\"both_strands\"") != std::string::npos) {
+        idx.both_strands = line.find("true") != std::string::npos;
+      }
+      if (line.find("\"sources\"") != std::string::npos) {
+        idx.sources_line = (long)lines.size() - 1;
+        parse_string_array_field(line, "\"sources\"", idx.sources);
+      }
+      if (line.find("\"shards\"") != std::string::npos) idx.shards_line = (long)lines.size() - 1;
+      continue;
+    }
+    ShardInfo si;
+    si.has_range = parse_u64_field(line, "\"start\"", si.start) && parse_u64_field(line, "\"end\"", si.end);
+    parse_u64_field(line, "\"ones\"", si.ones);
+    auto colon = line.find(':', fpos);
+    if (colon == std::string::npos) continue;
+    auto s1 = line.find('"', colon);
+    if (s1 == std::string::npos) continue;
+    auto s2 = line.find('"', s1 + 1);
+    if (s2 == std::string::npos) continue;
+    si.file = line.substr(s1 + 1, s2 - (s1 + 1));
+    parse_string_array_field(line, "\"deltas\"", si.deltas);
+    parse_string_field(line, "\"counts\"", si.counts);
+    parse_string_field(line, "\"node\"", si.node);
+    si.line_no = lines.size() - 1;
+    shards.push_back(si);
+  }
+  if (numShards != 0 && shards.size() != numShards) return false;
+  return !shards.empty() && k_out > 0;
+}
+
+// The shards of <dir>/index.json sorted by start; every shard must carry its [start, end) range.
+static inline bool read_index_shards(const std::string& dir, uint64_t& k_out, std::vector<ShardInfo>& shards,
+                                     IndexLines* idx_out = nullptr) {
+  IndexLines local;
+  IndexLines& idx = idx_out ? *idx_out : local;
+  if (!read_index_lines(dir, idx, k_out, shards)) return false;
+  for (const auto& si : shards) {
+    if (!si.has_range) {
+      std::cerr << "Error: shard ranges missing in index.json (start/end)\n";
+      return false;
+    }
+  }
+  std::sort(shards.begin(), shards.end(),
+            [](const ShardInfo& a, const ShardInfo& b) { return a.start < b.start; });
+  return true;
+}
+
+// Exclusive lock on <shards>/index.json.lock, taken by every tool that rewrites index.json around
+// its read-modify-write; released when the descriptor is closed (or the process exits).
+static inline int lock_index(const std::string& dir) {
+  const std::string path = dir + "/index.json.lock";
+  const int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) { std::perror(("open " + path).c_str()); return -1; }
+  if (::flock(fd, LOCK_EX) != 0) { std::perror(("flock " + path).c_str()); ::close(fd); return -1; }
+  return fd;
+}
+
+// ---------------- GC histograms ----------------
+static constexpr uint64_t LOW_BITS = 0x5555555555555555ULL;
+
+// Number of C/G digits (1 and 2) among the k 2-bit digits of v.
+static inline int gc_count(uint64_t v, int k) {
+  uint64_t x = (v ^ (v >> 1)) & LOW_BITS;
+  if (k < 32) x &= (1ULL << (2 * k)) - 1ULL;
+  return __builtin_popcountll(x);
+}
+
+// hist[g] += #{ v in [0, x) : gc_count(v) == g } for k-digit values, x <= 4^k.
+// Digit DP: for each prefix that is strictly below x at position i, the remaining r digits
+// contribute C(r, g') * 2^r values with g' extra GC digits.
+static inline void add_prefix_gc_hist(uint64_t x, int k, std::vector<uint64_t>& hist, int64_t sign) {
+  const uint64_t total = 1ULL << (2 * k);
+  std::vector<std::vector<uint64_t>> binom((size_t)k + 1, std::vector<uint64_t>((size_t)k + 1, 0));
+  for (int n = 0; n <= k; ++n) {
+    binom[n][0] = 1;
+    for (int r = 1; r <= n; ++r) binom[n][r] = binom[n - 1][r - 1] + binom[n - 1][r];
+  }
+
+  if (x >= total) {
+    for (int g = 0; g <= k; ++g) hist[(size_t)g] += (uint64_t)(sign * (int64_t)(binom[k][g] << k));
+    return;
+  }
+
+  int prefix_gc = 0;
+  for (int i = k - 1; i >= 0; --i) {
+    const int digit = (int)((x >> (2 * i)) & 3ULL);
+    for (int c = 0; c < digit; ++c) {
+      const int base_gc = prefix_gc + ((c == 1 || c == 2) ? 1 : 0);
+      for (int g = 0; g <= i; ++g) {
+        hist[(size_t)(base_gc + g)] += (uint64_t)(sign * (int64_t)(binom[i][g] << i));
+      }
+    }
+    prefix_gc += (digit == 1 || digit == 2) ? 1 : 0;
+  }
+}
+
+// GC histogram of every value in [start, end).
+static inline std::vector<uint64_t> range_gc_hist(uint64_t start, uint64_t end, int k) {
+  std::vector<uint64_t> h((size_t)k + 1, 0);
+  add_prefix_gc_hist(end, k, h, +1);
+  add_prefix_gc_hist(start, k, h, -1);
+  return h;
+}
+
+// gc_hist_shards_<k>.json, as written by build_kmer_shards and friends.
+static inline std::string format_gc_hist_json(int k, const std::vector<std::vector<uint64_t>>& hists) {
+  std::ostringstream gh;
+  const size_t N = hists.size();
+  gh << "{\n  \"k\": " << k << ",\n  \"num_shards\": " << N << ",\n  \"shards\": [\n";
+  for (size_t sid = 0; sid < N; ++sid) {
+    gh << "    {\"shard\": " << sid << ", \"gc_hist\": [";
+    for (int g = 0; g <= k; ++g) gh << (g ? ", " : "") << hists[sid][(size_t)g];
+    gh << "]}" << (sid + 1 < N ? "," : "") << "\n";
+  }
+  gh << "  ]\n}\n";
+  return gh.str();
+}
+
+// Minimal reader for the gc_hist_shards_<k>.json schema; shards missing from it stay zero.
+static inline bool load_gc_hist_json(const std::string& path, int& k_out, std::vector<std::vector<uint64_t>>& hists_out) {
+  std::ifstream in(path);
+  if (!in) return false;
+  std::string s((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  auto skip_ws = [&](size_t& i){
+    while (i < s.size()) {
+      char c = s[i];
+      if (c==' '||c=='\n'||c=='\r'||c=='\t') i++;
+      else break;
+    }
+  };
+  auto parse_int = [&](size_t& i, long long& out)->bool{
+    skip_ws(i);
+    bool neg=false;
+    if (i < s.size() && s[i]=='-') { neg=true; i++; }
+    if (i >= s.size() || s[i]<'0' || s[i]>'9') return false;
+    long long v=0;
+    while (i < s.size() && s[i]>='0' && s[i]<='9') { v = v*10 + (s[i]-'0'); i++; }
+    out = neg ? -v : v;
+    return true;
+  };
+
+  // "k"
+  {
+    auto pos = s.find("\"k\"");
+    if (pos == std::string::npos) return false;
+    size_t i = pos;
+    if ((i = s.find(':', i)) == std::string::npos) return false;
+    i++;
+    long long kk=0;
+    if (!parse_int(i, kk)) return false;
+    k_out = (int)kk;
+    if (k_out <= 0 || k_out > 31) return false;
+  }
+
+  // optional "num_shards"
+  int num_shards = -1;
+  {
+    auto pos = s.find("\"num_shards\"");
+    if (pos != std::string::npos) {
+      size_t i = pos;
+      if ((i = s.find(':', i)) != std::string::npos) {
+        i++;
+        long long ns=0;
+        if (parse_int(i, ns)) num_shards = (int)ns;
+      }
+    }
+  }
+
+  if (num_shards > 0) {
+    hists_out.assign((size_t)num_shards, std::vector<uint64_t>((size_t)k_out+1, 0));
+  } else {
+    hists_out.clear();
+  }
+
+  size_t i = 0;
+  while (true) {
+    auto sp = s.find("\"shard\"", i);
+    if (sp == std::string::npos) break;
+    size_t j = sp;
+    if ((j = s.find(':', j)) == std::string::npos) break;
+    j++;
+    long long shard_id_ll=0;
+    if (!parse_int(j, shard_id_ll)) { i = sp+7; continue; }
+    int shard_id = (int)shard_id_ll;
+    i = j;
+
+    auto gh = s.find("\"gc_hist\"", i);
+    if (gh == std::string::npos) break;
+    size_t kpos = gh;
+    if ((kpos = s.find('[', kpos)) == std::string::npos) break;
+    kpos++;
+
+    if (shard_id < 0) { i = gh+8; continue; }
+    if ((size_t)shard_id >= hists_out.size()) {
+      hists_out.resize((size_t)shard_id + 1, std::vector<uint64_t>((size_t)k_out+1, 0));
+    }
+
+    for (int b=0; b<=k_out; ++b) {
+      long long v=0;
+      if (!parse_int(kpos, v)) return false;
+      hists_out[(size_t)shard_id][(size_t)b] = (uint64_t)v;
+      skip_ws(kpos);
+      if (b < k_out) {
+        if (kpos < s.size() && s[kpos] == ',') kpos++;
+      }
+    }
+    auto close = s.find(']', kpos);
+    if (close == std::string::npos) break;
+    i = close + 1;
+  }
+  return true;
+}
+
+// Binary manifest written by gc_hist_from_shards --bin:
+//   "GCHISTv1" | k (u64) | num_shards (u64) | num_shards * (k+1) u64 counts, little-endian.
+static inline bool load_gc_hist_bin(const std::string& path, int& k_out, std::vector<std::vector<uint64_t>>& hists_out) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) return false;
+  unsigned char hdr[24];
+  in.read((char*)hdr, 24);
+  if (!in || std::memcmp(hdr, "GCHISTv1", 8) != 0) return false;
+  const uint64_t k = read_le64(hdr + 8);
+  const uint64_t n = read_le64(hdr + 16);
+  if (k == 0 || k > 31 || n == 0 || n > (1u << 24)) return false;
+
+  std::vector<unsigned char> body((size_t)(n * (k + 1) * 8));
+  in.read((char*)body.data(), (std::streamsize)body.size());
+  if ((uint64_t)in.gcount() != body.size()) return false;
+
+  k_out = (int)k;
+  hists_out.assign((size_t)n, std::vector<uint64_t>((size_t)k + 1, 0));
+  const unsigned char* p = body.data();
+  for (uint64_t i = 0; i < n; ++i) {
+    for (uint64_t b = 0; b <= k; ++b, p += 8) hists_out[(size_t)i][(size_t)b] = read_le64(p);
+  }
+  return true;
+}
+
+// Accepts either the JSON histogram or the GCHISTv1 binary manifest (detected by magic).
+static inline bool load_gc_hist(const std::string& path, int& k_out, std::vector<std::vector<uint64_t>>& hists_out) {
+  {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    char magic[8] = {0};
+    in.read(magic, 8);
+    if (in && std::memcmp(magic, "GCHISTv1", 8) == 0) return load_gc_hist_bin(path, k_out, hists_out);
+  }
+  return load_gc_hist_json(path, k_out, hists_out);
+}
+
+#endif  // BARCODESDB_KBIT_IO_H
@@ -1,5 +1,16 @@
 // query_kmer_bitmap_single_fast.cpp
 // Faster single-threaded random-access k-mer existence queries for a KBITv1 roaring64 payload.
+//
+// Scatter-gather: a shard line in index.json may carry "node": "host:port" (or "unix:/path").
+// Those shards are looked up by a worker started on that node with
+//   query_kmer_bitmap --shards <same set> --serve host:port
+// and the per-shard results are merged back in input order. Every node uses the same index.json
+// (shard ids must agree); a worker only needs the shard files assigned to it, and serves at most
+// --threads lookups at once.
+//
+// Cold tier: shards compressed by tier_shards (KBIT flags=3, zstd frames) are decompressed on
+// load. When <shards>/access_counts exists, every shard lookup bumps that shard's counter there,
+// which tier_shards uses to decide which shards stay compressed.
 
 #include <algorithm>
 #include <atomic>
@@ -16,8 +27,19 @@
 #include <string_view>
 #include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
 
 struct Args {
   // Sharded mode
@@ -33,12 +55,23 @@ struct Args {
   std::string out;    // optional
 
   int threads = 4;
+
+  // Append the sources (index.json "sources", colors/<source>/) containing each k-mer
+  bool colors = false;
+
+  // Count layer (index.json "counts", written by count_kmer_shards)
+  bool counts = false;   // append the occurrence count (saturating at 255)
+  int min_count = -1;    // present only if count >= min_count
+  int max_count = -1;    // present only if count <= max_count
+
+  std::string serve;     // worker mode: serve shard lookups on this address
 };
 
 static void usage(const char* prog) {
   std::cerr << "Usage: " << prog
-            << " --shards <dir> [--k 16|17|18] [--kmers <file>] [--out <file>]"
-            << " [--threads N]\n";
+            << " --shards <dir> [--k 1..31] [--kmers <file>] [--out <file>]"
+            << " [--threads N] [--colors] [--counts] [--min-count N] [--max-count N]\n"
+            << "       " << prog << " --shards <dir> --serve <host:port|unix:path> [--threads N]\n";
 }
 
 static bool parse_args(int argc, char** argv, Args& a) {
@@ -50,6 +83,11 @@ static bool parse_args(int argc, char** argv, Args& a) {
     else if (s == "--kmers" && i + 1 < argc) a.kmers = argv[++i];
     else if (s == "--out" && i + 1 < argc) a.out = argv[++i];
     else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else if (s == "--colors") a.colors = true;
+    else if (s == "--counts") a.counts = true;
+    else if (s == "--min-count" && i + 1 < argc) a.min_count = std::max(0, std::atoi(argv[++i]));
+    else if (s == "--max-count" && i + 1 < argc) a.max_count = std::max(0, std::atoi(argv[++i]));
+    else if (s == "--serve" && i + 1 < argc) a.serve = argv[++i];
     else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
   }
 
@@ -57,17 +95,16 @@ static bool parse_args(int argc, char** argv, Args& a) {
     std::cerr << "Error: --shards is required (or --bitmap for legacy mode)\n";
     return false;
   }
-  if (a.k != -1 && !(a.k == 16 || a.k == 17 || a.k == 18)) {
-    std::cerr << "Error: --k must be 16, 17, or 18\n";
+  if (!a.serve.empty() && a.shards.empty()) {
+    std::cerr << "Error: --serve needs --shards\n";
+    return false;
+  }
+  if (a.k != -1 && (a.k < 1 || a.k > 31)) {
+    std::cerr << "Error: --k must be between 1 and 31\n";
     return false;
   }
   return true;
 }
-static inline uint64_t read_le64_u(const unsigned char* p) {
-  uint64_t v = 0;
-  for (int i = 0; i < 8; ++i) v |= (uint64_t)p[i] << (8 * i);
-  return v;
-}
 
 struct Header {
   uint64_t total_bits = 0;
@@ -86,29 +123,43 @@ static bool read_header(std::ifstream& f, Header& h) {
     std::cerr << "Error: bad magic (not a KBITv1 file)\n";
     return false;
   }
-  h.total_bits  = read_le64_u(hdr + 8);
-  h.ones        = read_le64_u(hdr + 16);
-  h.k           = read_le64_u(hdr + 24);
-  h.seed        = read_le64_u(hdr + 32);
-  h.flags       = read_le64_u(hdr + 40);
-  h.payload_len = read_le64_u(hdr + 48);
+  h.total_bits  = read_le64(hdr + 8);
+  h.ones        = read_le64(hdr + 16);
+  h.k           = read_le64(hdr + 24);
+  h.seed        = read_le64(hdr + 32);
+  h.flags       = read_le64(hdr + 40);
+  h.payload_len = read_le64(hdr + 48);
   return true;
 }
 
-static roaring64_bitmap_t* load_kbit_portable(const std::string& path, Header& H, std::vector<char>& buf) {
-  std::ifstream in(path, std::ios::binary);
-  if (!in) { std::perror(("open shard: " + path).c_str()); return nullptr; }
-  if (!read_header(in, H)) return nullptr;
+// Payload of a flags=2 (plain) or flags=3 (compressed) file, as portable roaring bytes.
+static bool read_kbit_payload(std::ifstream& in, const Header& H, const std::string& path,
+                              std::vector<char>& buf) {
+  if (H.flags == 3) {
+    if (!read_zstd_frames(in, H.payload_len, buf)) {
+      std::cerr << "Error: corrupt compressed payload in " << path << "\n";
+      return false;
+    }
+    return true;
+  }
   if (H.flags != 2) {
-    std::cerr << "Error: expected roaring payload (flags=2) in " << path << "\n";
-    return nullptr;
+    std::cerr << "Error: expected roaring payload (flags=2 or 3) in " << path << "\n";
+    return false;
   }
   buf.resize(H.payload_len);
   in.read(buf.data(), (std::streamsize)buf.size());
   if ((uint64_t)in.gcount() != H.payload_len) {
     std::cerr << "Error: truncated payload in " << path << "\n";
-    return nullptr;
+    return false;
   }
+  return true;
+}
+
+static roaring64_bitmap_t* load_kbit_portable(const std::string& path, Header& H, std::vector<char>& buf) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) { std::perror(("open shard: " + path).c_str()); return nullptr; }
+  if (!read_header(in, H)) return nullptr;
+  if (!read_kbit_payload(in, H, path, buf)) return nullptr;
   roaring64_bitmap_t* rbm = roaring64_bitmap_portable_deserialize_safe(buf.data(), buf.size());
   if (!rbm) { std::cerr << "Error: deserialization failed for " << path << "\n"; return nullptr; }
   return rbm;
@@ -118,30 +169,66 @@ static roaring64_bitmap_t* load_bitmap_file(const std::string& path, Header& H,
   std::ifstream in(path, std::ios::binary);
   if (!in) { std::perror(("open bitmap: " + path).c_str()); return nullptr; }
   if (!read_header(in, H)) return nullptr;
-  if (H.flags != 2) {
-    std::cerr << "Error: expected roaring payload (flags=2) in " << path << "\n";
-    return nullptr;
-  }
-  buf.resize(H.payload_len);
-  in.read(buf.data(), (std::streamsize)buf.size());
-  if ((uint64_t)in.gcount() != H.payload_len) {
-    std::cerr << "Error: truncated payload in " << path << "\n";
-    return nullptr;
-  }
+  if (!read_kbit_payload(in, H, path, buf)) return nullptr;
   roaring64_bitmap_t* rbm =
       roaring64_bitmap_portable_deserialize_safe(buf.data(), buf.size());
   if (!rbm) { std::cerr << "Error: deserialization failed for " << path << "\n"; return nullptr; }
   return rbm;
 }
 
-struct ShardInfo {
-  uint64_t start = 0;
-  uint64_t end = 0;
-  std::string file;
-};
+// KCNTv1 count layer: "KCNTv1\0\0" | n | width (8) | max (255) | n u8 counts indexed by rank in
+// the shard bitmap (base | deltas). `expected` guards against a layer built before later deltas.
+static bool load_count_layer(const std::string& path, uint64_t expected, std::vector<uint8_t>& counts) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) { std::perror(("open counts: " + path).c_str()); return false; }
+  unsigned char hdr[32];
+  in.read(reinterpret_cast<char*>(hdr), 32);
+  if (!in || std::memcmp(hdr, "KCNTv1\0", 8) != 0 || read_le64(hdr + 16) != 8) {
+    std::cerr << "Error: bad count layer header: " << path << "\n";
+    return false;
+  }
+  const uint64_t n = read_le64(hdr + 8);
+  if (n != expected) {
+    std::cerr << "Error: stale count layer " << path << " (" << n << " counts for " << expected
+              << " k-mers); rerun count_kmer_shards\n";
+    return false;
+  }
+  counts.resize(n);
+  in.read(reinterpret_cast<char*>(counts.data()), (std::streamsize)n);
+  if ((uint64_t)in.gcount() != n) {
+    std::cerr << "Error: truncated count layer: " << path << "\n";
+    return false;
+  }
+  return true;
+}
+
+// Base shard OR-ed with its delta layers, i.e. the shard as of the latest added genome.
+static roaring64_bitmap_t* load_shard_layers(const std::string& dir, const ShardInfo& si,
+                                             Header& H, std::vector<char>& buf) {
+  roaring64_bitmap_t* rbm = load_kbit_portable(dir + "/" + si.file, H, buf);
+  if (!rbm) return nullptr;
+  for (const auto& d : si.deltas) {
+    Header dh;
+    roaring64_bitmap_t* layer = load_kbit_portable(dir + "/" + d, dh, buf);
+    if (!layer) { roaring64_bitmap_free(rbm); return nullptr; }
+    roaring64_bitmap_or_inplace(rbm, layer);
+    roaring64_bitmap_free(layer);
+  }
+  return rbm;
+}
+
+// Per-source colour layer colors/<source>/<shard file>; a source without k-mers in the shard has
+// no file, which reads as an empty bitmap.
+static roaring64_bitmap_t* load_color_layer(const std::string& dir, const std::string& source,
+                                            const ShardInfo& si, Header& H, std::vector<char>& buf) {
+  const std::string path = dir + "/colors/" + source + "/" + si.file;
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0) return roaring64_bitmap_create();
+  return load_kbit_portable(path, H, buf);
+}
 
 static bool read_index_shards(const std::string& dir, unsigned& numShards, uint64_t& k_out,
-                              std::vector<ShardInfo>& shards) {
+                              std::vector<ShardInfo>& shards, std::vector<std::string>& sources) {
   std::ifstream in(dir + "/index.json");
   if (!in) return false;
 
@@ -149,6 +236,7 @@ static bool read_index_shards(const std::string& dir, unsigned& numShards, uint6
   numShards = 0;
   k_out = 0;
   shards.clear();
+  sources.clear();
 
   auto parse_u64_field = [&](const std::string& s, const std::string& key, uint64_t& out)->bool {
     auto pos = s.find(key);
@@ -172,6 +260,9 @@ static bool read_index_shards(const std::string& dir, unsigned& numShards, uint6
       auto p = line.find(':');
       if (p != std::string::npos) k_out = (uint64_t)std::stoull(line.substr(p+1));
     }
+    if (line.find("\"sources\"") != std::string::npos && line.find("\"file\"") == std::string::npos) {
+      parse_string_array_field(line, "\"sources\"", sources);
+    }
 
     auto fpos = line.find("\"file\"");
     if (fpos != std::string::npos) {
@@ -190,6 +281,9 @@ static bool read_index_shards(const std::string& dir, unsigned& numShards, uint6
       si.file = line.substr(s1 + 1, s2 - (s1 + 1));
       si.start = has_start ? start : 0;
       si.end = has_end ? end : 0;
+      parse_string_array_field(line, "\"deltas\"", si.deltas);
+      parse_string_field(line, "\"counts\"", si.counts);
+      parse_string_field(line, "\"node\"", si.node);
       shards.push_back(si);
     }
   }
@@ -300,6 +394,234 @@ struct FastLineReader {
   }
 };
 
+// ---------------- Per-shard lookup (local, or by a --serve worker) ----------------
+enum : uint8_t { LOOKUP_COUNTS = 1, LOOKUP_COLORS = 2 };
+
+struct ShardLookup {
+  std::vector<uint8_t> hit;      // 1 if present (base | deltas)
+  std::vector<uint8_t> count;    // LOOKUP_COUNTS: occurrence count, 0 if absent
+  std::vector<uint64_t> colors;  // LOOKUP_COLORS: color_words(S) words per value, bit c = sources[c]
+};
+
+// ---------------- Access counts (tier_shards) ----------------
+// <shards>/access_counts: one native u64 per shard, created by tier_shards. Mapped shared so the
+// counters of concurrent queries add up; without the file nothing is recorded.
+struct AccessCounts {
+  uint64_t* c = nullptr;
+  size_t n = 0;
+
+  void open(const std::string& dir, size_t num_shards) {
+    const std::string path = dir + "/access_counts";
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) return;
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && num_shards > 0 && (uint64_t)st.st_size == num_shards * sizeof(uint64_t)) {
+      void* p = ::mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) { c = static_cast<uint64_t*>(p); n = num_shards; }
+    }
+    ::close(fd);
+  }
+  void bump(size_t sid) { if (sid < n) __atomic_fetch_add(&c[sid], 1, __ATOMIC_RELAXED); }
+};
+static AccessCounts g_access_counts;
+
+static inline size_t color_words(size_t num_sources) { return (num_sources + 63) / 64; }
+
+static bool lookup_shard(const std::string& dir, const ShardInfo& si, const std::vector<std::string>& sources,
+                         const std::vector<uint64_t>& vals, uint8_t flags, ShardLookup& out,
+                         std::vector<char>& buf, std::vector<uint8_t>& count_buf) {
+  const size_t n = vals.size();
+  Header H;
+  roaring64_bitmap_t* sbm = load_shard_layers(dir, si, H, buf);
+  if (!sbm) return false;
+
+  out.hit.assign(n, 0);
+  for (size_t i = 0; i < n; ++i) out.hit[i] = roaring64_bitmap_contains(sbm, vals[i]) ? 1 : 0;
+
+  // Counts by rank in the same (base | deltas) bitmap.
+  out.count.assign((flags & LOOKUP_COUNTS) ? n : 0, 0);
+  if (flags & LOOKUP_COUNTS) {
+    if (si.counts.empty()) {
+      std::cerr << "Error: no count layer for " << si.file << " (run count_kmer_shards)\n";
+      roaring64_bitmap_free(sbm);
+      return false;
+    }
+    if (!load_count_layer(dir + "/" + si.counts, roaring64_bitmap_get_cardinality(sbm), count_buf)) {
+      roaring64_bitmap_free(sbm);
+      return false;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      if (out.hit[i]) out.count[i] = count_buf[roaring64_bitmap_rank(sbm, vals[i]) - 1];
+    }
+  }
+  roaring64_bitmap_free(sbm);
+
+  // One colour layer at a time, probed with the whole batch of this shard.
+  const size_t W = color_words(sources.size());
+  out.colors.assign((flags & LOOKUP_COLORS) ? n * W : 0, 0);
+  for (size_t c = 0; (flags & LOOKUP_COLORS) && c < sources.size(); ++c) {
+    Header ch;
+    roaring64_bitmap_t* cbm = load_color_layer(dir, sources[c], si, ch, buf);
+    if (!cbm) return false;
+    for (size_t i = 0; i < n; ++i) {
+      if (out.hit[i] && roaring64_bitmap_contains(cbm, vals[i])) out.colors[i * W + c / 64] |= 1ULL << (c % 64);
+    }
+    roaring64_bitmap_free(cbm);
+  }
+  return true;
+}
+
+// ---------------- Node sockets (scatter-gather) ----------------
+// Addresses are "host:port" (TCP) or "unix:/path/to.sock". One request per connection:
+//   request : "KQB1" | shard id (u32) | flags (u8) | n (u64) | n x u64 k-mer ids
+//   response: status (u8, 0 = ok) | n x u8 hit | [n x u8 count] | [n * W x u64 colour words]
+// Integers are in native byte order (workers run the same build as the coordinator). A request
+// carries at most kMaxNodeBatch ids (32 MiB); larger shard batches are split across requests.
+static constexpr uint64_t kMaxNodeBatch = 1ULL << 22;
+static bool send_all(int fd, const void* p, size_t n) {
+  const char* c = (const char*)p;
+  while (n > 0) {
+    ssize_t w = ::send(fd, c, n, MSG_NOSIGNAL);
+    if (w <= 0) return false;
+    c += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, void* p, size_t n) {
+  char* c = (char*)p;
+  while (n > 0) {
+    ssize_t r = ::recv(fd, c, n, 0);
+    if (r <= 0) return false;
+    c += r;
+    n -= (size_t)r;
+  }
+  return true;
+}
+
+static int open_node_socket(const std::string& addr, bool listen_mode) {
+  if (addr.compare(0, 5, "unix:") == 0) {
+    sockaddr_un sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    const std::string path = addr.substr(5);
+    if (path.size() >= sizeof(sa.sun_path)) return -1;
+    std::memcpy(sa.sun_path, path.c_str(), path.size());
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (listen_mode) {
+      ::unlink(path.c_str());
+      if (::bind(fd, (sockaddr*)&sa, sizeof(sa)) == 0 && ::listen(fd, 128) == 0) return fd;
+    } else if (::connect(fd, (sockaddr*)&sa, sizeof(sa)) == 0) {
+      return fd;
+    }
+    ::close(fd);
+    return -1;
+  }
+
+  auto colon = addr.rfind(':');
+  if (colon == std::string::npos) return -1;
+  const std::string host = addr.substr(0, colon);
+  const std::string port = addr.substr(colon + 1);
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (listen_mode) hints.ai_flags = AI_PASSIVE;
+  addrinfo* res = nullptr;
+  if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+  int fd = -1;
+  for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+    fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) continue;
+    if (listen_mode) {
+      int one = 1;
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (::bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, 128) == 0) break;
+    } else if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    ::close(fd);
+    fd = -1;
+  }
+  ::freeaddrinfo(res);
+  return fd;
+}
+
+static bool lookup_shard_remote(const std::string& node, uint32_t sid, size_t num_sources,
+                                const std::vector<uint64_t>& vals, uint8_t flags, ShardLookup& out) {
+  const size_t C = (flags & LOOKUP_COUNTS) ? 1 : 0;
+  const size_t W = (flags & LOOKUP_COLORS) ? color_words(num_sources) : 0;
+  out.hit.resize(vals.size());
+  out.count.resize(vals.size() * C);
+  out.colors.resize(vals.size() * W);
+  bool ok = true;
+  for (size_t off = 0; ok && off < vals.size(); off += kMaxNodeBatch) {
+    int fd = open_node_socket(node, false);
+    if (fd < 0) { std::cerr << "Error: cannot connect to node " << node << "\n"; return false; }
+    const uint64_t n = std::min<uint64_t>(kMaxNodeBatch, vals.size() - off);
+    ok = send_all(fd, "KQB1", 4) && send_all(fd, &sid, 4) && send_all(fd, &flags, 1) &&
+         send_all(fd, &n, 8) && send_all(fd, vals.data() + off, n * sizeof(uint64_t));
+    uint8_t status = 1;
+    ok = ok && recv_all(fd, &status, 1) && status == 0;
+    ok = ok && recv_all(fd, out.hit.data() + off, n) &&
+         recv_all(fd, out.count.data() + off * C, n * C) &&
+         recv_all(fd, out.colors.data() + off * W, n * W * sizeof(uint64_t));
+    ::close(fd);
+  }
+  if (!ok) std::cerr << "Error: lookup of shard " << sid << " failed on node " << node << "\n";
+  return ok;
+}
+
+static int serve_lookups(const Args& args, const std::vector<ShardInfo>& shards,
+                         const std::vector<std::string>& sources) {
+  int lfd = open_node_socket(args.serve, true);
+  if (lfd < 0) { std::perror(("listen " + args.serve).c_str()); return 2; }
+  std::cerr << "[INFO] Serving " << shards.size() << " shard(s) of " << args.shards
+            << " on " << args.serve << "\n";
+
+  // A fixed pool of --threads workers, each accepting and serving one connection at a time; a
+  // peer that stalls mid-request is dropped after the receive timeout.
+  std::vector<std::thread> pool;
+  for (int t = 0; t < args.threads; ++t) {
+    pool.emplace_back([lfd, &args, &shards, &sources]() {
+      while (true) {
+        int fd = ::accept(lfd, nullptr, nullptr);
+        if (fd < 0) continue;
+        timeval tv{60, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char magic[4];
+        uint32_t sid = 0;
+        uint8_t flags = 0;
+        uint64_t n = 0;
+        std::vector<uint64_t> vals;
+        bool ok = recv_all(fd, magic, 4) && std::memcmp(magic, "KQB1", 4) == 0 &&
+                  recv_all(fd, &sid, 4) && recv_all(fd, &flags, 1) && recv_all(fd, &n, 8) &&
+                  sid < shards.size() && n <= kMaxNodeBatch;
+        if (ok) {
+          vals.resize(n);
+          ok = recv_all(fd, vals.data(), n * sizeof(uint64_t));
+        }
+        ShardLookup res;
+        std::vector<char> buf;
+        std::vector<uint8_t> count_buf;
+        ok = ok && lookup_shard(args.shards, shards[sid], sources, vals, flags, res, buf, count_buf);
+        if (ok) g_access_counts.bump(sid);
+        const uint8_t status = ok ? 0 : 1;
+        if (send_all(fd, &status, 1) && ok) {
+          (void)(send_all(fd, res.hit.data(), res.hit.size()) &&
+                 send_all(fd, res.count.data(), res.count.size()) &&
+                 send_all(fd, res.colors.data(), res.colors.size() * sizeof(uint64_t)));
+        }
+        ::close(fd);
+      }
+    });
+  }
+  for (auto& th : pool) th.join();
+  return 0;
+}
+
 int main(int argc, char** argv) {
   std::ios::sync_with_stdio(false);
 
@@ -313,16 +635,31 @@ int main(int argc, char** argv) {
   unsigned numShards = 0;
   uint64_t k_from_index = 0;
   std::vector<ShardInfo> shards;
+  std::vector<std::string> sources;
 
   if (!args.shards.empty()) {
-    if (!read_index_shards(args.shards, numShards, k_from_index, shards)) {
+    if (!read_index_shards(args.shards, numShards, k_from_index, shards, sources)) {
       std::cerr << "Error: failed to read shards index: " << args.shards << "/index.json\n";
       return 2;
     }
+    g_access_counts.open(args.shards, shards.size());
   } else {
     rbm = load_bitmap_file(args.bitmap, H, buf);
     if (!rbm) return 2;
   }
+  const bool use_counts = args.counts || args.min_count >= 0 || args.max_count >= 0;
+  if (use_counts && args.shards.empty()) {
+    std::cerr << "Error: --counts/--min-count/--max-count need --shards\n";
+    if (rbm) roaring64_bitmap_free(rbm);
+    return 2;
+  }
+  if (args.colors && sources.empty()) {
+    std::cerr << "Error: --colors needs a shard set with \"sources\" in index.json\n";
+    if (rbm) roaring64_bitmap_free(rbm);
+    return 2;
+  }
+
+  if (!args.serve.empty()) return serve_lookups(args, shards, sources);
 
   int k_fixed = (args.shards.empty()) ? (int)H.k : (int)k_from_index;
   if (args.k != -1 && k_fixed != args.k) {
@@ -330,8 +667,9 @@ int main(int argc, char** argv) {
     if (rbm) roaring64_bitmap_free(rbm);
     return 2;
   }
-  if (!(k_fixed == 16 || k_fixed == 17 || k_fixed == 18)) {
-    std::cerr << "Error: unsupported bitmap k=" << k_fixed << " (expected 16/17/18)\n";
+  // K-mers are packed 2 bits per base into a uint64_t.
+  if (k_fixed < 1 || k_fixed > 31) {
+    std::cerr << "Error: unsupported bitmap k=" << k_fixed << " (expected 1..31)\n";
     if (rbm) roaring64_bitmap_free(rbm);
     return 2;
   }
@@ -385,6 +723,8 @@ int main(int argc, char** argv) {
   }
 
   std::vector<char> hits(kmers.size(), '0');
+  std::vector<std::string> colors(args.colors ? kmers.size() : 0);
+  std::vector<uint8_t> counts(use_counts ? kmers.size() : 0, 0);
 
   if (!args.shards.empty()) {
     if (shards.empty()) {
@@ -395,6 +735,12 @@ int main(int argc, char** argv) {
     }
 
     for (auto& s : shards) {
+      if (use_counts && s.counts.empty() && s.node.empty()) {
+        std::cerr << "Error: no count layer for " << s.file << " (run count_kmer_shards)\n";
+        if (fout != stdout) std::fclose(fout);
+        if (fin != stdin) std::fclose(fin);
+        return 2;
+      }
       if (s.end <= s.start) {
         std::cerr << "Error: shard ranges missing in index.json (start/end)\n";
         if (fout != stdout) std::fclose(fout);
@@ -416,6 +762,9 @@ int main(int argc, char** argv) {
     }
 
     std::atomic<size_t> next_shard(0);
+    std::atomic<bool> lookup_error(false);
+    const uint8_t flags = (use_counts ? LOOKUP_COUNTS : 0) | (args.colors ? LOOKUP_COLORS : 0);
+    const size_t W = color_words(sources.size());
     int thread_count = std::min<int>(args.threads, (int)shards.size());
     std::vector<std::thread> pool;
     pool.reserve((size_t)thread_count);
@@ -423,38 +772,72 @@ int main(int argc, char** argv) {
     for (int t = 0; t < thread_count; ++t) {
       pool.emplace_back([&]() {
         std::vector<char> local_buf;
-        Header local_h;
+        std::vector<uint8_t> local_counts;
+        std::vector<uint64_t> vals;
+        ShardLookup res;
         while (true) {
           size_t sid = next_shard.fetch_add(1);
           if (sid >= shards.size()) break;
-          if (shard_to_indices[sid].empty()) continue;
-
-          const std::string shard_path = args.shards + "/" + shards[sid].file;
-          roaring64_bitmap_t* sbm = load_kbit_portable(shard_path, local_h, local_buf);
-          if (!sbm) continue;
-
-          for (size_t idx_pos : shard_to_indices[sid]) {
-            uint64_t val = kmer_vals[idx_pos];
-            hits[idx_pos] = roaring64_bitmap_contains(sbm, val) ? '1' : '0';
+          const auto& idxs = shard_to_indices[sid];
+          if (idxs.empty()) continue;
+
+          vals.resize(idxs.size());
+          for (size_t j = 0; j < idxs.size(); ++j) vals[j] = kmer_vals[idxs[j]];
+          const bool ok = shards[sid].node.empty()
+              ? lookup_shard(args.shards, shards[sid], sources, vals, flags, res, local_buf, local_counts)
+              : lookup_shard_remote(shards[sid].node, (uint32_t)sid, sources.size(), vals, flags, res);
+          if (!ok) { lookup_error = true; continue; }
+          if (shards[sid].node.empty()) g_access_counts.bump(sid);
+
+          // Gather back in input order; the thresholds turn rare (or overly common) k-mers into misses.
+          for (size_t j = 0; j < idxs.size(); ++j) {
+            const size_t idx_pos = idxs[j];
+            bool hit = res.hit[j] != 0;
+            if (use_counts) {
+              const uint8_t c = res.count[j];
+              counts[idx_pos] = c;
+              if ((args.min_count >= 0 && c < args.min_count) ||
+                  (args.max_count >= 0 && c > args.max_count)) hit = false;
+            }
+            hits[idx_pos] = hit ? '1' : '0';
+            if (!args.colors || !hit) continue;
+            std::string& col = colors[idx_pos];
+            for (size_t c = 0; c < sources.size(); ++c) {
+              if (!(res.colors[j * W + c / 64] >> (c % 64) & 1ULL)) continue;
+              if (!col.empty()) col.push_back(',');
+              col += sources[c];
+            }
           }
-          roaring64_bitmap_free(sbm);
         }
       });
     }
     for (auto& th : pool) th.join();
+    if (lookup_error) {
+      if (fout != stdout) std::fclose(fout);
+      if (fin != stdin) std::fclose(fin);
+      return 2;
+    }
   } else {
     for (size_t i = 0; i < kmer_vals.size(); ++i) {
       hits[i] = roaring64_bitmap_contains(rbm, kmer_vals[i]) ? '1' : '0';
     }
   }
 
-  // Reuse output line buffer (max 18 + tab + 1 + \n)
+  // Reuse output line buffer (max 18 + tab + 1 + \n, plus the count / source list columns)
   std::string out_line;
   out_line.reserve(32);
   for (size_t i = 0; i < kmers.size(); ++i) {
     out_line.assign(kmers[i]);
     out_line.push_back('\t');
     out_line.push_back(hits[i]);
+    if (args.counts) {
+      out_line.push_back('\t');
+      out_line += std::to_string((unsigned)counts[i]);
+    }
+    if (args.colors) {
+      out_line.push_back('\t');
+      out_line += colors[i].empty() ? "-" : colors[i];
+    }
     out_line.push_back('\n');
     std::fwrite(out_line.data(), 1, out_line.size(), fout);
   }
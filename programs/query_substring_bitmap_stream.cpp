@@ -11,13 +11,92 @@
 //        producing much more prefix diversity than single-shard draining.
 // - NEW: --reverse_complement (default off). When set and --substring is set,
 //        matches substring OR reverse-complement(substring).
+// - --substring takes IUPAC codes. N, R, Y, K and M fix at most one bit per base and stay
+//        mask/bits patterns; placements with S, W, B, D, H or V become per-digit masks matched
+//        with four ANDs. The m-mer index expands each window into the m-mers it allows.
+// - --absent-in / --present-in S1,S2,...: source filters over the colour layers
+//        (index.json "sources", colors/<source>/). Instead of "absent from every genome", a
+//        k-mer must be absent from each --absent-in source and present in each --present-in
+//        source. Only for construct_k == k0.
+// - --min-count / --max-count N: with a count layer (count_kmer_shards), a k-mer only counts as
+//        present when its occurrence count is in [min, max]; rarer ones are treated as absent.
+// - Scatter-gather: shards whose index.json line has "stream_node": "host:port" (or "unix:/path")
+//        are refilled by a worker on that node, started with
+//          query_substring_bitmap_stream --shards <same set> --serve host:port
+//        The worker runs refill_lane on its local shard and returns the buffer (plus expansion
+//        resume points); lane order, emission and the cursor stay on the coordinator. It serves
+//        at most --threads refills at once; further connections wait in the listen backlog.
+// - m-mer chunk index: when index.json names an "mmer_index" (build_mmer_index), a konly substring
+//        query intersects the chunk bitmaps of the substring's m-mers, scans only candidate chunks
+//        and never loads shards without one. Not used with source or count filters, which change
+//        the absent set the index was built for.
+// - construct_k up to 64: kout-mers and expansion indices are uint64_t while kout <= 32 and
+//        unsigned __int128 beyond (run_stream<V>); k0 shards themselves stay 64-bit.
+// - --max-homopolymer N / --max-dinuc-repeat N: drop k-mers with a run of more than N identical
+//        bases, or more than N consecutive copies of a two-base unit (ACACAC = 3). Checked in
+//        leaf_ok on the packed value; in expansion, parents over the limits are skipped whole.
+// - --max-self-rc-stem m: drop k-mers in which a stretch of more than m bases is the reverse
+//        complement of another (or the same) stretch: hairpin stems and palindromes. The packed
+//        value is compared with its bit-reversed complement at every shift.
+// - --avoid-rc-with A1,A2,... [--max-adapter-stem m]: drop k-mers pairing with an adapter over more
+//        than m bases (default: the --max-self-rc-stem value), via a precomputed mask set of the
+//        adapters' reverse-complement windows at every position.
+// - --tm-min / --tm-max C [--na-mm 50] [--oligo-nm 50]: SantaLucia (1998) nearest-neighbour Tm
+//        window with the entropy salt correction. dH/dS are summed over the k-1 dinucleotide steps
+//        of the packed value (16-entry table); in expansion, parents whose children cannot reach
+//        the window under per-step table extremes are skipped whole.
+// - --position-class P:C,P1-P2:C / --base-count C:lo-hi: IUPAC class per 1-based position, and
+//        how many bases of class C (or * for each base) a k-mer holds. Compiled into per-digit
+//        position masks and popcounts on the packed value; the scan jumps past offending prefixes,
+//        and in expansion a layout whose parent breaks a position class is skipped whole.
+// - --require S1,S2,... (repeatable) / --forbid S1,S2,...: IUPAC substring sets. Each --require
+//        is a group of alternatives of which one must occur; every group must match. No --forbid
+//        pattern may occur: checked first, behind a lookup table of the patterns' w-mer prefixes,
+//        and the scan jumps past prefixes that already hold one.
+// - --both-strands-absent: a k-mer is only emitted if its reverse complement is absent too. The
+//        reverse complement usually lies in another shard; its lane bitmap comes from a shard cache
+//        shared by all lanes (one bitmap per shard stays resident). In expansion the parent's
+//        reverse complement must be absent. Remote workers check against their own cache.
+// - --minimal-absent <dir>: keep minimal absent words, absent k-mers whose (k-1)-mer prefix and
+//        suffix are both present in the k-1 shard set at <dir> (shards_17 for k=18). Each refill
+//        collects its candidates, sorts their prefix/suffix lookups and joins them shard by shard
+//        (one cached bitmap per shard, probed in order). Workers take the set at --serve.
+// - --robust d (d <= 3): keep only absent k-mers whose every neighbour within d substitutions is
+//        absent too, so a read with up to d errors cannot be mistaken for a present sequence.
+//        The neighbourhood is walked base by base from the top, routing each prefix range to the
+//        shards it spans (bitmaps from the shared shard cache, held for the refill); ranges with
+//        nothing present are pruned whole and the first present neighbour rejects the k-mer.
+//        For d = 1 the set written by dilate_shards gives the same k-mers as a plain scan.
+// - --min-hamming d [--set-size N]: greedy barcode set selection. Emitted k-mers are accepted only
+//        if at least d mismatches from every k-mer accepted so far (pigeonhole block index), until
+//        N are selected; the accepted set travels in the cursor ('H' section), so paging
+//        continues the same set.
+// - --min-edit d [--set-size N]: the same with Levenshtein distance (indel-prone platforms):
+//        shifted-block pigeonhole index over the accepted set, bit-parallel Myers verification
+//        ('E' section).
+// - --color-balance 2|4 --set-size N [--min-channel-share 0.25]: Illumina colour-balanced set. Both
+//        channels (two-channel or four-colour chemistry) must be lit at every position by at least
+//        that share of the N k-mers; per-position channel counts of the accepted set are held to
+//        the share as it grows, scored on the packed value. A lane whose next k-mer does not fit
+//        waits; when all do, one rescans with the full positions as position classes. Combines
+//        with --min-hamming / --min-edit; the set travels in the cursor ('B' or 'C' trailer).
+// - --exclude-near <file> --exclude-d d: drop k-mers within d-1 mismatches of any barcode in the
+//        file (one per line, an existing panel). The list is indexed once (pigeonhole blocks with
+//        per-block presence bitmaps) and checked in leaf_ok; workers receive it with each refill
+//        and keep its index.
+// - --start-after <k-mer> / --range LO:HI: scan only k-mers after the given one and/or between
+//        two prefixes (LO padded with A, HI with T, both inclusive). Shards outside the range are
+//        never loaded and a lane starts at the first in-range value of its shard, so exports can
+//        be split by range across machines or resumed alphabetically without a cursor.
+// - Cold tier: KBIT flags=3 shards (zstd frames, see tier_shards) are decompressed on load, and
+//        each shard load bumps its counter in <shards>/access_counts when that file exists.
 //
 // Output:
 //   __META__ <cursor> <hasMore 0/1> <returned_count> <kout>
 //   then one k-mer per line.
 //
-// Cursor (BCW2):
-//  magic 'B','C','W','2'
+// Cursor (BCW2; BCW3 for kout > 32):
+//  magic 'B','C','W','2' ('3' when left_idx/right_idx below are 16 bytes)
 //  flags(u8): bit0=random_access
 //  k0(u8), kout(u8), d(u8)
 //  numShards(u32)
@@ -38,6 +117,10 @@
 //           child_present(u8)     // 1 if mid-parent expansion
 //           if child_present:
 //              L(u8), left_idx(u64), right_idx(u64)
+//  optional set selection section:
+//     'H' (Hamming), 'E' (edit distance) or 'B' (colour balance only, d=0), d(u8), set_size(u32), count(u32),
+//     count x LEB128 deltas of the sorted selected k-mers
+//     then, with --color-balance: 'C', channels(u8), min_channel_share(u16, permille)
 //
 // Notes:
 // - For kout==k0, we can still use GC-hist skipping at shard selection time.
@@ -45,7 +128,7 @@
 //
 // Compile:
 //   g++ -O3 -march=native -mtune=native -std=c++17 -pthread \
-//     query_substring_bitmap_stream_windowed_mix_complete.cpp -lroaring \
+//     query_substring_bitmap_stream_windowed_mix_complete.cpp -lroaring -lzstd \
 //     -o query_substring_bitmap_stream_windowed_mix
 //
 // Example:
@@ -59,19 +142,36 @@
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <list>
 #include <random>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
 
 using namespace std;
 using Clock = std::chrono::steady_clock;
@@ -83,9 +183,7 @@ static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return
 struct KbitHeader {
   uint64_t total_bits=0, ones=0, k=0, seed=0, flags=0, payload_len=0;
 };
-static inline uint64_t read_le64(const unsigned char* p) {
-  uint64_t v=0; for(int i=0;i<8;i++) v |= (uint64_t)p[i] << (8*i); return v;
-}
+
 static roaring64_bitmap_t* load_kbit_portable(const string& path, KbitHeader& h) {
   ifstream in(path, ios::binary);
   if (!in) { perror(("open " + path).c_str()); return nullptr; }
@@ -103,22 +201,150 @@ static roaring64_bitmap_t* load_kbit_portable(const string& path, KbitHeader& h)
   h.flags       = read_le64(hdr + 40);
   h.payload_len = read_le64(hdr + 48);
 
-  if (h.flags != 2) {
-    cerr << "Shard not portable flags=2: " << path << "\n";
+  if (h.flags != 2 && h.flags != 3) {
+    cerr << "Shard not portable flags=2 or 3: " << path << "\n";
     return nullptr;
   }
 
-  vector<char> payload(h.payload_len);
-  in.read(payload.data(), (streamsize)h.payload_len);
-  if ((uint64_t)in.gcount() != h.payload_len) {
-    cerr << "Truncated shard payload: " << path << "\n";
-    return nullptr;
+  vector<char> payload;
+  if (h.flags == 3) {
+    if (!read_zstd_frames(in, h.payload_len, payload)) {
+      cerr << "Corrupt compressed shard payload: " << path << "\n";
+      return nullptr;
+    }
+  } else {
+    payload.resize(h.payload_len);
+    in.read(payload.data(), (streamsize)h.payload_len);
+    if ((uint64_t)in.gcount() != h.payload_len) {
+      cerr << "Truncated shard payload: " << path << "\n";
+      return nullptr;
+    }
   }
   roaring64_bitmap_t* bm = roaring64_bitmap_portable_deserialize_safe(payload.data(), payload.size());
   if (!bm) cerr << "Deserialize failed for shard: " << path << "\n";
   return bm;
 }
 
+// ---------------- Access counts (tier_shards) ----------------
+// <shards>/access_counts: one native u64 per shard, created by tier_shards. Mapped shared so the
+// counters of concurrent queries add up; without the file nothing is recorded.
+struct AccessCounts {
+  uint64_t* c = nullptr;
+  size_t n = 0;
+
+  void open(const string& dir, size_t num_shards) {
+    const string path = dir + "/access_counts";
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) return;
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && num_shards > 0 && (uint64_t)st.st_size == num_shards * sizeof(uint64_t)) {
+      void* p = ::mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) { c = (uint64_t*)p; n = num_shards; }
+    }
+    ::close(fd);
+  }
+  void bump(size_t shardIdx) { if (shardIdx < n) __atomic_fetch_add(&c[shardIdx], 1, __ATOMIC_RELAXED); }
+};
+static AccessCounts g_access_counts;
+
+// Base shard OR-ed with its delta layers (index.json "deltas"), if any.
+static roaring64_bitmap_t* load_shard_layers(const string& dir, const string& file,
+                                             const vector<string>& deltas, KbitHeader& h) {
+  roaring64_bitmap_t* bm = load_kbit_portable(dir + "/" + file, h);
+  if (!bm) return nullptr;
+  for (const auto& d : deltas) {
+    KbitHeader dh;
+    roaring64_bitmap_t* layer = load_kbit_portable(dir + "/" + d, dh);
+    if (!layer) { roaring64_bitmap_free(bm); return nullptr; }
+    roaring64_bitmap_or_inplace(bm, layer);
+    roaring64_bitmap_free(layer);
+  }
+  return bm;
+}
+
+// KCNTv1 count layer (count_kmer_shards): u8 saturating counts indexed by rank in `bm`.
+// Returns the present values whose count lies in [min_count, max_count] (-1 = unbounded).
+static roaring64_bitmap_t* apply_count_threshold(const string& path, const roaring64_bitmap_t* bm,
+                                                 int min_count, int max_count) {
+  ifstream in(path, ios::binary);
+  if (!in) { perror(("open " + path).c_str()); return nullptr; }
+  unsigned char hdr[32];
+  in.read((char*)hdr, 32);
+  if (!in || memcmp(hdr, "KCNTv1\0", 8) != 0 || read_le64(hdr + 16) != 8) {
+    cerr << "Invalid count layer header: " << path << "\n";
+    return nullptr;
+  }
+  const uint64_t n = read_le64(hdr + 8);
+  if (n != roaring64_bitmap_get_cardinality(bm)) {
+    cerr << "Stale count layer (rerun count_kmer_shards): " << path << "\n";
+    return nullptr;
+  }
+  vector<uint8_t> counts(n);
+  in.read((char*)counts.data(), (streamsize)n);
+  if ((uint64_t)in.gcount() != n) {
+    cerr << "Truncated count layer: " << path << "\n";
+    return nullptr;
+  }
+
+  roaring64_bitmap_t* kept = roaring64_bitmap_create();
+  vector<uint64_t> batch(1 << 16), out;
+  out.reserve(batch.size());
+  roaring64_iterator_t* it = roaring64_iterator_create(bm);
+  uint64_t rank = 0, got;
+  while ((got = roaring64_iterator_read(it, batch.data(), batch.size())) > 0) {
+    out.clear();
+    for (uint64_t i = 0; i < got; ++i, ++rank) {
+      const int c = counts[rank];
+      if ((min_count < 0 || c >= min_count) && (max_count < 0 || c <= max_count)) out.push_back(batch[i]);
+    }
+    roaring64_bitmap_add_many(kept, out.size(), out.data());
+  }
+  roaring64_iterator_free(it);
+  roaring64_bitmap_run_optimize(kept);
+  return kept;
+}
+
+// Colour layer colors/<source>/<file>; no file means the source has no k-mers in that shard.
+static roaring64_bitmap_t* load_color_layer(const string& dir, const string& source, const string& file) {
+  const string path = dir + "/colors/" + source + "/" + file;
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0) return roaring64_bitmap_create();
+  KbitHeader h;
+  return load_kbit_portable(path, h);
+}
+
+// Bitmap of k-mers in [start, end) that fail the source filters, so the scan can keep skipping
+// "present" values as usual: absent-in sources OR-ed, plus the complement of the present-in AND.
+static roaring64_bitmap_t* load_source_filter(const string& dir, const string& file,
+                                              const vector<string>& absent_in,
+                                              const vector<string>& present_in,
+                                              uint64_t start, uint64_t end) {
+  roaring64_bitmap_t* blocked = roaring64_bitmap_create();
+  for (const auto& src : absent_in) {
+    roaring64_bitmap_t* c = load_color_layer(dir, src, file);
+    if (!c) { roaring64_bitmap_free(blocked); return nullptr; }
+    roaring64_bitmap_or_inplace(blocked, c);
+    roaring64_bitmap_free(c);
+  }
+  if (!present_in.empty()) {
+    roaring64_bitmap_t* need = nullptr;
+    for (const auto& src : present_in) {
+      roaring64_bitmap_t* c = load_color_layer(dir, src, file);
+      if (!c) { if (need) roaring64_bitmap_free(need); roaring64_bitmap_free(blocked); return nullptr; }
+      if (!need) need = c;
+      else { roaring64_bitmap_and_inplace(need, c); roaring64_bitmap_free(c); }
+    }
+    roaring64_bitmap_t* missing = roaring64_bitmap_create();
+    if (end > start) roaring64_bitmap_add_range_closed(missing, start, end - 1);
+    roaring64_bitmap_andnot_inplace(missing, need);
+    roaring64_bitmap_or_inplace(blocked, missing);
+    roaring64_bitmap_free(missing);
+    roaring64_bitmap_free(need);
+  }
+  roaring64_bitmap_run_optimize(blocked);
+  return blocked;
+}
+
 // ---------------- DNA helpers ----------------
 static inline int base4_digit(char c){
   switch(c){
@@ -130,9 +356,42 @@ static inline int base4_digit(char c){
   }
 }
 static inline char base4_char(int d){ return "ACGT"[d&3]; }
-static string decode_kmer(uint64_t val, int k){
+// IUPAC code -> set of base4 digits (bit d for digit d: A=1, C=2, G=4, T=8); 0 if not a code.
+static inline int iupac_digits(char c){
+  switch(c){
+    case 'A': case 'a': return 1;
+    case 'C': case 'c': return 2;
+    case 'G': case 'g': return 4;
+    case 'T': case 't': case 'U': case 'u': return 8;
+    case 'R': case 'r': return 1|4;
+    case 'Y': case 'y': return 2|8;
+    case 'S': case 's': return 2|4;
+    case 'W': case 'w': return 1|8;
+    case 'K': case 'k': return 4|8;
+    case 'M': case 'm': return 1|2;
+    case 'B': case 'b': return 2|4|8;
+    case 'D': case 'd': return 1|4|8;
+    case 'H': case 'h': return 1|2|8;
+    case 'V': case 'v': return 1|2|4;
+    case 'N': case 'n': return 15;
+    default: return 0;
+  }
+}
+// True if q (IUPAC codes allowed) matches the plain sequence s at some offset.
+static bool iupac_find(const string& s, const string& q) {
+  for (size_t i = 0; i + q.size() <= s.size(); ++i) {
+    size_t j = 0;
+    while (j < q.size() && (iupac_digits(q[j]) >> base4_digit(s[i + j]) & 1)) ++j;
+    if (j == q.size()) return true;
+  }
+  return false;
+}
+// V is uint64_t, or u128 for expansion beyond k=32 (2 bits per base).
+using u128 = unsigned __int128;
+template <class V>
+static string decode_kmer(V val, int k){
   string s(k,' ');
-  for(int i=k-1;i>=0;--i){ s[i]=base4_char((int)(val&3ULL)); val>>=2; }
+  for(int i=k-1;i>=0;--i){ s[i]=base4_char((int)(val&3)); val>>=2; }
   return s;
 }
 
@@ -146,6 +405,16 @@ static inline char dna_comp(char c) {
     case 'g': return 'c';
     case 'T': return 'A';
     case 't': return 'a';
+    // IUPAC codes complement to the code of the complemented set.
+    case 'R': return 'Y';
+    case 'Y': return 'R';
+    case 'K': return 'M';
+    case 'M': return 'K';
+    case 'B': return 'V';
+    case 'V': return 'B';
+    case 'D': return 'H';
+    case 'H': return 'D';
+    case 'S': case 'W': case 'N': return c;
     default:  return '?';
   }
 }
@@ -160,10 +429,11 @@ static string revcomp_string(const string& s) {
 }
 
 // ---------------- Filters ----------------
-static inline bool passes_gc_percent(uint64_t v, int k, int gcMinPct, int gcMaxPct) {
+template <class V>
+static inline bool passes_gc_percent(V v, int k, int gcMinPct, int gcMaxPct) {
   int gc = 0;
   for (int i = 0; i < k; ++i) {
-    uint64_t d = v & 3ULL;
+    uint64_t d = (uint64_t)(v & 3);
     gc += (d == 1ULL) | (d == 2ULL);
     v >>= 2;
   }
@@ -174,17 +444,628 @@ static inline bool passes_gc_percent(uint64_t v, int k, int gcMinPct, int gcMaxP
 }
 
 // Substring patterns for fast check via masks
-struct Pattern { uint64_t mask, bits; };
-static inline bool contains_sub(uint64_t v, const Pattern* pats, size_t np) {
+template <class V> struct PatternT { V mask, bits; };
+using Pattern = PatternT<uint64_t>;
+// A placement of an IUPAC substring that masks cannot express (S, W, B, D, H, V): bad[x] has the
+// low bit of each 2-bit group where digit x is not allowed.
+template <class V> struct IupacPatternT { V bad[4]; };
+template <class V>
+static inline bool contains_sub(V v, const PatternT<V>* pats, size_t np) {
   for(size_t i=0;i<np;i++){
     const auto& p=pats[i];
-    if(((v ^ p.bits) & p.mask) == 0ULL) return true;
+    if(((v ^ p.bits) & p.mask) == 0) return true;
+  }
+  return false;
+}
+
+// Bit 2g set where a and b carry the same base g, for g < n: XOR leaves a zero 2-bit group at each
+// match.
+template <class V>
+static inline V equal_groups(V a, V b, int n) {
+  const V x = a ^ b;
+  const V lo = ~(V)0 / 3;  // 0b0101...
+  const V valid = (2 * n >= (int)(8 * sizeof(V))) ? lo : (lo & (((V)1 << (2 * n)) - 1));
+  return ~(x | (x >> 1)) & valid;
+}
+// eq[x]: low bit of each 2-bit group holding digit x (all groups of V).
+template <class V>
+static inline void digit_groups(V v, V eq[4]) {
+  const V lo = ~(V)0 / 3;
+  for (int x = 0; x < 4; ++x) eq[x] = equal_groups(v, lo * (V)x, (int)(4 * sizeof(V)));
+}
+template <class V>
+static inline bool contains_iupac(V v, const IupacPatternT<V>* pats, size_t np) {
+  if (np == 0) return false;
+  V eq[4];
+  digit_groups(v, eq);
+  for (size_t i = 0; i < np; ++i) {
+    const V* bad = pats[i].bad;
+    if (((eq[0] & bad[0]) | (eq[1] & bad[1]) | (eq[2] & bad[2]) | (eq[3] & bad[3])) == 0) return true;
+  }
+  return false;
+}
+static inline int ctz_v(uint64_t x) { return __builtin_ctzll(x); }
+static inline int ctz_v(u128 x) {
+  const uint64_t lo = (uint64_t)x;
+  return lo ? __builtin_ctzll(lo) : 64 + __builtin_ctzll((uint64_t)(x >> 64));
+}
+// Placements of one or more substrings: v matches if it matches any mask pattern or IUPAC placement.
+template <class V>
+struct PatternSet {
+  vector<PatternT<V>> masks;
+  vector<IupacPatternT<V>> iupac;
+
+  bool empty() const { return masks.empty() && iupac.empty(); }
+  bool matches(V v) const {
+    return contains_sub(v, masks.data(), masks.size()) || contains_iupac(v, iupac.data(), iupac.size());
+  }
+};
+
+// Low-complexity limits (-1 = off): the longest homopolymer run, and the most consecutive copies
+// of a two-base unit with distinct bases (ACACAC = 3). any() covers these two only.
+// max_self_rc_stem (-1 = off): the longest stretch allowed to pair with the reverse complement of
+// a stretch of the same k-mer (hairpin stems, palindromes).
+// tm_min..tm_max: nearest-neighbour melting temperature window in degrees C, at na_mm mM Na+ and
+// oligo_nm nM total strand concentration; call tm_prepare() once they are set.
+struct LeafLimits {
+  int max_homopolymer=-1;
+  int max_dinuc_repeat=-1;
+  int max_self_rc_stem=-1;
+  double tm_min=-INFINITY, tm_max=INFINITY;
+  double na_mm=50, oligo_nm=50;
+  double tm_salt=0, tm_conc=0, tm_conc_self=0;  // derived by tm_prepare()
+
+  bool any() const { return max_homopolymer >= 0 || max_dinuc_repeat >= 0; }
+  bool by_tm() const { return tm_min > -INFINITY || tm_max < INFINITY; }
+  void tm_prepare() {
+    const double R = 1.9872;  // cal/(K mol)
+    tm_salt = 0.368 * log(na_mm * 1e-3);   // entropy per phosphate pair (SantaLucia 1998)
+    tm_conc = R * log(oligo_nm * 1e-9 / 4);  // non-self-complementary duplex
+    tm_conc_self = R * log(oligo_nm * 1e-9);
+  }
+};
+// Count range of the bases in a digit set (--base-count).
+struct BaseCount { uint8_t set, lo, hi; };
+template <class V> struct NearList;
+
+// Per-run leaf checks: the limits plus what is compiled for the output k: the adapter mask set
+// (--avoid-rc-with), per-digit masks of the positions where that digit is not allowed (low bit of
+// each 2-bit group, --position-class), the base-count ranges (--base-count), the --substring
+// placements that need per-digit masks (IUPAC codes; matched like the substring patterns), the
+// --require groups (each must match), the --forbid set (none may match) and the --exclude-near list.
+// forbid_table prefilters the forbid set: bit x is set if a forbidden pattern starts with the
+// forbid_w-mer x (forbid_w = 0: no table), so a k-mer without such a window is never forbidden.
+template <class V>
+struct LeafChecks : LeafLimits {
+  vector<PatternT<V>> avoid;
+  vector<IupacPatternT<V>> sub_iupac;
+  V pos_bad[4] = {0, 0, 0, 0};
+  vector<BaseCount> counts;
+  vector<PatternSet<V>> require;
+  PatternSet<V> forbid;
+  int forbid_w = 0;
+  vector<uint64_t> forbid_table;
+  shared_ptr<const NearList<V>> exclude;
+  uint64_t scan_lo = 0, scan_hi = UINT64_MAX;  // --start-after / --range (k0-mers, inclusive)
+
+  bool positional() const { return (pos_bad[0] | pos_bad[1] | pos_bad[2] | pos_bad[3]) != 0; }
+  bool forbidden(V v, int k) const {
+    if (forbid_w) {
+      const uint64_t wmask = (1ULL << (2 * forbid_w)) - 1;
+      bool hit = false;
+      for (int s = 0; s + forbid_w <= k && !hit; ++s) {
+        const uint64_t x = (uint64_t)(v >> (2 * s)) & wmask;
+        hit = forbid_table[x >> 6] >> (x & 63) & 1;
+      }
+      if (!hit) return false;
+    }
+    return forbid.matches(v);
+  }
+  // Bit 2g at the lowest constrained base g of the highest-reaching forbidden occurrence: like a
+  // complexity violation it stays until a base at or above g changes. Only placements within the
+  // low k bases count, so a parent (k = k0) is checked with the placements of the output k.
+  V forbid_violations(V v, int k) const {
+    if (forbid.empty() || (forbid_w && !forbidden(v, k))) return 0;
+    const bool all = 2 * k >= (int)(8 * sizeof(V));
+    int top = -1;
+    for (const auto& p : forbid.masks) {
+      if ((!all && (p.mask >> (2 * k)) != 0) || ((v ^ p.bits) & p.mask) != 0) continue;
+      top = max(top, ctz_v(p.mask) & ~1);
+    }
+    if (!forbid.iupac.empty()) {
+      V eq[4];
+      digit_groups(v, eq);
+      for (const auto& p : forbid.iupac) {
+        const V span = p.bad[0] | p.bad[1] | p.bad[2] | p.bad[3];
+        if ((!all && (span >> (2 * k)) != 0) ||
+            ((eq[0] & p.bad[0]) | (eq[1] & p.bad[1]) | (eq[2] & p.bad[2]) | (eq[3] & p.bad[3])) != 0) {
+          continue;
+        }
+        top = max(top, ctz_v(span));
+      }
+    }
+    return top < 0 ? (V)0 : (V)1 << top;
+  }
+};
+
+// Bit 2g set where base g equals base g+s (bases numbered from the right, g < k-s).
+template <class V>
+static inline V equal_bases_at(V v, int k, int s) {
+  return equal_groups(v, v >> (2 * s), k - s);
+}
+// Nonzero iff `z` has `n` consecutive set groups.
+template <class V>
+static inline V runs_of(V z, int n) {
+  V r = z;
+  for (int j = 1; j < n; ++j) r &= z >> (2 * j);
+  return r;
+}
+// Bit 2g set where a run over the limits starts at base g.
+template <class V>
+static inline V complexity_violations(V v, int k, const LeafLimits& lim) {
+  V bad = 0;
+  // A homopolymer of N+1 bases is N consecutive equal neighbours.
+  const int h = lim.max_homopolymer;
+  if (h >= 1 && h < k) bad |= runs_of(equal_bases_at(v, k, 1), h);
+  // N+1 copies of XY (X != Y) is 2N consecutive period-2 matches starting where X != Y.
+  const int r = lim.max_dinuc_repeat;
+  if (r >= 1 && 2 * r + 2 <= k) bad |= runs_of(equal_bases_at(v, k, 2), 2 * r) & ~equal_bases_at(v, k, 1);
+  return bad;
+}
+template <class V>
+static inline bool passes_complexity(V v, int k, const LeafLimits& lim) {
+  return complexity_violations(v, k, lim) == 0;
+}
+static inline int top_bit(uint64_t x) { return 63 - __builtin_clzll(x); }
+static inline int top_bit(u128 x) {
+  const uint64_t hi = (uint64_t)(x >> 64);
+  return hi ? 64 + top_bit(hi) : top_bit((uint64_t)x);
+}
+static inline int popcount_v(uint64_t x) { return __builtin_popcountll(x); }
+static inline int popcount_v(u128 x) {
+  return __builtin_popcountll((uint64_t)x) + __builtin_popcountll((uint64_t)(x >> 64));
+}
+// Smallest value >= v that can pass, given a violation mask (bit 2g) whose violations persist
+// until base g changes: every value below the next change of the highest such base still has it.
+// Returns UINT64_MAX on overflow.
+static inline uint64_t jump_past(uint64_t v, uint64_t bad) {
+  if (bad == 0) return v;
+  const int shift = top_bit(bad);  // 2g
+  const uint64_t next = ((v >> shift) + 1) << shift;
+  return next > v ? next : UINT64_MAX;
+}
+
+// Bit 2g set where base g holds a digit --position-class does not allow there; like a complexity
+// violation, it stays until base g itself changes.
+template <class V>
+static inline V position_violations(V v, const LeafChecks<V>& lim) {
+  V eq[4];
+  digit_groups(v, eq);
+  return (eq[0] & lim.pos_bad[0]) | (eq[1] & lim.pos_bad[1]) | (eq[2] & lim.pos_bad[2]) | (eq[3] & lim.pos_bad[3]);
+}
+// Number of bases equal to each digit.
+template <class V>
+static inline void base_counts(V v, int k, int cnt[4]) {
+  const V lo = ~(V)0 / 3;
+  for (int x = 0; x < 4; ++x) cnt[x] = popcount_v(equal_groups(v, lo * (V)x, k));
+}
+template <class V>
+static inline bool passes_base_counts(V v, int k, const vector<BaseCount>& counts) {
+  int cnt[4];
+  base_counts(v, k, cnt);
+  for (const auto& c : counts) {
+    int n = 0;
+    for (int x = 0; x < 4; ++x) if (c.set >> x & 1) n += cnt[x];
+    if (n < c.lo || n > c.hi) return false;
+  }
+  return true;
+}
+// Bit 2g set where the bases from g up already hold more of a class than its range allows: the
+// (hi+1)-th match counted from the 5' end sits at base g. Like a complexity violation, it stays
+// until a base at or above g changes.
+template <class V>
+static inline V count_excess(V v, int k, const vector<BaseCount>& counts) {
+  const V lo = ~(V)0 / 3;
+  V bad = 0;
+  for (const auto& c : counts) {
+    if (c.hi >= k) continue;
+    V m = 0;
+    for (int x = 0; x < 4; ++x) if (c.set >> x & 1) m |= equal_groups(v, lo * (V)x, k);
+    if (popcount_v(m) <= c.hi) continue;
+    for (int j = 0; j < c.hi; ++j) m &= ~((V)1 << top_bit(m));
+    bad |= (V)1 << top_bit(m);
+  }
+  return bad;
+}
+// A k0-mer parent gains d bases in expansion: its children can only meet a range it does not
+// already exceed and can reach with d more bases.
+static inline bool base_counts_may_pass(uint64_t parent, int k0, int d, const vector<BaseCount>& counts) {
+  int cnt[4];
+  base_counts(parent, k0, cnt);
+  for (const auto& c : counts) {
+    int n = 0;
+    for (int x = 0; x < 4; ++x) if (c.set >> x & 1) n += cnt[x];
+    if (n > c.hi || n + d < c.lo) return false;
+  }
+  return true;
+}
+
+// Reverse complement of a packed k-mer: complement every base (x ^ 3), then reverse the 2-bit
+// groups of the word and drop the unused low groups.
+static inline uint64_t revcomp_packed(uint64_t v, int k) {
+  v = ~v;
+  v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64(v) >> (2 * (32 - k));
+}
+static inline u128 revcomp_packed(u128 v, int k) {
+  const u128 r = ((u128)revcomp_packed((uint64_t)v, 32) << 64) | revcomp_packed((uint64_t)(v >> 64), 32);
+  return r >> (2 * (64 - k));
+}
+// True if some stretch of n bases is the reverse complement of another (or the same) stretch: a
+// stretch at base i pairing with one at base j lines up with v at shift i + j + n - k of the
+// reverse complement, so both are compared at every shift that overlaps by n or more.
+template <class V>
+static inline bool has_self_rc_stem(V v, int k, int n) {
+  const V r = revcomp_packed(v, k);
+  for (int s = 0; s <= k - n; ++s) {
+    if (runs_of(equal_groups(v >> (2 * s), r, k - s), n)) return true;
+    if (s > 0 && runs_of(equal_groups(v, r >> (2 * s), k - s), n)) return true;
   }
   return false;
 }
 
+// SantaLucia (1998) unified nearest-neighbour parameters, indexed by the dinucleotide step as
+// (5' base << 2) | 3' base: dH in 0.1 kcal/mol, dS in 0.1 cal/(K mol).
+static const int16_t NN_DH[16] = { -79, -84, -78, -72,  -85, -80, -106, -78,
+                                   -82, -98, -80, -84,  -72, -82,  -85, -79 };
+static const int16_t NN_DS[16] = { -222, -224, -210, -204,  -227, -199, -272, -210,
+                                   -222, -244, -199, -224,  -213, -222, -227, -222 };
+// Initiation per terminal base pair: G.C (C, G) or A.T (A, T).
+static const int16_t NN_INIT_DH[4] = { 23, 1, 1, 23 };
+static const int16_t NN_INIT_DS[4] = { 41, -28, -28, 41 };
+
+// Sum of the k-1 stacking steps of a packed k-mer: each step is the 4-bit window of two bases.
+template <class V>
+static inline void nn_steps(V v, int k, int& dH, int& dS) {
+  dH = 0; dS = 0;
+  for (int i = 0; i + 1 < k; ++i) {
+    const unsigned step = (unsigned)(v >> (2 * i)) & 15u;
+    dH += NN_DH[step];
+    dS += NN_DS[step];
+  }
+}
+// Two-state melting temperature (degrees C) of the k-mer against its perfect complement.
+template <class V>
+static inline double nn_tm(V v, int k, const LeafLimits& lim) {
+  int dH, dS;
+  nn_steps(v, k, dH, dS);
+  const unsigned first = (unsigned)(v >> (2 * (k - 1))) & 3u, last = (unsigned)v & 3u;
+  dH += NN_INIT_DH[first] + NN_INIT_DH[last];
+  dS += NN_INIT_DS[first] + NN_INIT_DS[last];
+  double conc = lim.tm_conc;
+  if (revcomp_packed(v, k) == v) { dS -= 14; conc = lim.tm_conc_self; }  // symmetry correction
+  return dH * 100.0 / (dS * 0.1 + lim.tm_salt * (k - 1) + conc) - 273.15;
+}
+template <class V>
+static inline bool passes_tm(V v, int k, const LeafLimits& lim) {
+  const double tm = nn_tm(v, k, lim);
+  return tm >= lim.tm_min && tm <= lim.tm_max;
+}
+// False when no kout-mer embedding the k0-mer parent can reach the Tm window. With T = t + 273.15
+// and a negative denominator D, Tm >= t iff 100 dH - T D <= 0, a sum over steps and terminal
+// pairs: the parent's steps are exact, each of the d added steps and both ends take the extreme
+// table entry for T (the symmetry correction and concentration term likewise).
+static inline bool tm_children_may_pass(uint64_t parent, int k0, int kout, const LeafLimits& lim) {
+  int dH, dS;
+  nn_steps(parent, k0, dH, dS);
+  const int d = kout - k0;
+  const double base = lim.tm_salt * (kout - 1);
+  const double conc_lo = min(lim.tm_conc, lim.tm_conc_self), conc_hi = max(lim.tm_conc, lim.tm_conc_self);
+  const double Dmax = 0.1 * (dS - 199 * d + 82) + base + conc_hi;
+  if (Dmax >= 0) return true;
+  auto bound = [&](double T, bool lowest)->double {
+    double step = 100.0 * NN_DH[0] - 0.1 * T * NN_DS[0];
+    double end = 100.0 * NN_INIT_DH[0] - 0.1 * T * NN_INIT_DS[0];
+    for (int i = 1; i < 16; ++i) {
+      const double x = 100.0 * NN_DH[i] - 0.1 * T * NN_DS[i];
+      step = lowest ? min(step, x) : max(step, x);
+    }
+    for (int i = 1; i < 4; ++i) {
+      const double x = 100.0 * NN_INIT_DH[i] - 0.1 * T * NN_INIT_DS[i];
+      end = lowest ? min(end, x) : max(end, x);
+    }
+    return 100.0 * dH - 0.1 * T * dS + d * step + 2 * end;
+  };
+  if (lim.tm_min > -INFINITY) {
+    const double T = lim.tm_min + 273.15;
+    if (bound(T, true) - T * (base + conc_hi) > 0) return false;
+  }
+  if (lim.tm_max < INFINITY) {
+    const double T = lim.tm_max + 273.15;
+    if (bound(T, false) - T * (base + conc_lo - 1.4) < 0) return false;
+  }
+  return true;
+}
+
+// ---------------- Set selection ----------------
+template <class V>
+static inline int hamming_packed(V a, V b) {
+  const V x = a ^ b;
+  return popcount_v((x | (x >> 1)) & (~(V)0 / 3));
+}
+
+// Accepted k-mers that were just accepted or just rejected a candidate, most recent first. A
+// lane streams lexicographic neighbours, so most rejections hit one of these before any index
+// lookup.
+struct RecentRejectors {
+  vector<uint32_t> ids;
+  void touch(uint32_t j) {
+    auto it = find(ids.begin(), ids.end(), j);
+    if (it != ids.end()) ids.erase(it);
+    ids.insert(ids.begin(), j);
+    if (ids.size() > 32) ids.pop_back();
+  }
+};
+
+// Pigeonhole index for Hamming distance below d: two k-mers within d-1 mismatches agree exactly on
+// at least one of nb >= d disjoint blocks, so a query is only compared with the entries sharing one
+// of its block values. Blocks of up to 12 bases also keep a presence bitmap of their values, so a
+// query far from every entry costs nb bit tests.
+template <class V>
+struct HammingIndex {
+  int k=0, d=0, nb=0;
+  vector<int> block_lo;  // first base (from the right) of each block; block_lo[nb] = k
+  vector<unordered_map<uint64_t, vector<uint32_t>>> blocks;
+  vector<vector<uint64_t>> present;  // per block, bit per value (blocks of <= 12 bases)
+
+  HammingIndex(int k_, int d_, int nb_) : k(k_), d(d_), nb(nb_), blocks(nb_), present(nb_) {
+    for (int b = 0; b <= nb; ++b) block_lo.push_back(nb ? b * k / nb : k);
+    for (int b = 0; b < nb; ++b) {
+      const int n = block_lo[b + 1] - block_lo[b];
+      if (n <= 12) present[b].assign(max<size_t>(1, ((size_t)1 << (2 * n)) / 64), 0);
+    }
+  }
+  uint64_t block_value(V v, int b) const {
+    const int n = block_lo[b + 1] - block_lo[b];  // <= 32 bases since nb >= 2
+    const V m = (2 * n >= (int)(8 * sizeof(V))) ? ~(V)0 : (((V)1 << (2 * n)) - 1);
+    return (uint64_t)((v >> (2 * block_lo[b])) & m);
+  }
+  void add(V v, uint32_t j) {
+    for (int b = 0; b < nb; ++b) {
+      const uint64_t x = block_value(v, b);
+      blocks[b][x].push_back(j);
+      if (!present[b].empty()) present[b][x >> 6] |= 1ULL << (x & 63);
+    }
+  }
+  // Some entry of `values` (indexed by add) within d-1 mismatches of v, or -1.
+  int64_t find_near(V v, const vector<V>& values) const {
+    for (int b = 0; b < nb; ++b) {
+      const uint64_t x = block_value(v, b);
+      if (!present[b].empty() && !(present[b][x >> 6] >> (x & 63) & 1)) continue;
+      auto it = blocks[b].find(x);
+      if (it == blocks[b].end()) continue;
+      for (uint32_t j : it->second) {
+        if (hamming_packed(v, values[j]) < d) return j;
+      }
+    }
+    return -1;
+  }
+};
+
+// --min-hamming d: greedy set of k-mers pairwise at least d mismatches apart (HammingIndex over the
+// accepted k-mers, d blocks).
+template <class V>
+struct HammingSelector {
+  int d=0;
+  vector<V> accepted;
+  HammingIndex<V> index;
+  uint64_t rejected=0;
+  RecentRejectors recent;
+
+  HammingSelector(int k_, int d_) : d(d_), index(k_, d_, d_ > 1 ? d_ : 0) {}
+  // Accepts v if it is at least d mismatches from every accepted k-mer.
+  bool try_add(V v) {
+    if (d > 1) {
+      for (uint32_t j : recent.ids) {
+        if (hamming_packed(v, accepted[j]) < d) { rejected++; return false; }
+      }
+      const int64_t j = index.find_near(v, accepted);
+      if (j >= 0) { recent.touch((uint32_t)j); rejected++; return false; }
+    }
+    add(v);
+    recent.touch((uint32_t)accepted.size() - 1);
+    return true;
+  }
+  void add(V v) {
+    index.add(v, (uint32_t)accepted.size());
+    accepted.push_back(v);
+  }
+};
+
+// --exclude-near <file> --exclude-d d: k-mers within d-1 mismatches of a listed barcode are dropped
+// in the refill loop. Indexed over max(d, 2) blocks, so d = 1 (exact matches) stays a lookup.
+template <class V>
+struct NearList {
+  vector<V> values;
+  HammingIndex<V> index;
+
+  NearList(int k, int d, vector<V> v) : values(move(v)), index(k, d, max(d, 2)) {
+    for (uint32_t j = 0; j < values.size(); ++j) index.add(values[j], j);
+  }
+  bool near(V v) const { return index.find_near(v, values) >= 0; }
+};
+
+// Levenshtein distance of two k-mers (k <= 64), bit-parallel over the pattern (Myers / Hyyrö,
+// global alignment): peq[c] has bit g set where base g of the pattern is c. Exact when below d;
+// stops early once the distance can no longer drop below d.
+template <class V>
+static inline int edit_distance_packed(const uint64_t peq[4], V text, int k, int d) {
+  const uint64_t mask = (k == 64) ? ~0ULL : ((1ULL << k) - 1);
+  const uint64_t high = 1ULL << (k - 1);
+  uint64_t pv = mask, mv = 0;
+  int score = k;
+  for (int j = 0; j < k; ++j) {
+    const uint64_t eq = peq[(int)((text >> (2 * j)) & 3)];
+    const uint64_t xv = eq | mv;
+    const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+    score += (int)((ph & high) != 0) - (int)((mh & high) != 0);
+    if (score - (k - 1 - j) >= d) return score;
+    ph = (ph << 1) | 1;  // top row: D[0][j] = j
+    mh <<= 1;
+    pv = (mh | ~(xv | ph)) & mask;
+    mv = ph & xv;
+  }
+  return score;
+}
+
+// --min-edit d: greedy set of k-mers pairwise at least d edits apart. Pigeonhole with shifts: if
+// two k-mers are within e = d-1 edits, one of d disjoint blocks of the candidate appears
+// unedited in the other k-mer, displaced by at most e bases. Each accepted k-mer is indexed under
+// its substrings at every block position shifted by -e..e; a candidate looks up its d blocks and
+// verifies the hits (Hamming first, as edit distance <= Hamming distance, then Myers).
+template <class V>
+struct EditSelector {
+  int k=0, d=0;
+  vector<V> accepted;
+  vector<int> block_lo;  // as in HammingIndex; block_lo[d] = k
+  vector<unordered_map<uint64_t, vector<uint32_t>>> blocks;
+  vector<uint8_t> seen;
+  vector<uint32_t> touched;
+  uint64_t rejected=0;
+  RecentRejectors recent;
+
+  EditSelector(int k_, int d_) : k(k_), d(d_), blocks(d_ > 1 ? d_ : 0) {
+    for (int b = 0; b <= d; ++b) block_lo.push_back(b * k / d);
+  }
+  uint64_t substring_at(V v, int lo, int n) const {  // n <= 32 bases since d >= 2
+    const V m = (2 * n >= (int)(8 * sizeof(V))) ? ~(V)0 : (((V)1 << (2 * n)) - 1);
+    return (uint64_t)((v >> (2 * lo)) & m);
+  }
+
+  bool try_add(V v) {
+    if (d > 1 && !accepted.empty()) {
+      uint64_t peq[4] = {0, 0, 0, 0};
+      for (int g = 0; g < k; ++g) peq[(int)((v >> (2 * g)) & 3)] |= 1ULL << g;
+      auto close_to = [&](uint32_t j) {
+        return hamming_packed(v, accepted[j]) < d || edit_distance_packed(peq, accepted[j], k, d) < d;
+      };
+      for (uint32_t j : recent.ids) {
+        if (close_to(j)) { rejected++; return false; }
+      }
+      seen.resize(accepted.size());
+      touched.clear();
+      int64_t close = -1;
+      for (int b = 0; b < d && close < 0; ++b) {
+        auto it = blocks[b].find(substring_at(v, block_lo[b], block_lo[b + 1] - block_lo[b]));
+        if (it == blocks[b].end()) continue;
+        for (uint32_t j : it->second) {
+          if (seen[j]) continue;
+          seen[j] = 1;
+          touched.push_back(j);
+          if (close_to(j)) { close = j; break; }
+        }
+      }
+      for (uint32_t j : touched) seen[j] = 0;
+      if (close >= 0) { recent.touch((uint32_t)close); rejected++; return false; }
+    }
+    add(v);
+    recent.touch((uint32_t)accepted.size() - 1);
+    return true;
+  }
+  void add(V v) {
+    const uint32_t j = (uint32_t)accepted.size();
+    accepted.push_back(v);
+    const int e = d - 1;
+    for (int b = 0; b < (int)blocks.size(); ++b) {
+      const int lo = block_lo[b], n = block_lo[b + 1] - lo;
+      for (int sft = -e; sft <= e; ++sft) {
+        if (lo + sft < 0 || lo + sft + n > k) continue;
+        auto& post = blocks[b][substring_at(v, lo + sft, n)];
+        if (post.empty() || post.back() != j) post.push_back(j);
+      }
+    }
+  }
+};
+
+// --color-balance C --set-size N: Illumina colour balance. In the finished set every position must be
+// lit in each channel by at least `need` k-mers. Four-colour chemistry reads A/C with the red laser
+// and G/T with the green one; two-channel chemistry lights A in both channels, C red, T green and G
+// in neither. unlit[c][g] counts accepted k-mers dark in channel c at base g. The set is held to the
+// share while it grows: with n accepted, a base may be dark in (n+1)(N-need)/N of them, rounded up,
+// and bases at that allowance are full for the channel (their group bit in full[c]). Balance then
+// never has to be repaired by the last few k-mers, which a lane of lexicographic neighbours rarely
+// supplies. A candidate is scored by the full bases it would leave dark, two ANDs on the packed
+// value; only a clean score is accepted.
+template <class V>
+struct ColorBalancer {
+  int k=0, channels=0;
+  uint32_t set_size=0, need=0, cap=0;
+  vector<uint32_t> unlit[2];
+  V full[2] = {0, 0};
+  V valid = 0;
+  vector<V> accepted;
+  uint64_t rejected=0;
+
+  ColorBalancer(int k_, int channels_, uint32_t n, double min_share)
+      : k(k_), channels(channels_), set_size(max<uint32_t>(n, 1)) {
+    need = max<uint32_t>(1, (uint32_t)ceil(set_size * min_share - 1e-9));
+    cap = set_size > need ? set_size - need : 0;
+    const V lo = ~(V)0 / 3;
+    valid = (2 * k >= (int)(8 * sizeof(V))) ? lo : (lo & (((V)1 << (2 * k)) - 1));
+    for (int c = 0; c < 2; ++c) unlit[c].assign((size_t)k, 0);
+    update_full();
+  }
+  // Bases already dark in as many accepted k-mers as the next one may bring them to.
+  void update_full() {
+    const uint64_t n = accepted.size() + 1;
+    const uint32_t allow = (uint32_t)min<uint64_t>(cap, (n * cap + set_size - 1) / set_size);
+    for (int c = 0; c < 2; ++c) {
+      full[c] = 0;
+      for (int g = 0; g < k; ++g) {
+        if (unlit[c][g] >= allow) full[c] |= (V)1 << (2 * g);
+      }
+    }
+  }
+  // Low bit of each 2-bit group where v is dark in the red (0) and green (1) channel.
+  void dark(V v, V out[2]) const {
+    V eq[4];
+    digit_groups(v, eq);
+    out[0] = (eq[2] | eq[3]) & valid;
+    out[1] = (channels == 4 ? (eq[0] | eq[1]) : (eq[1] | eq[2])) & valid;
+  }
+  // Bit 2g where v would leave a full base g dark.
+  V violations(V v) const {
+    V dk[2];
+    dark(v, dk);
+    return (dk[0] & full[0]) | (dk[1] & full[1]);
+  }
+  // The full bases as --position-class masks: bad[x] gains each base where digit x is dark in a full
+  // channel, so a lane scan can jump past them like a position class.
+  void add_position_masks(V bad[4]) const {
+    for (int x = 0; x < 4; ++x) {
+      if (x >= 2) bad[x] |= full[0];
+      if (channels == 4 ? x < 2 : (x == 1 || x == 2)) bad[x] |= full[1];
+    }
+  }
+  void add(V v) {
+    V dk[2];
+    dark(v, dk);
+    for (int c = 0; c < 2; ++c) {
+      for (V m = dk[c]; m; m &= m - 1) unlit[c][ctz_v(m) / 2]++;
+    }
+    accepted.push_back(v);
+    update_full();
+  }
+};
+
 // ---------------- index.json parsing ----------------
+
 static bool read_index(const string& dir, unsigned& numShards, vector<string>& files,
+                       vector<vector<string>>& deltas, vector<string>& counts, vector<string>& nodes,
+                       vector<string>& sources, string& mmer_index,
                        uint64_t& k_out, uint64_t& total_bits_out,
                        vector<uint64_t>& starts, vector<uint64_t>& ends) {
   ifstream in(dir + "/index.json");
@@ -193,6 +1074,11 @@ static bool read_index(const string& dir, unsigned& numShards, vector<string>& f
   string line;
   numShards = 0;
   files.clear();
+  deltas.clear();
+  counts.clear();
+  nodes.clear();
+  sources.clear();
+  mmer_index.clear();
   k_out = 0;
   total_bits_out = 0;
   starts.clear();
@@ -224,6 +1110,14 @@ static bool read_index(const string& dir, unsigned& numShards, vector<string>& f
       auto p = line.find(':');
       if (p != string::npos) k_out = (uint64_t)stoull(line.substr(p+1));
     }
+    if (line.find("\"sources\"") != string::npos && line.find("\"file\"") == string::npos) {
+      parse_string_array_field(line, "\"sources\"", sources);
+    }
+    if (line.find("\"mmer_index\"") != string::npos && line.find("\"file\"") == string::npos) {
+      auto q1 = line.find('"', line.find(':', line.find("\"mmer_index\"")));
+      auto q2 = line.find('"', q1 + 1);
+      if (q1 != string::npos && q2 != string::npos) mmer_index = line.substr(q1 + 1, q2 - q1 - 1);
+    }
     auto fpos = line.find("\"file\"");
     if (fpos != string::npos) {
       uint64_t sstart=0, send=0;
@@ -237,6 +1131,26 @@ static bool read_index(const string& dir, unsigned& numShards, vector<string>& f
       auto s2 = line.find('"', s1 + 1);
       if (s2 == string::npos) continue;
       files.push_back(line.substr(s1 + 1, s2 - (s1 + 1)));
+      deltas.emplace_back();
+      parse_string_array_field(line, "\"deltas\"", deltas.back());
+      counts.emplace_back();
+      {
+        auto cpos = line.find("\"counts\"");
+        if (cpos != string::npos) {
+          auto q1 = line.find('"', line.find(':', cpos));
+          auto q2 = line.find('"', q1 + 1);
+          if (q1 != string::npos && q2 != string::npos) counts.back() = line.substr(q1 + 1, q2 - q1 - 1);
+        }
+      }
+      nodes.emplace_back();
+      {
+        auto npos_ = line.find("\"stream_node\"");
+        if (npos_ != string::npos) {
+          auto q1 = line.find('"', line.find(':', npos_));
+          auto q2 = line.find('"', q1 + 1);
+          if (q1 != string::npos && q2 != string::npos) nodes.back() = line.substr(q1 + 1, q2 - q1 - 1);
+        }
+      }
 
       if (has_start && has_end) {
         starts.push_back(sstart);
@@ -248,6 +1162,9 @@ static bool read_index(const string& dir, unsigned& numShards, vector<string>& f
   if (numShards == 0) numShards = (unsigned)files.size();
   if (files.size() != numShards) {
     files.clear();
+    deltas.assign(numShards, vector<string>());
+    counts.assign(numShards, string());
+    nodes.assign(numShards, string());
     files.reserve(numShards);
     for (unsigned i = 0; i < numShards; ++i) {
       ostringstream os;
@@ -258,100 +1175,130 @@ static bool read_index(const string& dir, unsigned& numShards, vector<string>& f
   return numShards > 0 && !files.empty() && k_out > 0;
 }
 
-// ---------------- GC histogram JSON parsing (minimal) ----------------
-static bool load_gc_hist_json(const string& path, int& k_out, vector<vector<uint64_t>>& hists_out) {
-  ifstream in(path);
-  if (!in) return false;
-  string s((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+// Equal-width shard ranges over [0, total_bits) for indexes that do not list start/end.
+static void default_shard_ranges(unsigned numShards, uint64_t total_bits, int k,
+                                 vector<uint64_t>& starts, vector<uint64_t>& ends) {
+  if (starts.size() == numShards && ends.size() == numShards) return;
+  if (!total_bits) total_bits = 1ULL << (2 * k);
+  const uint64_t width = (total_bits + (uint64_t)numShards - 1) / (uint64_t)numShards;
+  starts.assign(numShards, 0);
+  ends.assign(numShards, 0);
+  for (unsigned i = 0; i < numShards; i++) {
+    starts[i] = (uint64_t)i * width;
+    ends[i] = min<uint64_t>(total_bits, starts[i] + width);
+  }
+}
 
-  auto skip_ws = [&](size_t& i){
-    while (i < s.size()) {
-      char c = s[i];
-      if (c==' '||c=='\n'||c=='\r'||c=='\t') i++;
-      else break;
-    }
+// ---------------- m-mer chunk index (build_mmer_index) ----------------
+// Sorted ids of the chunks (2^chunk_bits values each) that may hold an absent k-mer containing one
+// of `subs`: per substring the AND of its m-mers' chunk bitmaps (or the OR over the m-mers that
+// contain it, when it is shorter than m), OR-ed together with the "dense" chunks.
+static bool load_mmer_candidates(const string& path, int k, const vector<string>& subs,
+                                 vector<uint64_t>& chunks, int& chunk_bits) {
+  ifstream in(path, ios::binary);
+  if (!in) { perror(("open " + path).c_str()); return false; }
+  unsigned char hdr[48];
+  in.read((char*)hdr, 48);
+  if (!in || memcmp(hdr, "KMIDXv1\0", 8) != 0) { cerr << "Invalid m-mer index: " << path << "\n"; return false; }
+  const uint64_t ik = read_le64(hdr + 8), m = read_le64(hdr + 16), n = read_le64(hdr + 40);
+  chunk_bits = (int)read_le64(hdr + 24);
+  if ((int)ik != k || m < 1 || m > 8 || n != (1ULL << (2 * m)) + 1) {
+    cerr << "m-mer index does not match the shard set (k=" << ik << "): " << path << "\n";
+    return false;
+  }
+  vector<unsigned char> off_raw(8 * (n + 1));
+  in.read((char*)off_raw.data(), (streamsize)off_raw.size());
+  if (!in) { cerr << "Truncated m-mer index: " << path << "\n"; return false; }
+  // Entries follow the offset table in order and end within the file, so no entry read below
+  // allocates more than the file holds.
+  in.seekg(0, ios::end);
+  const uint64_t file_size = (uint64_t)in.tellg();
+  uint64_t prev = 48 + off_raw.size();
+  for (uint64_t x = 0; x <= n; ++x) {
+    const uint64_t o = read_le64(off_raw.data() + 8 * x);
+    if (o < prev || o > file_size) { cerr << "Corrupt m-mer index offsets: " << path << "\n"; return false; }
+    prev = o;
+  }
+
+  map<uint64_t, roaring64_bitmap_t*> cache;
+  auto entry = [&](uint64_t x)->roaring64_bitmap_t* {
+    auto it = cache.find(x);
+    if (it != cache.end()) return it->second;
+    const uint64_t o1 = read_le64(off_raw.data() + 8 * x), o2 = read_le64(off_raw.data() + 8 * (x + 1));
+    roaring64_bitmap_t* bm = nullptr;
+    vector<char> blob(o2 - o1);
+    in.seekg((streamoff)o1);
+    in.read(blob.data(), (streamsize)blob.size());
+    if (in) bm = roaring64_bitmap_portable_deserialize_safe(blob.data(), blob.size());
+    if (!bm) cerr << "Corrupt m-mer index entry " << x << ": " << path << "\n";
+    cache[x] = bm;
+    return bm;
   };
-  auto parse_int = [&](size_t& i, long long& out)->bool{
-    skip_ws(i);
-    bool neg=false;
-    if (i < s.size() && s[i]=='-') { neg=true; i++; }
-    if (i >= s.size() || s[i]<'0' || s[i]>'9') return false;
-    long long v=0;
-    while (i < s.size() && s[i]>='0' && s[i]<='9') { v = v*10 + (s[i]-'0'); i++; }
-    out = neg ? -v : v;
+  // The m-mers an m-base window of q matches, enumerating only the digits each IUPAC code allows;
+  // false if there are more than max_expand (such a window barely narrows the candidates).
+  const size_t max_expand = 64;
+  auto expand = [&](const string& q, size_t from, vector<uint64_t>& xs)->bool {
+    size_t total = 1;
+    for (size_t i = 0; i < m; ++i) total *= (size_t)__builtin_popcount(iupac_digits(q[from + i]));
+    if (total > max_expand) return false;
+    xs.assign(1, 0);
+    for (size_t i = 0; i < m; ++i) {
+      const int set = iupac_digits(q[from + i]);
+      vector<uint64_t> next;
+      for (uint64_t x : xs) for (int d = 0; d < 4; ++d) if (set >> d & 1) next.push_back((x << 2) | (uint64_t)d);
+      xs.swap(next);
+    }
     return true;
   };
 
-  // "k"
-  {
-    auto pos = s.find("\"k\"");
-    if (pos == string::npos) return false;
-    size_t i = pos;
-    if ((i = s.find(':', i)) == string::npos) return false;
-    i++;
-    long long kk=0;
-    if (!parse_int(i, kk)) return false;
-    k_out = (int)kk;
-    if (k_out <= 0 || k_out > 32) return false;
-  }
-
-  // optional "num_shards"
-  int num_shards = -1;
-  {
-    auto pos = s.find("\"num_shards\"");
-    if (pos != string::npos) {
-      size_t i = pos;
-      if ((i = s.find(':', i)) != string::npos) {
-        i++;
-        long long ns=0;
-        if (parse_int(i, ns)) num_shards = (int)ns;
+  bool ok = true;
+  roaring64_bitmap_t* cand = roaring64_bitmap_create();
+  for (const auto& q : subs) {
+    roaring64_bitmap_t* acc = nullptr;
+    if (q.size() >= m) {
+      vector<uint64_t> xs;
+      for (size_t i = 0; ok && i + m <= q.size(); ++i) {
+        if (!expand(q, i, xs)) continue;
+        roaring64_bitmap_t* any = roaring64_bitmap_create();
+        for (uint64_t x : xs) {
+          roaring64_bitmap_t* e = entry(x);
+          if (!e) { ok = false; break; }
+          roaring64_bitmap_or_inplace(any, e);
+        }
+        if (!acc) { acc = any; continue; }
+        roaring64_bitmap_and_inplace(acc, any);
+        roaring64_bitmap_free(any);
+      }
+      if (ok && !acc) { cerr << "Substring " << q << " is too degenerate for the m-mer index\n"; ok = false; }
+    } else {
+      acc = roaring64_bitmap_create();
+      for (uint64_t x = 0; ok && x + 1 < n; ++x) {
+        if (!iupac_find(decode_kmer(x, (int)m), q)) continue;
+        roaring64_bitmap_t* e = entry(x);
+        if (!e) { ok = false; break; }
+        roaring64_bitmap_or_inplace(acc, e);
       }
     }
+    if (acc) { roaring64_bitmap_or_inplace(cand, acc); roaring64_bitmap_free(acc); }
   }
-
-  if (num_shards > 0) {
-    hists_out.assign((size_t)num_shards, vector<uint64_t>((size_t)k_out+1, 0));
-  } else {
-    hists_out.clear();
-  }
-
-  size_t i = 0;
-  while (true) {
-    auto sp = s.find("\"shard\"", i);
-    if (sp == string::npos) break;
-    size_t j = sp;
-    if ((j = s.find(':', j)) == string::npos) break;
-    j++;
-    long long shard_id_ll=0;
-    if (!parse_int(j, shard_id_ll)) { i = sp+7; continue; }
-    int shard_id = (int)shard_id_ll;
-    i = j;
-
-    auto gh = s.find("\"gc_hist\"", i);
-    if (gh == string::npos) break;
-    size_t kpos = gh;
-    if ((kpos = s.find('[', kpos)) == string::npos) break;
-    kpos++;
-
-    if (shard_id < 0) { i = gh+8; continue; }
-    if ((size_t)shard_id >= hists_out.size()) {
-      hists_out.resize((size_t)shard_id + 1, vector<uint64_t>((size_t)k_out+1, 0));
-    }
-
-    for (int b=0; b<=k_out; ++b) {
-      long long v=0;
-      if (!parse_int(kpos, v)) return false;
-      hists_out[(size_t)shard_id][(size_t)b] = (uint64_t)v;
-      skip_ws(kpos);
-      if (b < k_out) {
-        if (kpos < s.size() && s[kpos] == ',') kpos++;
-      }
+  roaring64_bitmap_t* dense = ok ? entry(n - 1) : nullptr;
+  if (dense) roaring64_bitmap_or_inplace(cand, dense);
+  ok = ok && dense;
+
+  chunks.clear();
+  if (ok) {
+    chunks.reserve(roaring64_bitmap_get_cardinality(cand));
+    vector<uint64_t> batch(1 << 16);
+    roaring64_iterator_t* it = roaring64_iterator_create(cand);
+    uint64_t got;
+    while ((got = roaring64_iterator_read(it, batch.data(), batch.size())) > 0) {
+      chunks.insert(chunks.end(), batch.begin(), batch.begin() + (ptrdiff_t)got);
     }
-    auto close = s.find(']', kpos);
-    if (close == string::npos) break;
-    i = close + 1;
+    roaring64_iterator_free(it);
   }
-  return true;
+  roaring64_bitmap_free(cand);
+  for (auto& kv : cache) if (kv.second) roaring64_bitmap_free(kv.second);
+  return ok;
 }
 
 // ---------------- splitmix + perm ----------------
@@ -374,28 +1321,31 @@ static vector<uint32_t> build_perm(uint32_t n, uint64_t seed) {
 }
 
 // ---------------- Expansion helpers ----------------
-static inline uint64_t pow4(int n) { return (n<=0) ? 1ULL : (1ULL << (2*n)); }
-static inline uint64_t make_value(uint64_t parentB, int k0, int kout,
-                                  int L, uint64_t left_idx, uint64_t right_idx) {
+template <class V>
+static inline V pow4(int n) { return (n<=0) ? (V)1 : ((V)1 << (2*n)); }
+template <class V>
+static inline V make_value(uint64_t parentB, int k0, int kout, int L, V left_idx, V right_idx) {
   int d = kout - k0;
   int R = d - L;
-  return (left_idx << (2 * (k0 + R))) | (parentB << (2 * R)) | right_idx;
+  return (left_idx << (2 * (k0 + R))) | ((V)parentB << (2 * R)) | right_idx;
 }
-static inline void init_state_first(int d, uint8_t& L, uint64_t& left_idx, uint64_t& right_idx) {
+template <class V>
+static inline void init_state_first(int d, uint8_t& L, V& left_idx, V& right_idx) {
   L = (uint8_t)d;
   left_idx = 0;
   right_idx = 0;
 }
-static inline bool advance_state(int d, uint8_t& L, uint64_t& left_idx, uint64_t& right_idx) {
+template <class V>
+static inline bool advance_state(int d, uint8_t& L, V& left_idx, V& right_idx) {
   int Li = (int)L;
   int R = d - Li;
 
-  uint64_t right_lim = pow4(R);
+  V right_lim = pow4<V>(R);
   right_idx++;
   if (right_idx < right_lim) return true;
 
   right_idx = 0;
-  uint64_t left_lim = pow4(Li);
+  V left_lim = pow4<V>(Li);
   left_idx++;
   if (left_idx < left_lim) return true;
 
@@ -404,6 +1354,59 @@ static inline bool advance_state(int d, uint8_t& L, uint64_t& left_idx, uint64_t
   L = (uint8_t)(Li - 1);
   return true;
 }
+// Like advance_state, but skips every child that keeps base g (from the right) and all bases
+// above it unchanged: the next state changes the base g of the right part, or the lowest left
+// base when g lies in the parent, or base g of the left part. Used to step past a violating run
+// starting at g.
+template <class V>
+static inline bool skip_state(int d, int k0, uint8_t& L, V& left_idx, V& right_idx, int g) {
+  const int Li = (int)L;
+  const int R = d - Li;
+  if (g < R) {
+    right_idx = ((right_idx >> (2 * g)) + 1) << (2 * g);
+    if (right_idx < pow4<V>(R)) return true;
+    right_idx = 0;
+    left_idx++;
+  } else {
+    right_idx = 0;
+    const int gl = max(0, g - R - k0);
+    left_idx = ((left_idx >> (2 * gl)) + 1) << (2 * gl);
+  }
+  if (left_idx < pow4<V>(Li)) return true;
+  left_idx = 0;
+  if (Li == 0) return false;
+  L = (uint8_t)(Li - 1);
+  return true;
+}
+
+// Moves to the first child of the next layout (one base less on the left).
+template <class V>
+static inline bool skip_layout(uint8_t& L, V& left_idx, V& right_idx) {
+  left_idx = 0;
+  right_idx = 0;
+  if (L == 0) return false;
+  L = (uint8_t)(L - 1);
+  return true;
+}
+// Low bits of the 2-bit groups the parent occupies when R bases are appended on the right.
+template <class V>
+static inline V parent_groups(int k0, int R) {
+  const V lo = ~(V)0 / 3;
+  const V low = (2 * k0 >= (int)(8 * sizeof(V))) ? lo : (lo & (((V)1 << (2 * k0)) - 1));
+  return low << (2 * R);
+}
+// Smallest parent >= p with some layout whose parent bases meet every position class: in each
+// layout the highest offending parent base stays until it changes (see jump_past).
+template <class V>
+static inline uint64_t next_positional_parent(uint64_t p, int k0, int d, const LeafChecks<V>& lim) {
+  uint64_t next = UINT64_MAX;
+  for (int R = 0; R <= d; ++R) {
+    const V bad = position_violations((V)p << (2 * R), lim) & parent_groups<V>(k0, R);
+    if (bad == 0) return p;
+    next = min(next, jump_past(p, (uint64_t)(bad >> (2 * R))));
+  }
+  return next;
+}
 
 // ---------------- Base64url + LE pack/unpack ----------------
 static const char* B64URL = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
@@ -478,6 +1481,22 @@ static inline bool read_u64_le(const vector<uint8_t>& b, size_t off, uint64_t& x
   x = v;
   return true;
 }
+// Expansion indices: 8 bytes while kout <= 32, 16 bytes beyond.
+static inline void push_idx_le(vector<uint8_t>& b, u128 x, bool wide) {
+  push_u64_le(b, (uint64_t)x);
+  if (wide) push_u64_le(b, (uint64_t)(x >> 64));
+}
+static inline bool read_idx_le(const vector<uint8_t>& b, size_t& off, u128& x, bool wide) {
+  uint64_t lo = 0, hi = 0;
+  if (!read_u64_le(b, off, lo)) return false;
+  off += 8;
+  if (wide) {
+    if (!read_u64_le(b, off, hi)) return false;
+    off += 8;
+  }
+  x = ((u128)hi << 64) | lo;
+  return true;
+}
 
 // ---------------- Window cursor BCW2 ----------------
 struct WindowCursor {
@@ -502,16 +1521,26 @@ struct WindowCursor {
     uint64_t parent_anchor=UINT64_MAX; // UINT64_MAX means not started
     bool child_present=false;
     uint8_t L=0;
-    uint64_t left_idx=0;
-    uint64_t right_idx=0;
+    u128 left_idx=0;
+    u128 right_idx=0;
   };
   vector<LaneState> lanes;
+
+  // Set selection (--min-hamming / --min-edit / --color-balance): accepted k-mers so far, carried
+  // so later pages keep the distance to them and the balance.
+  char sel_metric='H';  // 'H' = Hamming, 'E' = edit distance, 'B' = colour balance only
+  uint8_t sel_d=0;
+  uint32_t set_size=0;
+  vector<u128> selected;
+  uint8_t balance_channels=0;   // --color-balance (0 = off)
+  uint16_t balance_share=0;     // --min-channel-share in permille
 };
 
 static string make_cursor_bcw2(const WindowCursor& c) {
   vector<uint8_t> b;
   b.reserve(64 + c.lanes.size() * 64);
-  b.push_back('B'); b.push_back('C'); b.push_back('W'); b.push_back('2');
+  const bool wide = c.kout > 32;
+  b.push_back('B'); b.push_back('C'); b.push_back('W'); b.push_back(wide ? '3' : '2');
   b.push_back(c.flags);
   b.push_back(c.k0); b.push_back(c.kout); b.push_back(c.d);
   push_u32_le(b, c.numShards);
@@ -535,11 +1564,34 @@ static string make_cursor_bcw2(const WindowCursor& c) {
       b.push_back(ln.child_present ? 1 : 0);
       if (ln.child_present) {
         b.push_back(ln.L);
-        push_u64_le(b, ln.left_idx);
-        push_u64_le(b, ln.right_idx);
+        push_idx_le(b, ln.left_idx, wide);
+        push_idx_le(b, ln.right_idx, wide);
       }
     }
   }
+  if (c.sel_d || c.balance_channels) {
+    b.push_back((uint8_t)c.sel_metric);
+    b.push_back(c.sel_d);
+    push_u32_le(b, c.set_size);
+    push_u32_le(b, (uint32_t)c.selected.size());
+    vector<u128> sorted_sel(c.selected);
+    sort(sorted_sel.begin(), sorted_sel.end());
+    u128 prev = 0;
+    for (u128 x : sorted_sel) {  // LEB128 deltas
+      u128 delta = x - prev;
+      prev = x;
+      do {
+        uint8_t byte = (uint8_t)(delta & 0x7F);
+        delta >>= 7;
+        b.push_back(byte | (delta ? 0x80 : 0));
+      } while (delta);
+    }
+    if (c.balance_channels) {
+      b.push_back('C');
+      b.push_back(c.balance_channels);
+      push_u16_le(b, c.balance_share);
+    }
+  }
   return b64url_encode(b);
 }
 
@@ -547,10 +1599,12 @@ static bool parse_cursor_bcw2(const string& token, WindowCursor& c) {
   vector<uint8_t> b;
   if (!b64url_decode(token, b)) return false;
   if (b.size() < 4 + 1 + 3 + 4 + 8 + 4 + 2 + 2 + 2) return false;
-  if (!(b[0]=='B' && b[1]=='C' && b[2]=='W' && b[3]=='2')) return false;
+  if (!(b[0]=='B' && b[1]=='C' && b[2]=='W' && (b[3]=='2' || b[3]=='3'))) return false;
 
   c.flags = b[4];
   c.k0 = b[5]; c.kout = b[6]; c.d = b[7];
+  const bool wide = b[3] == '3';
+  if (wide != (c.kout > 32)) return false;
   if (!read_u32_le(b, 8, c.numShards)) return false;
   if (!read_u64_le(b, 12, c.seed)) return false;
   if (!read_u32_le(b, 20, c.next_perm_pos)) return false;
@@ -583,8 +1637,8 @@ static bool parse_cursor_bcw2(const string& token, WindowCursor& c) {
       if (c.lanes[i].child_present) {
         if (off + 1 > b.size()) return false;
         c.lanes[i].L = b[off++];
-        if (!read_u64_le(b, off, c.lanes[i].left_idx)) return false; off += 8;
-        if (!read_u64_le(b, off, c.lanes[i].right_idx)) return false; off += 8;
+        if (!read_idx_le(b, off, c.lanes[i].left_idx, wide)) return false;
+        if (!read_idx_le(b, off, c.lanes[i].right_idx, wide)) return false;
       } else {
         c.lanes[i].L = 0;
         c.lanes[i].left_idx = 0;
@@ -593,6 +1647,37 @@ static bool parse_cursor_bcw2(const string& token, WindowCursor& c) {
     }
   }
 
+  if (off < b.size()) {
+    c.sel_metric = (char)b[off++];
+    if ((c.sel_metric != 'H' && c.sel_metric != 'E' && c.sel_metric != 'B') || off + 1 + 4 + 4 > b.size()) {
+      return false;
+    }
+    c.sel_d = b[off++];
+    uint32_t n = 0;
+    if (!read_u32_le(b, off, c.set_size)) return false; off += 4;
+    if (!read_u32_le(b, off, n)) return false; off += 4;
+    if (n > b.size() - off) return false;
+    c.selected.resize(n);
+    u128 prev = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+      u128 delta = 0;
+      for (int shift = 0;; shift += 7) {
+        if (off >= b.size() || shift > 126) return false;
+        const uint8_t byte = b[off++];
+        delta |= (u128)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) break;
+      }
+      prev += delta;
+      c.selected[i] = prev;
+    }
+    if (off < b.size()) {
+      if (b[off++] != 'C' || off + 1 + 2 > b.size()) return false;
+      c.balance_channels = b[off++];
+      if (!read_u16_le(b, off, c.balance_share)) return false; off += 2;
+    }
+    if ((c.sel_metric == 'B') != (c.sel_d == 0) || (c.sel_metric == 'B' && !c.balance_channels)) return false;
+  }
+
   c.present = true;
   return true;
 }
@@ -624,20 +1709,76 @@ struct Args {
   uint16_t burst=1;
 
   uint32_t refill_chunk=256;
+
+  vector<string> absent_in;   // source filters (colour layers)
+  vector<string> present_in;
+
+  int min_count=-1, max_count=-1; // count-layer thresholds for "present"
+
+  LeafLimits leaf;                // --max-homopolymer / --max-dinuc-repeat / --max-self-rc-stem
+  vector<string> avoid_rc_with;   // adapters the k-mers must not pair with
+  int max_adapter_stem=-1;        //   over more than this many bases (default: max_self_rc_stem)
+  bool both_strands_absent=false; // the reverse complement must be absent as well
+  string minimal_absent;          // (k-1)-mer shard set: both (k-1)-mers must be present
+  int robust_d=0;                 // every k-mer within this many mismatches must be absent too
+  string start_after;             // scan only k-mers after this one
+  string range;                   // LO:HI k-mer prefixes, inclusive
+  string position_class;          // --position-class P:C,P1-P2:C,...
+  vector<vector<string>> require; // one group per --require: a k-mer must contain one of each
+  vector<string> forbid;          // all --forbid patterns: a k-mer must contain none
+  string base_count;              // --base-count C:lo-hi,...
+
+  int min_hamming=-1;             // greedy set selection: pairwise distance >= d
+  int min_edit=-1;                //   same with Levenshtein distance
+  uint32_t set_size=0;            // stop once this many are selected (0 = no cap)
+  int color_balance=0;            // 2 or 4 channels: keep the selected set colour-balanced
+  string exclude_near;            // barcodes in use: drop k-mers within exclude_d-1 mismatches
+  int exclude_d=-1;
+  double min_channel_share=0.25;  //   each channel lit by this share of the set at every position
+
+  string serve;                   // worker mode: serve lane refills on this address
 };
 
+static void split_csv(const string& s, vector<string>& out) {
+  size_t i = 0;
+  while (i <= s.size()) {
+    size_t j = s.find(',', i);
+    if (j == string::npos) j = s.size();
+    if (j > i) out.push_back(s.substr(i, j - i));
+    i = j + 1;
+  }
+}
+static string join_csv(const vector<string>& v) {
+  string out;
+  for (const auto& x : v) { if (!out.empty()) out.push_back(','); out += x; }
+  return out;
+}
+
 static void usage(const char* prog) {
   cerr << "Usage: " << prog
-       << " --shards <dir> --gc-hist <json>"
+       << " --shards <dir> --gc-hist <json|bin>"
        << " [--construct_k X]"
        << " [--substring <DNA>]"
+       << " [--require P1,P2,... ...] [--forbid P1,P2,... ...]"
        << " [--reverse_complement]"
        << " [--gc-min 0..100] [--gc-max 0..100]"
        << " [--limit N]"
        << " [--threads N]"
        << " [--window W] [--burst B]"
        << " [--cursor <BCW2...>]"
-       << " [--random_access [--ra_seed U64]]\n";
+       << " [--random_access [--ra_seed U64]]"
+       << " [--absent-in S1,S2,...] [--present-in S1,S2,...]"
+       << " [--min-count N] [--max-count N]"
+       << " [--max-homopolymer N] [--max-dinuc-repeat N]"
+       << " [--max-self-rc-stem m] [--avoid-rc-with A1,A2,... [--max-adapter-stem m]]"
+       << " [--both-strands-absent] [--minimal-absent <(k-1)-mer shards dir>] [--robust d]"
+       << " [--tm-min C] [--tm-max C] [--na-mm 50] [--oligo-nm 50]"
+       << " [--position-class P:C,P1-P2:C,...] [--base-count C:lo-hi,...]"
+       << " [--min-hamming d | --min-edit d [--set-size N]]"
+       << " [--color-balance 2|4 [--min-channel-share F] --set-size N]"
+       << " [--exclude-near <barcode file> --exclude-d d]"
+       << " [--start-after <k-mer>] [--range LO:HI]\n"
+       << "       " << prog << " --shards <dir> --serve <host:port|unix:path> [--minimal-absent <dir>] [--threads N]\n";
 }
 
 static bool parse_args(int argc, char** argv, Args& a) {
@@ -648,6 +1789,8 @@ static bool parse_args(int argc, char** argv, Args& a) {
     else if (s=="--construct_k" && i+1<argc) a.construct_k=stoi(argv[++i]);
     else if (s=="--substring" && i+1<argc) { a.substring=argv[++i]; a.substring_set=!a.substring.empty(); }
     else if (s=="--reverse_complement") a.reverse_complement=true; // NEW
+    else if (s=="--require" && i+1<argc) { a.require.emplace_back(); split_csv(argv[++i], a.require.back()); }
+    else if (s=="--forbid" && i+1<argc) split_csv(argv[++i], a.forbid);
     else if (s=="--gc-min" && i+1<argc) a.gcMinPct=stoi(argv[++i]);
     else if (s=="--gc-max" && i+1<argc) a.gcMaxPct=stoi(argv[++i]);
     else if (s=="--limit" && i+1<argc) a.limit=stoull(argv[++i]);
@@ -658,92 +1801,439 @@ static bool parse_args(int argc, char** argv, Args& a) {
     else if (s=="--random_access") a.random_access=true;
     else if (s=="--ra_seed" && i+1<argc) { a.ra_seed_set=true; a.ra_seed=(uint64_t)stoull(argv[++i]); }
     else if (s=="--refill_chunk" && i+1<argc) a.refill_chunk=(uint32_t)max(16, stoi(argv[++i]));
+    else if (s=="--absent-in" && i+1<argc) split_csv(argv[++i], a.absent_in);
+    else if (s=="--present-in" && i+1<argc) split_csv(argv[++i], a.present_in);
+    else if (s=="--min-count" && i+1<argc) a.min_count=max(0, stoi(argv[++i]));
+    else if (s=="--max-count" && i+1<argc) a.max_count=max(0, stoi(argv[++i]));
+    else if (s=="--max-homopolymer" && i+1<argc) a.leaf.max_homopolymer=stoi(argv[++i]);
+    else if (s=="--max-dinuc-repeat" && i+1<argc) a.leaf.max_dinuc_repeat=stoi(argv[++i]);
+    else if (s=="--max-self-rc-stem" && i+1<argc) a.leaf.max_self_rc_stem=stoi(argv[++i]);
+    else if (s=="--avoid-rc-with" && i+1<argc) split_csv(argv[++i], a.avoid_rc_with);
+    else if (s=="--max-adapter-stem" && i+1<argc) a.max_adapter_stem=stoi(argv[++i]);
+    else if (s=="--both-strands-absent") a.both_strands_absent=true;
+    else if (s=="--minimal-absent" && i+1<argc) a.minimal_absent=argv[++i];
+    else if (s=="--robust" && i+1<argc) a.robust_d=stoi(argv[++i]);
+    else if (s=="--start-after" && i+1<argc) a.start_after=argv[++i];
+    else if (s=="--range" && i+1<argc) a.range=argv[++i];
+    else if (s=="--position-class" && i+1<argc) a.position_class=argv[++i];
+    else if (s=="--base-count" && i+1<argc) a.base_count=argv[++i];
+    else if (s=="--tm-min" && i+1<argc) a.leaf.tm_min=stod(argv[++i]);
+    else if (s=="--tm-max" && i+1<argc) a.leaf.tm_max=stod(argv[++i]);
+    else if (s=="--na-mm" && i+1<argc) a.leaf.na_mm=stod(argv[++i]);
+    else if (s=="--oligo-nm" && i+1<argc) a.leaf.oligo_nm=stod(argv[++i]);
+    else if (s=="--min-hamming" && i+1<argc) a.min_hamming=stoi(argv[++i]);
+    else if (s=="--min-edit" && i+1<argc) a.min_edit=stoi(argv[++i]);
+    else if (s=="--set-size" && i+1<argc) a.set_size=(uint32_t)stoul(argv[++i]);
+    else if (s=="--color-balance" && i+1<argc) a.color_balance=stoi(argv[++i]);
+    else if (s=="--min-channel-share" && i+1<argc) a.min_channel_share=stod(argv[++i]);
+    else if (s=="--exclude-near" && i+1<argc) a.exclude_near=argv[++i];
+    else if (s=="--exclude-d" && i+1<argc) a.exclude_d=stoi(argv[++i]);
+    else if (s=="--serve" && i+1<argc) a.serve=argv[++i];
     else { cerr << "Unknown arg: " << s << "\n"; return false; }
   }
 
-  if (a.shardsDir.empty() || a.gcHistPath.empty()) return false;
+  if (a.shardsDir.empty()) return false;
+  if (a.gcHistPath.empty() && a.serve.empty()) return false;
   if (a.gcMinPct < 0 || a.gcMinPct > 100 || a.gcMaxPct < 0 || a.gcMaxPct > 100 || a.gcMinPct > a.gcMaxPct) {
     cerr << "GC range must satisfy 0<=gc-min<=gc-max<=100\n";
     return false;
   }
   if (a.limit < 1) return false;
+  if ((a.leaf.max_homopolymer != -1 && a.leaf.max_homopolymer < 1) ||
+      (a.leaf.max_dinuc_repeat != -1 && a.leaf.max_dinuc_repeat < 1)) {
+    cerr << "--max-homopolymer/--max-dinuc-repeat must be >= 1\n";
+    return false;
+  }
+  if ((a.leaf.max_self_rc_stem != -1 && a.leaf.max_self_rc_stem < 1) ||
+      (a.max_adapter_stem != -1 && a.max_adapter_stem < 1)) {
+    cerr << "--max-self-rc-stem/--max-adapter-stem must be >= 1\n";
+    return false;
+  }
+  if (a.max_adapter_stem < 0) a.max_adapter_stem = a.leaf.max_self_rc_stem;
+  if (!(a.leaf.tm_min <= a.leaf.tm_max) || !(a.leaf.na_mm > 0) || !(a.leaf.oligo_nm > 0)) {
+    cerr << "--tm-min must be <= --tm-max, --na-mm and --oligo-nm > 0\n";
+    return false;
+  }
+  a.leaf.tm_prepare();
+  if (!a.avoid_rc_with.empty() && a.max_adapter_stem < 0) {
+    cerr << "--avoid-rc-with needs --max-adapter-stem (or --max-self-rc-stem)\n";
+    return false;
+  }
+  if ((a.min_hamming != -1 && (a.min_hamming < 1 || a.min_hamming > 64)) ||
+      (a.min_edit != -1 && (a.min_edit < 1 || a.min_edit > 64))) {
+    cerr << "--min-hamming/--min-edit must be between 1 and the output k\n";
+    return false;
+  }
+  if (a.min_hamming > 0 && a.min_edit > 0) {
+    cerr << "--min-hamming and --min-edit are exclusive\n";
+    return false;
+  }
+  if (a.set_size && a.min_hamming < 0 && a.min_edit < 0 && !a.color_balance) {
+    cerr << "--set-size needs --min-hamming, --min-edit or --color-balance\n";
+    return false;
+  }
+  if (a.color_balance && ((a.color_balance != 2 && a.color_balance != 4) || a.set_size < 2 ||
+                          !(a.min_channel_share > 0 && a.min_channel_share <= 0.5))) {
+    cerr << "--color-balance takes 2 or 4 channels and needs --set-size >= 2;"
+            " --min-channel-share must be in (0, 0.5]\n";
+    return false;
+  }
+  if (a.exclude_near.empty() != (a.exclude_d < 0) || (a.exclude_d != -1 && (a.exclude_d < 1 || a.exclude_d > 64))) {
+    cerr << "--exclude-near and --exclude-d go together; d must be between 1 and the output k\n";
+    return false;
+  }
+  if (a.robust_d < 0 || a.robust_d > 3) {
+    cerr << "--robust takes 1, 2 or 3 mismatches\n";
+    return false;
+  }
   return true;
 }
 
-// ---------------- Lane runtime ----------------
-struct LaneRuntime {
-  bool active=false;
-  uint32_t perm_pos=0;
-  unsigned shardIdx=0;
-  string shardPath;
+// ---------------- Lane bitmaps ----------------
+// Request filters that change which k-mers count as "present" (see --absent-in, --min-count).
+struct LaneFilter {
+  vector<string> absent_in, present_in;
+  int min_count=-1, max_count=-1;
 
-  roaring64_bitmap_t* bm=nullptr;
-  KbitHeader hdr;
+  bool by_source() const { return !absent_in.empty() || !present_in.empty(); }
+  bool by_count() const { return min_count >= 0 || max_count >= 0; }
+};
 
-  // Mode 0 (konly)
-  uint64_t after=UINT64_MAX;
+// The bitmap a lane scans around: the shard's present k-mers (optionally only those within the
+// count thresholds), or those failing the source filters.
+static roaring64_bitmap_t* load_lane_bitmap(const string& dir, const string& file, const vector<string>& deltas,
+                                            const string& counts, const LaneFilter& f,
+                                            uint64_t start, uint64_t end, KbitHeader& hdr) {
+  if (f.by_count()) {
+    roaring64_bitmap_t* bm = load_shard_layers(dir, file, deltas, hdr);
+    if (!bm) return nullptr;
+    roaring64_bitmap_t* kept = apply_count_threshold(dir + "/" + counts, bm, f.min_count, f.max_count);
+    roaring64_bitmap_free(bm);
+    return kept;
+  }
+  if (!f.by_source()) return load_shard_layers(dir, file, deltas, hdr);
+  return load_source_filter(dir, file, f.absent_in, f.present_in, start, end);
+}
 
-  // Mode 1 (expand) COMPLETE state:
-  uint64_t parent_anchor=UINT64_MAX; // UINT64_MAX => not started
-  bool child_present=false;
+static constexpr size_t kShardCacheBytes = size_t(1) << 30;
+
+// Lane bitmaps of any shard per (shard, filter), shared between lanes (and worker connections).
+// Holds up to cap_bytes of serialized bitmap size, evicting the least recently used entries;
+// bitmaps still in use stay alive through their shared_ptr.
+struct ShardCache {
+  struct Entry {
+    shared_ptr<roaring64_bitmap_t> bm;
+    size_t bytes = 0;
+    list<string>::iterator lru;
+  };
+  const string& dir;
+  const vector<string>& files;
+  const vector<vector<string>>& deltas;
+  const vector<string>& counts;
+  const vector<uint64_t>& starts;
+  const vector<uint64_t>& ends;
+  size_t cap_bytes = kShardCacheBytes;
+  mutex mu;
+  map<string, Entry> cache;
+  list<string> lru;  // most recently used first
+  size_t bytes = 0;
+};
+
+static shared_ptr<roaring64_bitmap_t> shard_cache_get(ShardCache& c, uint32_t shardIdx, const LaneFilter& f) {
+  const string key = to_string(shardIdx) + "|" + to_string(f.min_count) + "|" + to_string(f.max_count) +
+                     "|" + join_csv(f.absent_in) + "|" + join_csv(f.present_in);
+  {
+    lock_guard<mutex> lk(c.mu);
+    auto it = c.cache.find(key);
+    if (it != c.cache.end()) {
+      c.lru.splice(c.lru.begin(), c.lru, it->second.lru);
+      return it->second.bm;
+    }
+  }
+  KbitHeader h;
+  roaring64_bitmap_t* raw = load_lane_bitmap(c.dir, c.files[shardIdx], c.deltas[shardIdx], c.counts[shardIdx], f,
+                                             c.starts[shardIdx], c.ends[shardIdx], h);
+  if (!raw) return nullptr;
+  g_access_counts.bump(shardIdx);
+  shared_ptr<roaring64_bitmap_t> bm(raw, roaring64_bitmap_free);
+  const size_t bytes = roaring64_bitmap_portable_size_in_bytes(raw);
+  lock_guard<mutex> lk(c.mu);
+  auto it = c.cache.find(key);
+  if (it != c.cache.end()) return it->second.bm;  // another lane loaded it meanwhile
+  while (!c.lru.empty() && c.bytes + bytes > c.cap_bytes) {
+    auto victim = c.cache.find(c.lru.back());
+    c.bytes -= victim->second.bytes;
+    c.cache.erase(victim);
+    c.lru.pop_back();
+  }
+  c.lru.push_front(key);
+  c.cache[key] = ShardCache::Entry{bm, bytes, c.lru.begin()};
+  c.bytes += bytes;
+  return bm;
+}
+
+// Lookups a refill makes outside its own shard: --both-strands-absent checks each k0-mer's reverse
+// complement in the shard holding it (usually another shard), --minimal-absent its two (k0-1)-mers
+// in the (k0-1)-mer shard set, --robust the d-mismatch neighbourhood across shards. A refill
+// keeps the bitmaps it fetched, so the cache lock is taken once per shard and refill; a shard that
+// cannot be loaded sets `failed`.
+struct ShardLookup {
+  ShardCache& shards;
+  const LaneFilter& filter;
+  atomic<bool>& failed;
+};
+
+// --minimal-absent: the (k0-1)-mer shard set (e.g. shards_17 for k=18). Its shards are read
+// through a ShardCache with the query's LaneFilter, so "present" means the same at both lengths.
+struct SubShardSet {
+  string dir;
+  unsigned numShards=0;
+  vector<string> files, counts, nodes, sources;
+  vector<vector<string>> deltas;
+  vector<uint64_t> starts, ends;
+  int k=0;
+};
+
+static bool read_sub_shards(const string& dir, SubShardSet& s) {
+  string mmer_index;
+  uint64_t k = 0, total_bits = 0;
+  s.dir = dir;
+  if (!read_index(dir, s.numShards, s.files, s.deltas, s.counts, s.nodes, s.sources, mmer_index, k,
+                  total_bits, s.starts, s.ends) || k == 0 || k > 31) {
+    return false;
+  }
+  s.k = (int)k;
+  default_shard_ranges(s.numShards, total_bits, s.k, s.starts, s.ends);
+  return true;
+}
+
+// ---------------- Lane runtime ----------------
+// V holds kout-mers and expansion indices: uint64_t up to k=32, u128 beyond.
+template <class V>
+struct LaneRuntime {
+  bool active=false;
+  uint32_t perm_pos=0;
+  unsigned shardIdx=0;
+  string shardPath;
+  string node;   // non-empty: refilled by the worker at this address (bm stays null)
+
+  roaring64_bitmap_t* bm=nullptr;
+  KbitHeader hdr;
+
+  // Mode 0 (konly)
+  uint64_t after=UINT64_MAX;
+
+  // Mode 1 (expand) COMPLETE state:
+  uint64_t parent_anchor=UINT64_MAX; // UINT64_MAX => not started
+  bool child_present=false;
   uint8_t L=0;
-  uint64_t left_idx=0;
-  uint64_t right_idx=0;
+  V left_idx=0;
+  V right_idx=0;
+
+  // Set once the shard range is fully scanned; the lane stays active until `buf` is drained.
+  bool exhausted=false;
 
-  vector<uint64_t> buf;
+  vector<V> buf;
   size_t buf_pos=0;
 
-  void clear_buf(){ buf.clear(); buf_pos=0; }
+  // Expand mode: resume point just after each buffered value, applied when it is emitted.
+  struct ExpandResume {
+    uint64_t parent_anchor;
+    bool child_present;
+    uint8_t L;
+    V left_idx, right_idx;
+  };
+  vector<ExpandResume> buf_resume;
+
+  void clear_buf(){ buf.clear(); buf_resume.clear(); buf_pos=0; }
+  bool drained() const { return buf_pos >= buf.size(); }
+  bool done() const { return !active || (exhausted && drained()); }
 
   void free_all() {
     if (bm) { roaring64_bitmap_free(bm); bm=nullptr; }
     active=false;
+    exhausted=false;
     clear_buf();
   }
 };
 
-static inline bool leaf_ok(uint64_t vX, int kout,
+template <class V>
+static inline bool leaf_ok(V vX, int kout,
                            int gcMinPct, int gcMaxPct,
-                           bool substring_set, const vector<Pattern>& patterns) {
+                           bool substring_set, const vector<PatternT<V>>& patterns,
+                           const LeafChecks<V>& lim) {
+  if (!lim.forbid.empty() && lim.forbidden(vX, kout)) return false;
   if (!passes_gc_percent(vX, kout, gcMinPct, gcMaxPct)) return false;
-  if (substring_set && !contains_sub(vX, patterns.data(), patterns.size())) return false;
+  if (substring_set && !contains_sub(vX, patterns.data(), patterns.size()) &&
+      !contains_iupac(vX, lim.sub_iupac.data(), lim.sub_iupac.size())) {
+    return false;
+  }
+  for (const auto& g : lim.require) if (!g.matches(vX)) return false;
+  if (lim.any() && !passes_complexity(vX, kout, lim)) return false;
+  if (!lim.avoid.empty() && contains_sub(vX, lim.avoid.data(), lim.avoid.size())) return false;
+  if (lim.max_self_rc_stem >= 0 && has_self_rc_stem(vX, kout, lim.max_self_rc_stem + 1)) return false;
+  if (lim.positional() && position_violations(vX, lim)) return false;
+  if (!lim.counts.empty() && !passes_base_counts(vX, kout, lim.counts)) return false;
+  if (lim.by_tm() && !passes_tm(vX, kout, lim)) return false;
+  if (lim.exclude && lim.exclude->near(vX)) return false;
   return true;
 }
 
+// True if no k-mer within 1..d substitutions of absent k-mer v is present; call with g = k and
+// prefix = 0. occupied(lo, hi) tells whether any present k-mer lies in [lo, hi] (inclusive). Bases
+// are fixed from the most significant down and a prefix whose whole range is empty clears all its
+// completions at once, so sparse sets are decided near the top; the first present neighbour ends
+// the search.
+template <class F>
+static bool neighbourhood_absent(uint64_t v, int g, uint64_t prefix, int d, F& occupied) {
+  const uint64_t low = g >= 32 ? ~0ULL : (1ULL << (2 * g)) - 1;
+  const uint64_t lo = g >= 32 ? 0 : prefix << (2 * g);
+  if (!occupied(lo, lo | low)) return true;
+  if (g == 0) return false;  // a present neighbour (v itself is absent)
+  if (d == 0) return !occupied(lo | (v & low), lo | (v & low));
+  const uint64_t b = (v >> (2 * (g - 1))) & 3;
+  for (uint64_t x = 0; x < 4; ++x) {
+    if (!neighbourhood_absent(v, g - 1, (prefix << 2) | x, x == b ? d : d - 1, occupied)) return false;
+  }
+  return true;
+}
 
 // Fill lane buffer by scanning lexicographically in-shard
-static void refill_lane(LaneRuntime& lane,
+template <class V>
+static void refill_lane(LaneRuntime<V>& lane,
                         int k0, int kout,
                         int gcMinPct, int gcMaxPct,
-                        bool substring_set, const vector<Pattern>& patterns,
+                        bool substring_set, const vector<PatternT<V>>& patterns,
+                        const LeafChecks<V>& lim,
                         uint32_t refill_target,
                         const vector<uint64_t>& shard_starts,
-                        const vector<uint64_t>& shard_ends)
+                        const vector<uint64_t>& shard_ends,
+                        const vector<uint64_t>* chunks = nullptr, int chunk_bits = 0,
+                        ShardLookup* strands = nullptr, ShardLookup* minimal = nullptr,
+                        ShardLookup* robust = nullptr, int robust_d = 0)
 {
   lane.clear_buf();
   if (!lane.active || !lane.bm) return;
 
+  // True if the reverse complement of k0-mer x is absent; shards failing to load count as present.
+  map<uint32_t, shared_ptr<roaring64_bitmap_t>> held;
+  auto rc_absent = [&](uint64_t x)->bool {
+    const uint64_t rc = revcomp_packed(x, k0);
+    auto it = upper_bound(shard_starts.begin(), shard_starts.end(), rc);
+    if (it == shard_starts.begin()) return true;
+    const uint32_t s = (uint32_t)(it - shard_starts.begin() - 1);
+    if (rc >= shard_ends[s]) return true;
+    auto& bm = held[s];
+    if (!bm) bm = shard_cache_get(strands->shards, s, strands->filter);
+    if (!bm) { strands->failed = true; return false; }
+    return !roaring64_bitmap_contains(bm.get(), rc);
+  };
+
+  // --minimal-absent join: keeps the candidates whose (k0-1)-mer prefix and suffix are both present,
+  // in order, up to refill_target (`cut` records a shortfall). The batch's lookups are sorted by
+  // (k0-1)-mer, so each shard of that set is fetched once and probed in ascending order.
+  bool cut = false;
+  map<uint32_t, shared_ptr<roaring64_bitmap_t>> held_sub;
+  auto join_minimal = [&](vector<uint64_t>& cand) {
+    const auto& starts = minimal->shards.starts;
+    const auto& ends = minimal->shards.ends;
+    const uint64_t low = (1ULL << (2 * (k0 - 1))) - 1;
+    vector<pair<uint64_t, uint32_t>> look;  // (k0-1)-mer, candidate
+    look.reserve(2 * cand.size());
+    for (uint32_t i = 0; i < cand.size(); ++i) {
+      look.push_back({cand[i] >> 2, i});
+      look.push_back({cand[i] & low, i});
+    }
+    sort(look.begin(), look.end());
+    vector<uint8_t> hits(cand.size(), 0);
+    for (size_t j = 0; j < look.size();) {
+      auto it = upper_bound(starts.begin(), starts.end(), look[j].first);
+      const uint32_t s = (uint32_t)(it - starts.begin()) - 1;
+      if (it == starts.begin() || look[j].first >= ends[s]) { ++j; continue; }  // not covered: absent
+      auto& bm = held_sub[s];
+      if (!bm) bm = shard_cache_get(minimal->shards, s, minimal->filter);
+      if (!bm) { minimal->failed = true; cand.clear(); return; }
+      for (; j < look.size() && look[j].first < ends[s]; ++j) {
+        if (roaring64_bitmap_contains(bm.get(), look[j].first)) hits[look[j].second]++;
+      }
+    }
+    for (uint32_t i = 0; i < cand.size(); ++i) {
+      if (hits[i] < 2) continue;
+      if (lane.buf.size() >= refill_target) { cut = true; break; }
+      lane.buf.push_back(cand[i]);
+    }
+    cand.clear();
+  };
+
+  // --robust: range probes over the lane's own bitmap and, beyond the shard, the other shards'
+  // bitmaps (held for the refill, one iterator each); ranges no shard covers hold nothing.
+  struct RangeProbe {
+    shared_ptr<roaring64_bitmap_t> bm;
+    unique_ptr<roaring64_iterator_t, void (*)(roaring64_iterator_t*)> it{nullptr, roaring64_iterator_free};
+  };
+  map<uint32_t, RangeProbe> held_robust;
+  auto occupied = [&](uint64_t lo, uint64_t hi)->bool {
+    const auto& starts = robust->shards.starts;
+    const auto& ends = robust->shards.ends;
+    auto it = upper_bound(starts.begin(), starts.end(), lo);
+    size_t s = it == starts.begin() ? 0 : (size_t)(it - starts.begin()) - 1;
+    for (; s < starts.size() && starts[s] <= hi; ++s) {
+      if (ends[s] <= lo) continue;
+      const uint64_t a = max(lo, starts[s]), b = min(hi, ends[s] - 1);
+      auto& p = held_robust[(uint32_t)s];
+      if (!p.it) {
+        if (s != lane.shardIdx) p.bm = shard_cache_get(robust->shards, (uint32_t)s, robust->filter);
+        const roaring64_bitmap_t* bm = s == lane.shardIdx ? lane.bm : p.bm.get();
+        if (!bm) { robust->failed = true; return true; }
+        p.it.reset(roaring64_iterator_create(bm));
+      }
+      if (roaring64_iterator_move_equalorlarger(p.it.get(), a) && roaring64_iterator_value(p.it.get()) <= b) return true;
+    }
+    return false;
+  };
+
   if (kout == k0) {
     uint64_t shardIdx = lane.shardIdx;
     if (shardIdx >= shard_starts.size() || shardIdx >= shard_ends.size()) {
       lane.active = false;
       return;
     }
-    uint64_t start = shard_starts[shardIdx];
-    uint64_t end = shard_ends[shardIdx];
-    uint64_t v = (lane.after == UINT64_MAX) ? start : lane.after + 1;
+    uint64_t start = max(shard_starts[shardIdx], lim.scan_lo);
+    uint64_t end = max(start, lim.scan_hi < shard_ends[shardIdx] ? lim.scan_hi + 1 : shard_ends[shardIdx]);
+    uint64_t v = (lane.after == UINT64_MAX) ? start : max(start, lane.after + 1);
+    uint64_t chunk_end = 0;  // with an m-mer index: end of the candidate chunk holding v
+    vector<uint64_t> pending;  // --minimal-absent candidates awaiting the join
+    const size_t batch = max<size_t>(refill_target, 4096);
 
     for (; v < end && lane.buf.size() < refill_target; ++v) {
+      if (chunks && v >= chunk_end) {
+        auto it = lower_bound(chunks->begin(), chunks->end(), v >> chunk_bits);
+        if (it == chunks->end() || (*it << chunk_bits) >= end) { v = end; break; }
+        v = max(v, *it << chunk_bits);
+        chunk_end = (*it + 1) << chunk_bits;
+      }
+      if (lim.any() || lim.positional() || !lim.counts.empty() || !lim.forbid.empty()) {
+        const uint64_t bad = (uint64_t)(complexity_violations((V)v, kout, lim) | position_violations((V)v, lim) |
+                                        count_excess((V)v, kout, lim.counts) | lim.forbid_violations((V)v, kout));
+        const uint64_t next = jump_past(v, bad);
+        if (next >= end) { v = end; break; }
+        if (next != v) { v = next - 1; continue; }
+      }
       if (roaring64_bitmap_contains(lane.bm, v)) continue;
-      if (!leaf_ok(v, kout, gcMinPct, gcMaxPct, substring_set, patterns)) continue;
+      if (!leaf_ok((V)v, kout, gcMinPct, gcMaxPct, substring_set, patterns, lim)) continue;
+      if (strands && !rc_absent(v)) continue;
+      if (robust && !neighbourhood_absent(v, k0, 0, robust_d, occupied)) continue;
+      if (minimal) {
+        pending.push_back(v);
+        if (pending.size() >= batch) join_minimal(pending);
+        continue;
+      }
       lane.buf.push_back(v);
     }
+    if (minimal) join_minimal(pending);
 
-    if (v == end) {
-      lane.active = false;
-    } else {
-      lane.after = v - 1;
-    }
+    // lane.after moves on emission only; a refill stops right after its last buffered value.
+    if (v == end && !cut) lane.exhausted = true;
     return;
   }
 
@@ -758,169 +2248,783 @@ static void refill_lane(LaneRuntime& lane,
   const uint64_t start = shard_starts[shardIdx];
   const uint64_t end = shard_ends[shardIdx];
 
+  // Scan from the lane's resume point with local state; the lane itself only moves when a
+  // buffered value is emitted (see buf_resume), so unemitted values survive into the cursor.
+  uint64_t anchor = lane.parent_anchor;
+  bool child = lane.child_present;
+  uint8_t L0 = lane.L;
+  V li0 = lane.left_idx, ri0 = lane.right_idx;
+
   while (lane.buf.size() < refill_target) {
     uint64_t parentB = 0;
-    if (lane.parent_anchor == UINT64_MAX) {
+    if (anchor == UINT64_MAX) {
       parentB = start;
-    } else if (lane.child_present) {
-      parentB = lane.parent_anchor;
+    } else if (child) {
+      parentB = anchor;
     } else {
-      parentB = lane.parent_anchor + 1;
+      parentB = anchor + 1;
     }
 
-    while (parentB < end && roaring64_bitmap_contains(lane.bm, parentB)) parentB++;
-    if (parentB >= end) { lane.active=false; break; }
+    // Every child embeds its parent, so parents over the complexity limits or a base-count maximum,
+    // or holding a forbidden pattern, are skipped whole, jumping past each offending run or prefix;
+    // so are parents that already hold a self-complementary stem, and those breaking a position
+    // class in every layout.
+    // With --both-strands-absent the parent's reverse complement must be absent too (then every
+    // child's reverse complement holds an absent k0-mer). Parents whose children cannot reach the
+    // Tm window or the base-count ranges are skipped as well.
+    while (parentB < end) {
+      if (lim.any() || !lim.counts.empty() || !lim.forbid.empty()) {
+        const uint64_t next = jump_past(parentB, complexity_violations(parentB, k0, lim) |
+                                                 count_excess(parentB, k0, lim.counts) |
+                                                 (uint64_t)lim.forbid_violations((V)parentB, k0));
+        if (next != parentB) { parentB = min(next, end); continue; }
+      }
+      if (lim.positional()) {
+        const uint64_t next = next_positional_parent(parentB, k0, d, lim);
+        if (next != parentB) { parentB = min(next, end); continue; }
+      }
+      if (!roaring64_bitmap_contains(lane.bm, parentB) &&
+          (lim.max_self_rc_stem < 0 || !has_self_rc_stem(parentB, k0, lim.max_self_rc_stem + 1)) &&
+          (!lim.by_tm() || tm_children_may_pass(parentB, k0, kout, lim)) &&
+          (lim.counts.empty() || base_counts_may_pass(parentB, k0, d, lim.counts)) &&
+          (!strands || rc_absent(parentB))) break;
+      parentB++;
+    }
+    if (parentB >= end) { lane.exhausted=true; break; }
 
     uint8_t Lcur;
-    uint64_t li, ri;
+    V li, ri;
 
-    if (lane.child_present && lane.parent_anchor == parentB) {
-      Lcur = lane.L;
-      li = lane.left_idx;
-      ri = lane.right_idx;
+    if (child && anchor == parentB) {
+      Lcur = L0;
+      li = li0;
+      ri = ri0;
     } else {
       init_state_first(d, Lcur, li, ri);
     }
 
     bool exhausted_parent = false;
     while (!exhausted_parent && lane.buf.size() < refill_target) {
-      uint64_t vX = make_value(parentB, k0, kout, (int)Lcur, li, ri);
-      if (leaf_ok(vX, kout, gcMinPct, gcMaxPct, substring_set, patterns)) {
-        lane.buf.push_back(vX);
+      V vX = make_value(parentB, k0, kout, (int)Lcur, li, ri);
+      if (lim.positional()) {
+        // A position class the parent itself breaks at this layout fails every child of the layout.
+        const V bad = position_violations(vX, lim);
+        if (bad & parent_groups<V>(k0, d - (int)Lcur)) {
+          if (!skip_layout(Lcur, li, ri)) exhausted_parent = true;
+          continue;
+        }
+        if (bad != 0) {
+          if (!skip_state(d, k0, Lcur, li, ri, top_bit(bad) / 2)) exhausted_parent = true;
+          continue;
+        }
       }
+      if (lim.any() || !lim.counts.empty() || !lim.forbid.empty()) {
+        const V bad = complexity_violations(vX, kout, lim) | count_excess(vX, kout, lim.counts) |
+                      lim.forbid_violations(vX, kout);
+        if (bad != 0) {
+          if (!skip_state(d, k0, Lcur, li, ri, top_bit(bad) / 2)) exhausted_parent = true;
+          continue;
+        }
+      }
+      const bool ok = leaf_ok(vX, kout, gcMinPct, gcMaxPct, substring_set, patterns, lim);
       if (!advance_state(d, Lcur, li, ri)) exhausted_parent = true;
+      if (ok) {
+        lane.buf.push_back(vX);
+        lane.buf_resume.push_back({parentB, !exhausted_parent, Lcur, li, ri});
+      }
     }
 
-    if (lane.buf.size() >= refill_target) {
-      lane.parent_anchor = parentB;
-      lane.child_present = true;
-      lane.L = Lcur;
-      lane.left_idx = li;
-      lane.right_idx = ri;
-      break;
+    anchor = parentB;
+    child = !exhausted_parent;
+    L0 = Lcur; li0 = li; ri0 = ri;
+  }
+}
+
+// ---------------- Node sockets (scatter-gather) ----------------
+// Addresses are "host:port" (TCP) or "unix:/path/to.sock". One refill per connection:
+//   request : "SQB1" | shardIdx u32 | k0 u8 | kout u8 | gcMin u8 | gcMax u8 | substring_set u8 |
+//             refill_target u32 | npat u32 | npat x (mask V, bits V) |
+//             max_homopolymer i32 | max_dinuc_repeat i32 | max_self_rc_stem i32 |
+//             tm_min f64 | tm_max f64 | na_mm f64 | oligo_nm f64 |
+//             navoid u32 | navoid x (mask V, bits V) (adapter mask set) |
+//             4 x pos_bad V | ncounts u32 | ncounts x (set u8, lo u8, hi u8) |
+//             niupac u32 | niupac x 4 V (IUPAC substring placements) |
+//             nrequire u32 | nrequire x set | forbid set | forbid_w u8 | nwords u32 | nwords x u64 |
+//             exclude_d u8 | nexclude u32 | nexclude x V (--exclude-near list) |
+//             scan_lo u64 | scan_hi u64 (--start-after / --range), where
+//             set = nmask u32 | nmask x (mask V, bits V) | niupac u32 | niupac x 4 V |
+//             min_count i32 | max_count i32 | absent-in csv (u32 len + bytes) | present-in csv (same) |
+//             both_strands u8 | minimal_absent u8 | robust_d u8 |
+//             after u64 | parent_anchor u64 | child_present u8 | L u8 | left_idx V | right_idx V |
+//             chunk_bits u8 | n u32 | n x u64 candidate chunk ids within the shard (m-mer index)
+//   response: status u8 (0 = ok) | exhausted u8 | n u32 | n x V values |
+//             (kout > k0) n x (parent_anchor u64, child_present u8, L u8, left_idx V, right_idx V)
+// V is 8 bytes while kout <= 32 and 16 bytes beyond. Integers are in native byte order (workers
+// run the same build as the coordinator).
+static bool send_all(int fd, const void* p, size_t n) {
+  const char* c = (const char*)p;
+  while (n > 0) {
+    ssize_t w = ::send(fd, c, n, MSG_NOSIGNAL);
+    if (w <= 0) return false;
+    c += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, void* p, size_t n) {
+  char* c = (char*)p;
+  while (n > 0) {
+    ssize_t r = ::recv(fd, c, n, 0);
+    if (r <= 0) return false;
+    c += r;
+    n -= (size_t)r;
+  }
+  return true;
+}
+
+static int open_node_socket(const string& addr, bool listen_mode) {
+  if (addr.compare(0, 5, "unix:") == 0) {
+    sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    const string path = addr.substr(5);
+    if (path.size() >= sizeof(sa.sun_path)) return -1;
+    memcpy(sa.sun_path, path.c_str(), path.size());
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (listen_mode) {
+      ::unlink(path.c_str());
+      if (::bind(fd, (sockaddr*)&sa, sizeof(sa)) == 0 && ::listen(fd, 128) == 0) return fd;
+    } else if (::connect(fd, (sockaddr*)&sa, sizeof(sa)) == 0) {
+      return fd;
     }
+    ::close(fd);
+    return -1;
+  }
 
-    lane.parent_anchor = parentB;
-    lane.child_present = false;
-    lane.L = 0; lane.left_idx = 0; lane.right_idx = 0;
+  auto colon = addr.rfind(':');
+  if (colon == string::npos) return -1;
+  const string host = addr.substr(0, colon);
+  const string port = addr.substr(colon + 1);
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (listen_mode) hints.ai_flags = AI_PASSIVE;
+  addrinfo* res = nullptr;
+  if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+  int fd = -1;
+  for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+    fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) continue;
+    if (listen_mode) {
+      int one = 1;
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (::bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, 128) == 0) break;
+    } else if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    ::close(fd);
+    fd = -1;
   }
+  ::freeaddrinfo(res);
+  return fd;
 }
 
-// ---------------- Main ----------------
-int main(int argc, char** argv) {
-  ios::sync_with_stdio(false);
-  cin.tie(nullptr);
+static void push_str(vector<uint8_t>& b, const string& s) {
+  push_u32_le(b, (uint32_t)s.size());
+  b.insert(b.end(), s.begin(), s.end());
+}
+static bool recv_str(int fd, string& s) {
+  uint32_t n = 0;
+  if (!recv_all(fd, &n, 4) || n > (1u << 20)) return false;
+  s.resize(n);
+  return recv_all(fd, &s[0], n);
+}
 
-  Args args;
-  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+// refill_lane() for a lane whose shard lives on lane.node.
+template <class V>
+static void push_raw(vector<uint8_t>& b, const V& x) {
+  const uint8_t* p = (const uint8_t*)&x;
+  b.insert(b.end(), p, p + sizeof(V));
+}
 
-  // We support k0 in {16,17,18} shard sets on-disk.
-  // Expansion (construct_k > k0) is ONLY allowed when k0==18.
-  // If the caller requests construct_k > 18, we force base shards to 18-mers.
-  const int requested_kout = (args.construct_k > 0) ? args.construct_k : -1;
+template <class V>
+static void push_pattern_set(vector<uint8_t>& b, const PatternSet<V>& set) {
+  push_u32_le(b, (uint32_t)set.masks.size());
+  for (const auto& p : set.masks) { push_raw(b, p.mask); push_raw(b, p.bits); }
+  push_u32_le(b, (uint32_t)set.iupac.size());
+  for (const auto& p : set.iupac) for (const V& m : p.bad) push_raw(b, m);
+}
+template <class V>
+static bool recv_pattern_set(int fd, PatternSet<V>& set) {
+  uint32_t nmask = 0, niupac = 0;
+  if (!recv_all(fd, &nmask, 4) || nmask > (1u << 20)) return false;
+  set.masks.resize(nmask);
+  if (!recv_all(fd, set.masks.data(), (size_t)nmask * sizeof(PatternT<V>))) return false;
+  if (!recv_all(fd, &niupac, 4) || niupac > (1u << 20)) return false;
+  set.iupac.resize(niupac);
+  return recv_all(fd, set.iupac.data(), (size_t)niupac * sizeof(IupacPatternT<V>));
+}
 
-  unsigned numShards=0;
-  vector<string> shardFiles;
-  uint64_t k_from_index=0;
-  uint64_t total_bits_index=0;
-  vector<uint64_t> shard_starts;
-  vector<uint64_t> shard_ends;
-  if (!read_index(args.shardsDir, numShards, shardFiles, k_from_index,
-                  total_bits_index, shard_starts, shard_ends)) {
-    cerr << "Failed to read " << args.shardsDir << "/index.json\n";
-    return 1;
+template <class V>
+static bool refill_lane_remote(LaneRuntime<V>& lane, int k0, int kout, int gcMinPct, int gcMaxPct,
+                               bool substring_set, const vector<PatternT<V>>& patterns,
+                               const LeafChecks<V>& lim, uint32_t refill_target, const LaneFilter& f,
+                               const vector<uint64_t>& shard_chunks, int chunk_bits, bool both_strands,
+                               bool minimal_absent, int robust_d) {
+  lane.clear_buf();
+  vector<uint8_t> req;
+  req.insert(req.end(), {'S', 'Q', 'B', '1'});
+  push_u32_le(req, lane.shardIdx);
+  req.push_back((uint8_t)k0); req.push_back((uint8_t)kout);
+  req.push_back((uint8_t)gcMinPct); req.push_back((uint8_t)gcMaxPct);
+  req.push_back(substring_set ? 1 : 0);
+  push_u32_le(req, refill_target);
+  push_u32_le(req, (uint32_t)patterns.size());
+  for (const auto& p : patterns) { push_raw(req, p.mask); push_raw(req, p.bits); }
+  push_u32_le(req, (uint32_t)lim.max_homopolymer);
+  push_u32_le(req, (uint32_t)lim.max_dinuc_repeat);
+  push_u32_le(req, (uint32_t)lim.max_self_rc_stem);
+  for (double x : {lim.tm_min, lim.tm_max, lim.na_mm, lim.oligo_nm}) push_raw(req, x);
+  push_u32_le(req, (uint32_t)lim.avoid.size());
+  for (const auto& p : lim.avoid) { push_raw(req, p.mask); push_raw(req, p.bits); }
+  for (const V& m : lim.pos_bad) push_raw(req, m);
+  push_u32_le(req, (uint32_t)lim.counts.size());
+  for (const auto& c : lim.counts) req.insert(req.end(), {c.set, c.lo, c.hi});
+  push_u32_le(req, (uint32_t)lim.sub_iupac.size());
+  for (const auto& p : lim.sub_iupac) for (const V& m : p.bad) push_raw(req, m);
+  push_u32_le(req, (uint32_t)lim.require.size());
+  for (const auto& g : lim.require) push_pattern_set(req, g);
+  push_pattern_set(req, lim.forbid);
+  req.push_back((uint8_t)lim.forbid_w);
+  push_u32_le(req, (uint32_t)lim.forbid_table.size());
+  for (uint64_t w : lim.forbid_table) push_u64_le(req, w);
+  req.push_back(lim.exclude ? (uint8_t)lim.exclude->index.d : 0);
+  push_u32_le(req, lim.exclude ? (uint32_t)lim.exclude->values.size() : 0);
+  if (lim.exclude) for (const V& v : lim.exclude->values) push_raw(req, v);
+  push_u64_le(req, lim.scan_lo);
+  push_u64_le(req, lim.scan_hi);
+  push_u32_le(req, (uint32_t)f.min_count);
+  push_u32_le(req, (uint32_t)f.max_count);
+  push_str(req, join_csv(f.absent_in));
+  push_str(req, join_csv(f.present_in));
+  req.push_back(both_strands ? 1 : 0);
+  req.push_back(minimal_absent ? 1 : 0);
+  req.push_back((uint8_t)robust_d);
+  push_u64_le(req, lane.after);
+  push_u64_le(req, lane.parent_anchor);
+  req.push_back(lane.child_present ? 1 : 0);
+  req.push_back(lane.L);
+  push_raw(req, lane.left_idx);
+  push_raw(req, lane.right_idx);
+  req.push_back((uint8_t)chunk_bits);
+  push_u32_le(req, (uint32_t)shard_chunks.size());
+  for (uint64_t c : shard_chunks) push_u64_le(req, c);
+
+  int fd = open_node_socket(lane.node, false);
+  if (fd < 0) { cerr << "Error: cannot connect to node " << lane.node << "\n"; return false; }
+  uint8_t status = 1, exhausted = 0;
+  uint32_t n = 0;
+  bool ok = send_all(fd, req.data(), req.size()) && recv_all(fd, &status, 1) && status == 0 &&
+            recv_all(fd, &exhausted, 1) && recv_all(fd, &n, 4) && n <= refill_target;
+  if (ok) {
+    lane.buf.resize(n);
+    ok = recv_all(fd, lane.buf.data(), (size_t)n * sizeof(V));
   }
-
-  const int k_index = (int)k_from_index;
-  if (k_index <= 0 || k_index > 32) {
-    cerr << "Error: invalid k in index.json: " << k_index << "\n";
-    return 1;
+  if (ok && kout != k0) {
+    lane.buf_resume.resize(n);
+    for (uint32_t i = 0; ok && i < n; ++i) {
+      auto& r = lane.buf_resume[i];
+      uint8_t child = 0;
+      ok = recv_all(fd, &r.parent_anchor, 8) && recv_all(fd, &child, 1) && recv_all(fd, &r.L, 1) &&
+           recv_all(fd, &r.left_idx, sizeof(V)) && recv_all(fd, &r.right_idx, sizeof(V));
+      r.child_present = child != 0;
+    }
   }
+  ::close(fd);
+  if (!ok) { cerr << "Error: refill of shard " << lane.shardIdx << " failed on node " << lane.node << "\n"; return false; }
+  if (exhausted) lane.exhausted = true;
+  return true;
+}
 
-  // Decide the effective base-k (k0) and output-k (kout).
-  int k0 = k_index;
-  int kout = (requested_kout > 0) ? requested_kout : k0;
-  if (kout > 32) { cerr << "Error: construct_k>32 not supported in uint64 encoding\n"; return 1; }
-
-  // Enforce: only 18-mer base allows expansion.
-  // For kout>18, we require k0==18. If the user pointed us at shards_16/shards_17, fail loudly.
-  // (The web server will route to shards_18 automatically for kout>18.)
-  if (kout > 18 && k0 != 18) {
-    cerr << "Error: construct_k>18 expansion is only supported from k=18 base shards. "
-         << "Got base k=" << k0 << ".\n";
-    return 1;
+// Worker side: lane bitmaps are cached per (shard, filter) so consecutive refills of the same lane
+// do not reload the shard.
+struct ServeContext {
+  ShardCache& shards;
+  const vector<string>& sources;
+  ShardCache* sub;  // --minimal-absent (k0-1)-mer set given at --serve, or null
+
+  // --exclude-near lists arrive with every refill; their indices are kept by content (hashed,
+  // then compared in full), so each list is indexed once per worker.
+  struct NearEntry {
+    int k = 0, d = 0;
+    size_t width = 0;  // sizeof(V)
+    shared_ptr<const void> list;
+  };
+  mutex near_mu;
+  map<uint64_t, NearEntry> near_lists;
+
+  template <class V>
+  shared_ptr<const NearList<V>> near_list(int k, int d, vector<V> values) {
+    uint64_t h = 1469598103934665603ULL ^ (uint64_t)(k << 8 | d) ^ ((uint64_t)sizeof(V) << 16);
+    const auto* p = (const uint8_t*)values.data();
+    for (size_t i = 0; i < values.size() * sizeof(V); ++i) h = (h ^ p[i]) * 1099511628211ULL;
+    {
+      lock_guard<mutex> lk(near_mu);
+      auto it = near_lists.find(h);
+      if (it != near_lists.end() && it->second.k == k && it->second.d == d && it->second.width == sizeof(V)) {
+        auto list = static_pointer_cast<const NearList<V>>(it->second.list);
+        if (list->values == values) return list;
+      }
+    }
+    auto list = make_shared<const NearList<V>>(k, d, move(values));
+    lock_guard<mutex> lk(near_mu);
+    if (near_lists.size() >= 8) near_lists.clear();
+    near_lists[h] = NearEntry{k, d, sizeof(V), list};
+    return list;
   }
+};
 
-  // Enforce: no expansion for k0<18 at all.
-  if (k0 < 18 && kout != k0) {
-    cerr << "Error: expansion is disabled for k=" << k0 << ". "
-         << "Use construct_k=" << k0 << ".\n";
-    return 1;
+// Reads the rest of one SQB1 request (after k0/kout/gc/substring_set) and builds the response.
+template <class V>
+static void serve_one_refill(int fd, uint32_t shardIdx, const uint8_t hdr5[5], ServeContext& ctx,
+                             vector<uint8_t>& resp) {
+  uint32_t refill_target = 0, npat = 0;
+  int32_t min_count = -1, max_count = -1;
+  string absent_csv, present_csv;
+  bool ok = recv_all(fd, &refill_target, 4) && recv_all(fd, &npat, 4) &&
+            refill_target <= (1u << 24) && npat <= 4096;
+  vector<PatternT<V>> patterns(ok ? npat : 0);
+  for (uint32_t i = 0; ok && i < npat; ++i) {
+    ok = recv_all(fd, &patterns[i].mask, sizeof(V)) && recv_all(fd, &patterns[i].bits, sizeof(V));
   }
-  int k_from_hist=0;
-  vector<vector<uint64_t>> gc_hists;
-  auto t_hist0 = Clock::now();
-  if (!load_gc_hist_json(args.gcHistPath, k_from_hist, gc_hists)) {
-    cerr << "Failed to load gc histogram json: " << args.gcHistPath << "\n";
-    return 1;
+  LeafChecks<V> lim;
+  uint32_t navoid = 0;
+  ok = ok && recv_all(fd, &lim.max_homopolymer, 4) && recv_all(fd, &lim.max_dinuc_repeat, 4) &&
+       recv_all(fd, &lim.max_self_rc_stem, 4) && recv_all(fd, &lim.tm_min, 8) && recv_all(fd, &lim.tm_max, 8) &&
+       recv_all(fd, &lim.na_mm, 8) && recv_all(fd, &lim.oligo_nm, 8) && recv_all(fd, &navoid, 4) &&
+       navoid <= (1u << 20);
+  lim.tm_prepare();
+  lim.avoid.resize(ok ? navoid : 0);
+  for (uint32_t i = 0; ok && i < navoid; ++i) {
+    ok = recv_all(fd, &lim.avoid[i].mask, sizeof(V)) && recv_all(fd, &lim.avoid[i].bits, sizeof(V));
   }
-  auto t_hist1 = Clock::now();
+  uint32_t ncounts = 0;
+  ok = ok && recv_all(fd, lim.pos_bad, sizeof(lim.pos_bad)) && recv_all(fd, &ncounts, 4) && ncounts <= 64;
+  lim.counts.resize(ok ? ncounts : 0);
+  ok = ok && recv_all(fd, lim.counts.data(), (size_t)ncounts * sizeof(BaseCount));
+  uint32_t niupac = 0;
+  ok = ok && recv_all(fd, &niupac, 4) && niupac <= 4096;
+  lim.sub_iupac.resize(ok ? niupac : 0);
+  ok = ok && recv_all(fd, lim.sub_iupac.data(), (size_t)niupac * sizeof(IupacPatternT<V>));
+  uint32_t nrequire = 0, nwords = 0;
+  uint8_t forbid_w = 0;
+  ok = ok && recv_all(fd, &nrequire, 4) && nrequire <= 256;
+  lim.require.resize(ok ? nrequire : 0);
+  for (auto& g : lim.require) ok = ok && recv_pattern_set(fd, g);
+  ok = ok && recv_pattern_set(fd, lim.forbid) && recv_all(fd, &forbid_w, 1) && forbid_w <= 8 &&
+       recv_all(fd, &nwords, 4) && nwords <= (1u << 10);
+  lim.forbid_w = forbid_w;
+  lim.forbid_table.resize(ok ? nwords : 0);
+  ok = ok && recv_all(fd, lim.forbid_table.data(), (size_t)nwords * 8) &&
+       (forbid_w == 0 || nwords == (1u << max(0, 2 * forbid_w - 6)));
+  uint8_t exclude_d = 0;
+  uint32_t nexclude = 0;
+  ok = ok && recv_all(fd, &exclude_d, 1) && recv_all(fd, &nexclude, 4) && nexclude <= (1u << 24) &&
+       (nexclude == 0 || (exclude_d >= 1 && exclude_d <= hdr5[1]));
+  vector<V> exclude(ok ? nexclude : 0);
+  ok = ok && recv_all(fd, exclude.data(), (size_t)nexclude * sizeof(V));
+  if (ok && nexclude) lim.exclude = ctx.near_list<V>(hdr5[1], exclude_d, move(exclude));
+  ok = ok && recv_all(fd, &lim.scan_lo, 8) && recv_all(fd, &lim.scan_hi, 8) &&
+       ((lim.scan_lo == 0 && lim.scan_hi == UINT64_MAX) || hdr5[0] == hdr5[1]);
+  uint8_t both_strands = 0, minimal_absent = 0, robust_d = 0;
+  ok = ok && recv_all(fd, &min_count, 4) && recv_all(fd, &max_count, 4) &&
+       recv_str(fd, absent_csv) && recv_str(fd, present_csv) && recv_all(fd, &both_strands, 1) &&
+       recv_all(fd, &minimal_absent, 1) && recv_all(fd, &robust_d, 1);
+
+  LaneRuntime<V> lane;
+  uint8_t child = 0;
+  ok = ok && recv_all(fd, &lane.after, 8) && recv_all(fd, &lane.parent_anchor, 8) &&
+       recv_all(fd, &child, 1) && recv_all(fd, &lane.L, 1) &&
+       recv_all(fd, &lane.left_idx, sizeof(V)) && recv_all(fd, &lane.right_idx, sizeof(V));
+  lane.child_present = child != 0;
+  uint8_t chunk_bits = 0;
+  uint32_t nchunks = 0;
+  // At most one id per chunk the shard's range overlaps.
+  ok = ok && recv_all(fd, &chunk_bits, 1) && recv_all(fd, &nchunks, 4) && chunk_bits < 64 &&
+       nchunks <= (1u << 26) &&
+       nchunks <= ((ctx.shards.ends[shardIdx] - 1) >> chunk_bits) - (ctx.shards.starts[shardIdx] >> chunk_bits) + 1;
+  vector<uint64_t> chunks(ok ? nchunks : 0);
+  ok = ok && recv_all(fd, chunks.data(), (size_t)nchunks * 8);
+
+  LaneFilter f;
+  f.min_count = min_count;
+  f.max_count = max_count;
+  split_csv(absent_csv, f.absent_in);
+  split_csv(present_csv, f.present_in);
+  for (const auto* names : {&f.absent_in, &f.present_in}) {
+    for (const auto& src : *names) ok = ok && find(ctx.sources.begin(), ctx.sources.end(), src) != ctx.sources.end();
+  }
+  if (ok && f.by_count() && ctx.shards.counts[shardIdx].empty()) ok = false;
+  if (minimal_absent && (!ctx.sub || hdr5[0] != hdr5[1])) ok = false;
+  if (robust_d && (robust_d > 3 || hdr5[0] != hdr5[1])) ok = false;
+
+  shared_ptr<roaring64_bitmap_t> bm;
+  if (ok) bm = shard_cache_get(ctx.shards, shardIdx, f);
+  ok = ok && bm;
+  if (!ok) { resp.push_back(1); return; }
+
+  const int k0 = hdr5[0], kout = hdr5[1];
+  lane.active = true;
+  lane.shardIdx = shardIdx;
+  lane.bm = bm.get();
+  atomic<bool> strand_failed(false), sub_failed(false);
+  ShardLookup strands{ctx.shards, f, strand_failed};
+  ShardLookup minimal{ctx.sub ? *ctx.sub : ctx.shards, f, sub_failed};
+  refill_lane(lane, k0, kout, hdr5[2], hdr5[3], hdr5[4] != 0, patterns, lim, refill_target,
+              ctx.shards.starts, ctx.shards.ends, chunk_bits ? &chunks : nullptr, chunk_bits,
+              both_strands ? &strands : nullptr, minimal_absent ? &minimal : nullptr,
+              robust_d ? &strands : nullptr, robust_d);
+  lane.bm = nullptr;  // owned by the cache
+  if (strand_failed || sub_failed) { resp.push_back(1); return; }
+  resp.push_back(0);
+  resp.push_back(lane.exhausted ? 1 : 0);
+  push_u32_le(resp, (uint32_t)lane.buf.size());
+  for (const V& v : lane.buf) push_raw(resp, v);
+  if (kout != k0) {
+    for (const auto& r : lane.buf_resume) {
+      push_u64_le(resp, r.parent_anchor);
+      resp.push_back(r.child_present ? 1 : 0);
+      resp.push_back(r.L);
+      push_raw(resp, r.left_idx);
+      push_raw(resp, r.right_idx);
+    }
+  }
+}
 
-  if (k_from_hist != k0) {
-    cerr << "GC hist k (" << k_from_hist << ") != index k (" << k0 << ")\n";
-    return 1;
+static int serve_refills(const string& dir, const vector<string>& files, const vector<vector<string>>& deltas,
+                         const vector<string>& counts, const vector<string>& sources,
+                         const vector<uint64_t>& starts, const vector<uint64_t>& ends, const string& addr,
+                         const SubShardSet& sub, int k, int threads) {
+  int lfd = open_node_socket(addr, true);
+  if (lfd < 0) { perror(("listen " + addr).c_str()); return 1; }
+  cerr << "[INFO] Serving " << files.size() << " shard(s) of " << dir << " on " << addr << "\n";
+
+  ShardCache shards{dir, files, deltas, counts, starts, ends, kShardCacheBytes, {}, {}, {}, 0};
+  ShardCache sub_shards{sub.dir, sub.files, sub.deltas, sub.counts, sub.starts, sub.ends,
+                        kShardCacheBytes, {}, {}, {}, 0};
+  ServeContext ctx{shards, sources, sub.files.empty() ? nullptr : &sub_shards, {}, {}};
+  if (ctx.sub) cerr << "[INFO] Minimal absent over " << sub.files.size() << " shard(s) of " << sub.dir << "\n";
+
+  // A fixed pool of --threads workers, each accepting and serving one connection at a time; a
+  // peer that stalls mid-request is dropped after the receive timeout.
+  vector<thread> pool;
+  for (int t = 0; t < threads; ++t) {
+    pool.emplace_back([&]() {
+      while (true) {
+        int fd = ::accept(lfd, nullptr, nullptr);
+        if (fd < 0) continue;
+        timeval tv{60, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char magic[4];
+        uint32_t shardIdx = 0;
+        uint8_t hdr5[5];
+        // k0 must be this worker's shard k; kout follows the coordinator's rule (k0, or an
+        // expansion of an 18-mer base).
+        const bool ok = recv_all(fd, magic, 4) && memcmp(magic, "SQB1", 4) == 0 &&
+                        recv_all(fd, &shardIdx, 4) && recv_all(fd, hdr5, 5) &&
+                        shardIdx < files.size() && hdr5[0] == k &&
+                        (hdr5[1] == k || (k == 18 && hdr5[1] > k && hdr5[1] <= 64));
+        vector<uint8_t> resp;
+        if (!ok) resp.push_back(1);
+        else if (hdr5[1] > 32) serve_one_refill<u128>(fd, shardIdx, hdr5, ctx, resp);
+        else serve_one_refill<uint64_t>(fd, shardIdx, hdr5, ctx, resp);
+        (void)send_all(fd, resp.data(), resp.size());
+        ::close(fd);
+      }
+    });
+  }
+  for (auto& th : pool) th.join();
+  return 0;
+}
+
+// ---------------- Stream ----------------
+// Everything main() resolves before scanning; run_stream() is instantiated per value width.
+struct StreamSetup {
+  unsigned numShards=0;
+  vector<string> shardFiles;
+  vector<vector<string>> shardDeltas;
+  vector<string> shardCounts;
+  vector<string> shardNodes;
+  string mmerIndex;
+  vector<uint64_t> shard_starts, shard_ends;
+  int k0=0, kout=0;
+  bool source_filter=false, count_filter=false;
+  double hist_sec=0.0;
+  SubShardSet sub;  // --minimal-absent
+  uint64_t scan_lo=0, scan_hi=UINT64_MAX;  // --start-after / --range
+};
+
+// Appends every placement of `sub` (IUPAC codes allowed) in a k-mer to `set`. Codes fixing one bit
+// of the 2-bit digit (R/Y the low bit, M/K the high bit, N none) stay mask/bits patterns; S, W and
+// the three-base codes need per-digit masks.
+template <class V>
+static bool compile_placements(const string& sub, int k, const char* what, PatternSet<V>& set) {
+  const int m = (int)sub.size();
+  if (m == 0) return true;
+  if (m > k) { cerr << what << " longer than output k\n"; return false; }
+
+  V sub_bits=0, sub_mask=0;
+  V sub_bad[4] = {0, 0, 0, 0};  // low bit per 2-bit group
+  bool by_mask = true;
+  for (char c : sub) {
+    const int digits = iupac_digits(c);
+    if (digits == 0) { cerr << "Invalid base in " << what << " " << sub << "\n"; return false; }
+    int mask = 0, bits = 0;
+    switch (digits) {
+      case 1: case 2: case 4: case 8: mask = 3; bits = __builtin_ctz(digits); break;
+      case 1|4: mask = 1; bits = 0; break;  // R
+      case 2|8: mask = 1; bits = 1; break;  // Y
+      case 1|2: mask = 2; bits = 0; break;  // M
+      case 4|8: mask = 2; bits = 2; break;  // K
+      case 15: break;                       // N
+      default: by_mask = false;
+    }
+    sub_bits = (sub_bits << 2) | (V)bits;
+    sub_mask = (sub_mask << 2) | (V)mask;
+    for (int x = 0; x < 4; ++x) sub_bad[x] = (sub_bad[x] << 2) | (V)(digits >> x & 1 ? 0 : 1);
   }
 
-  if (shard_starts.size() != numShards || shard_ends.size() != numShards) {
-    uint64_t total_bits = total_bits_index ? total_bits_index : (1ULL << (2 * k0));
-    const uint64_t width = (total_bits + (uint64_t)numShards - 1) / (uint64_t)numShards;
-    shard_starts.assign(numShards, 0);
-    shard_ends.assign(numShards, 0);
-    for (unsigned i=0;i<numShards;i++) {
-      uint64_t start = (uint64_t)i * width;
-      uint64_t end = min<uint64_t>(total_bits, start + width);
-      shard_starts[i] = start;
-      shard_ends[i] = end;
+  for (int pos=0; pos<=k-m; ++pos) {
+    int shift = 2 * (k - m - pos);
+    if (by_mask) {
+      set.masks.push_back({ sub_mask << shift, sub_bits << shift });
+    } else {
+      set.iupac.push_back({{sub_bad[0] << shift, sub_bad[1] << shift, sub_bad[2] << shift, sub_bad[3] << shift}});
     }
   }
+  return true;
+}
 
-  // substring patterns for kout
-  vector<Pattern> patterns;
+// --forbid prefilter table over the first w bases of each pattern (w = the shortest pattern, at
+// most 8: 4^8 bits), with IUPAC codes expanded. Left off if a prefix expands to over 4096 w-mers.
+template <class V>
+static void build_forbid_table(const vector<string>& pats, LeafChecks<V>& leaf) {
+  int w = 8;
+  for (const auto& p : pats) w = min(w, (int)p.size());
+  if (pats.empty() || w < 1) return;
+  vector<uint64_t> table((size_t)1 << max(0, 2 * w - 6), 0);
+  for (const auto& p : pats) {
+    size_t total = 1;
+    for (int i = 0; i < w; ++i) total *= (size_t)__builtin_popcount(iupac_digits(p[i]));
+    if (total > 4096) return;
+    vector<uint64_t> xs(1, 0), next;
+    for (int i = 0; i < w; ++i) {
+      const int digits = iupac_digits(p[i]);
+      next.clear();
+      for (uint64_t x : xs) for (int d = 0; d < 4; ++d) if (digits >> d & 1) next.push_back((x << 2) | (uint64_t)d);
+      xs.swap(next);
+    }
+    for (uint64_t x : xs) table[x >> 6] |= 1ULL << (x & 63);
+  }
+  leaf.forbid_w = w;
+  leaf.forbid_table = move(table);
+}
 
-  auto append_patterns_for = [&](const string& sub) -> bool {
-    const int m = (int)sub.size();
-    if (m == 0) return true;
-    if (m > kout) { cerr << "substring longer than output k\n"; return false; }
+// "a-b" / "a-" / "-b" / "a" -> [lo, hi] (missing ends keep their defaults).
+static bool parse_range(const string& s, int& lo, int& hi) {
+  try {
+    const size_t dash = s.find('-');
+    if (dash == string::npos) { lo = hi = stoi(s); return true; }
+    if (dash > 0) lo = stoi(s.substr(0, dash));
+    if (dash + 1 < s.size()) hi = stoi(s.substr(dash + 1));
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
 
-    uint64_t sub_bits=0;
-    for (char c : sub) {
-      int dd = base4_digit(c);
-      if (dd < 0) { cerr << "Invalid base in substring\n"; return false; }
-      sub_bits = (sub_bits<<2) | (uint64_t)dd;
+// Compiles --position-class (P:C or P1-P2:C, 1-based from the 5' end, C an IUPAC code) and
+// --base-count (C:lo-hi with C an IUPAC code, or * for each base) for k-mers of length k.
+template <class V>
+static bool compile_base_constraints(const string& pos_spec, const string& count_spec, int k, LeafChecks<V>& leaf) {
+  vector<string> items;
+  split_csv(pos_spec, items);
+  for (const auto& it : items) {
+    const size_t colon = it.find(':');
+    int p1 = 0, p2 = 0;
+    const int set = (colon != string::npos && colon + 2 == it.size()) ? iupac_digits(it[colon + 1]) : 0;
+    if (!set || !parse_range(it.substr(0, colon), p1, p2) || p1 < 1 || p2 < p1 || p2 > k) {
+      cerr << "Invalid --position-class item '" << it << "' (P:C or P1-P2:C, positions 1.." << k << ")\n";
+      return false;
+    }
+    for (int p = p1; p <= p2; ++p) {
+      for (int x = 0; x < 4; ++x) if (!(set >> x & 1)) leaf.pos_bad[x] |= (V)1 << (2 * (k - p));
+    }
+  }
+  items.clear();
+  split_csv(count_spec, items);
+  for (const auto& it : items) {
+    const size_t colon = it.find(':');
+    int lo = 0, hi = k;
+    const int set = (colon == 1) ? (it[0] == '*' ? -1 : iupac_digits(it[0])) : 0;
+    if (!set || !parse_range(it.substr(colon + 1), lo, hi) || lo < 0 || hi < lo) {
+      cerr << "Invalid --base-count item '" << it << "' (C:lo-hi, C an IUPAC code or *)\n";
+      return false;
+    }
+    const uint8_t l = (uint8_t)min(lo, k), h = (uint8_t)min(hi, k);
+    if (set < 0) {
+      for (int x = 0; x < 4; ++x) leaf.counts.push_back({(uint8_t)(1 << x), l, h});
+    } else {
+      leaf.counts.push_back({(uint8_t)set, l, h});
     }
+  }
+  return true;
+}
 
-    uint64_t base_mask = (m >= 32) ? ~0ULL : ((1ULL << (2*m)) - 1ULL);
-    for (int pos=0; pos<=kout-m; ++pos) {
-      int shift = 2 * (kout - m - pos);
-      patterns.push_back({ base_mask << shift, sub_bits << shift });
+// --range / --start-after: a prefix of at most k bases, padded to k with digit `pad` (0 = A, 3 = T).
+static bool parse_kmer_prefix(const string& s, int k, uint64_t pad, uint64_t& out) {
+  if (s.empty() || (int)s.size() > k) return false;
+  out = 0;
+  for (char c : s) {
+    const int dd = base4_digit(c);
+    if (dd < 0) return false;
+    out = (out << 2) | (uint64_t)dd;
+  }
+  for (int i = (int)s.size(); i < k; ++i) out = (out << 2) | pad;
+  return true;
+}
+
+// --exclude-near: one barcode per line (first field; blank lines and lines starting with '#' or '>'
+// are skipped), each exactly k bases of A/C/G/T.
+template <class V>
+static bool read_barcode_list(const string& path, int k, vector<V>& out) {
+  ifstream in(path);
+  if (!in) { cerr << "Error: cannot read " << path << "\n"; return false; }
+  string line;
+  for (size_t ln = 1; getline(in, line); ++ln) {
+    const size_t b = line.find_first_not_of(" \t\r");
+    if (b == string::npos || line[b] == '#' || line[b] == '>') continue;
+    const size_t e = line.find_first_of(" \t\r,;", b);
+    const string bc = line.substr(b, e == string::npos ? string::npos : e - b);
+    bool ok = (int)bc.size() == k;
+    V v = 0;
+    for (char c : bc) {
+      const int dd = base4_digit(c);
+      if (dd < 0) ok = false;
+      v = (v << 2) | (V)(dd & 3);
     }
-    return true;
-  };
+    if (!ok) {
+      cerr << "Error: " << path << " line " << ln << ": expected a " << k << "-base A/C/G/T barcode\n";
+      return false;
+    }
+    out.push_back(v);
+  }
+  sort(out.begin(), out.end());
+  out.erase(unique(out.begin(), out.end()), out.end());
+  return true;
+}
 
-  if (args.substring_set) {
-    patterns.reserve((size_t)(2 * (kout - (int)args.substring.size() + 1)));
+template <class V>
+static int run_stream(const Args& args, const StreamSetup& setup) {
+  const unsigned numShards = setup.numShards;
+  const auto& shardFiles = setup.shardFiles;
+  const auto& shardDeltas = setup.shardDeltas;
+  const auto& shardCounts = setup.shardCounts;
+  const auto& shardNodes = setup.shardNodes;
+  const auto& mmerIndex = setup.mmerIndex;
+  const auto& shard_starts = setup.shard_starts;
+  const auto& shard_ends = setup.shard_ends;
+  const int k0 = setup.k0, kout = setup.kout;
+  const bool source_filter = setup.source_filter, count_filter = setup.count_filter;
+  const double hist_sec = setup.hist_sec;
+
+  // substring patterns for kout (placements needing per-digit masks go to leaf.sub_iupac)
+  vector<PatternT<V>> patterns;
+  PatternSet<V> sub_set;
 
-    if (!append_patterns_for(args.substring)) return 1;
+  if (args.substring_set) {
+    if (!compile_placements(args.substring, kout, "substring", sub_set)) return 1;
 
     if (args.reverse_complement) {
       string rc = revcomp_string(args.substring);
       // If substring is palindromic (rc == substring), avoid duplicating the same patterns.
       if (rc != args.substring) {
-        if (!append_patterns_for(rc)) return 1;
+        if (!compile_placements(rc, kout, "substring", sub_set)) return 1;
       }
     }
   }
 
+  // Adapter mask set: every (stem+1)-base window of each adapter's reverse complement, at every
+  // position of the output k-mer. A k-mer matching one pairs with the adapter over a longer stem.
+  LeafChecks<V> leaf;
+  static_cast<LeafLimits&>(leaf) = args.leaf;
+  patterns = move(sub_set.masks);
+  leaf.sub_iupac = move(sub_set.iupac);
+  for (const auto& group : args.require) {
+    leaf.require.emplace_back();
+    for (const auto& pat : group) if (!compile_placements(pat, kout, "--require pattern", leaf.require.back())) return 1;
+  }
+  for (const auto& pat : args.forbid) {
+    if (pat.find_first_not_of("Nn") == string::npos) { cerr << "--forbid pattern " << pat << " matches everything\n"; return 1; }
+    if (!compile_placements(pat, kout, "--forbid pattern", leaf.forbid)) return 1;
+  }
+  build_forbid_table(args.forbid, leaf);
+  if (!args.avoid_rc_with.empty()) {
+    const int n = args.max_adapter_stem + 1;
+    vector<V> windows;
+    for (const auto& adapter : args.avoid_rc_with) {
+      const string rc = revcomp_string(adapter);
+      for (int i = 0; i + n <= (int)rc.size() && n <= kout; ++i) {
+        V w = 0;
+        for (int j = 0; j < n; ++j) {
+          const int dd = base4_digit(rc[i + j]);
+          if (dd < 0) { cerr << "Invalid base in adapter " << adapter << "\n"; return 1; }
+          w = (w << 2) | (V)dd;
+        }
+        windows.push_back(w);
+      }
+    }
+    sort(windows.begin(), windows.end());
+    windows.erase(unique(windows.begin(), windows.end()), windows.end());
+    const V wmask = (2 * n >= (int)(8 * sizeof(V))) ? ~(V)0 : (((V)1 << (2 * n)) - 1);
+    for (V w : windows) {
+      for (int pos = 0; pos <= kout - n; ++pos) leaf.avoid.push_back({wmask << (2 * pos), w << (2 * pos)});
+    }
+  }
+
+  if (!compile_base_constraints(args.position_class, args.base_count, kout, leaf)) return 1;
+  if (!args.exclude_near.empty()) {
+    vector<V> near;
+    if (!read_barcode_list(args.exclude_near, kout, near)) return 1;
+    leaf.exclude = make_shared<const NearList<V>>(kout, args.exclude_d, move(near));
+  }
+  leaf.scan_lo = setup.scan_lo;
+  leaf.scan_hi = setup.scan_hi;
+  const bool by_range = setup.scan_lo != 0 || setup.scan_hi != UINT64_MAX;
+
+  // Candidate chunks from the m-mer index (konly substring queries over the plain absent set).
+  vector<uint64_t> cand_chunks;
+  int chunk_bits = 0;
+  bool use_chunks = false;
+  if (args.substring_set && kout == k0 && !source_filter && !count_filter && !mmerIndex.empty()) {
+    vector<string> subs{args.substring};
+    if (args.reverse_complement && revcomp_string(args.substring) != args.substring) {
+      subs.push_back(revcomp_string(args.substring));
+    }
+    use_chunks = load_mmer_candidates(args.shardsDir + "/" + mmerIndex, k0, subs, cand_chunks, chunk_bits);
+    if (!use_chunks) cerr << "[WARN] m-mer index unusable, scanning every chunk\n";
+  }
+  // Candidate chunk ids inside one shard's range.
+  auto shard_chunk_range = [&](unsigned s) {
+    auto lo = lower_bound(cand_chunks.begin(), cand_chunks.end(), shard_starts[s] >> chunk_bits);
+    auto hi = lower_bound(cand_chunks.begin(), cand_chunks.end(), ((shard_ends[s] - 1) >> chunk_bits) + 1);
+    return make_pair(lo, hi);
+  };
+  atomic<uint64_t> shards_skipped(0), range_skipped(0);
+
   // permutation seed
   uint64_t seed = 0;
   if (args.random_access) {
@@ -943,6 +3047,7 @@ int main(int argc, char** argv) {
   // Cursor init
   uint32_t next_perm_pos = 0;
   vector<WindowCursor::LaneState> lane_states;
+  vector<u128> cursor_selected;
 
   if (args.cursor_set) {
     WindowCursor in;
@@ -967,6 +3072,14 @@ int main(int argc, char** argv) {
 
     next_perm_pos = in.next_perm_pos;
     lane_states = in.lanes;
+    const bool in_edit = in.sel_d && in.sel_metric == 'E';
+    if (in.sel_d != (uint8_t)max({0, args.min_hamming, args.min_edit}) || in_edit != (args.min_edit > 0) ||
+        in.set_size != args.set_size || in.balance_channels != args.color_balance ||
+        (args.color_balance && in.balance_share != (uint16_t)lround(args.min_channel_share * 1000))) {
+      cerr << "Error: cursor set selection mismatch\n";
+      return 1;
+    }
+    cursor_selected = move(in.selected);
   } else {
     next_perm_pos = 0;
     lane_states.resize(args.window);
@@ -974,7 +3087,43 @@ int main(int argc, char** argv) {
   }
 
   // Runtime lanes
-  vector<LaneRuntime> lanes(args.window);
+  vector<LaneRuntime<V>> lanes(args.window);
+
+  LaneFilter filter;
+  filter.absent_in = args.absent_in;
+  filter.present_in = args.present_in;
+  filter.min_count = args.min_count;
+  filter.max_count = args.max_count;
+
+  // Other shards' bitmaps for --both-strands-absent and --robust, kept within the cache's byte cap.
+  ShardCache strand_cache{args.shardsDir, shardFiles, shardDeltas, shardCounts, shard_starts, shard_ends,
+                          kShardCacheBytes, {}, {}, {}, 0};
+  atomic<bool> strand_failed(false), robust_failed(false);
+  ShardLookup strands{strand_cache, filter, strand_failed};
+  ShardLookup robust{strand_cache, filter, robust_failed};
+
+  // The (k0-1)-mer set for --minimal-absent, cached the same way.
+  const SubShardSet& sub = setup.sub;
+  ShardCache sub_cache{sub.dir, sub.files, sub.deltas, sub.counts, sub.starts, sub.ends,
+                       kShardCacheBytes, {}, {}, {}, 0};
+  atomic<bool> sub_failed(false);
+  ShardLookup minimal{sub_cache, filter, sub_failed};
+  const bool by_minimal = !args.minimal_absent.empty();
+
+  // Attaches the lane to its shard: local shards load their bitmap, remote ones only record the node.
+  auto attach_lane = [&](int i, unsigned shardIdx)->bool {
+    lanes[i].node = shardNodes[shardIdx];
+    if (!lanes[i].node.empty()) { lanes[i].bm = nullptr; return true; }
+    KbitHeader hdr;
+    roaring64_bitmap_t* bm = load_lane_bitmap(args.shardsDir, shardFiles[shardIdx], shardDeltas[shardIdx],
+                                              shardCounts[shardIdx], filter,
+                                              shard_starts[shardIdx], shard_ends[shardIdx], hdr);
+    if (!bm) return false;
+    g_access_counts.bump(shardIdx);
+    lanes[i].bm = bm;
+    lanes[i].hdr = hdr;
+    return true;
+  };
 
   auto load_lane_from_state = [&](int i, const WindowCursor::LaneState& st)->bool {
     lanes[i].free_all();
@@ -988,12 +3137,7 @@ int main(int argc, char** argv) {
     lanes[i].shardIdx = shardIdx;
     lanes[i].shardPath = args.shardsDir + "/" + shardFiles[shardIdx];
 
-    KbitHeader hdr;
-    roaring64_bitmap_t* bm = load_kbit_portable(lanes[i].shardPath, hdr);
-    if (!bm) return false;
-
-    lanes[i].bm = bm;
-    lanes[i].hdr = hdr;
+    if (!attach_lane(i, shardIdx)) return false;
     lanes[i].active = true;
 
     lanes[i].clear_buf();
@@ -1017,23 +3161,34 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Lanes are refilled from the worker pool below; the next shard is claimed under a lock.
+  mutex perm_mu;
   auto try_fill_empty_lane = [&](int i)->bool {
     if (lanes[i].active) return true;
 
-    while (next_perm_pos < numShards) {
-      uint32_t ppos = next_perm_pos++;
+    while (true) {
+      uint32_t ppos;
+      {
+        lock_guard<mutex> lk(perm_mu);
+        if (next_perm_pos >= numShards) break;
+        ppos = next_perm_pos++;
+      }
       unsigned shardIdx = shard_from_permpos(ppos);
+      if (by_range && (setup.scan_lo > setup.scan_hi || shard_ends[shardIdx] <= setup.scan_lo ||
+                       shard_starts[shardIdx] > setup.scan_hi)) {
+        range_skipped++;
+        continue;
+      }
+      if (use_chunks && shard_starts[shardIdx] < shard_ends[shardIdx]) {
+        auto r = shard_chunk_range(shardIdx);
+        if (r.first == r.second) { shards_skipped++; continue; }
+      }
 
       lanes[i].perm_pos = ppos;
       lanes[i].shardIdx = shardIdx;
       lanes[i].shardPath = args.shardsDir + "/" + shardFiles[shardIdx];
 
-      KbitHeader hdr;
-      roaring64_bitmap_t* bm = load_kbit_portable(lanes[i].shardPath, hdr);
-      if (!bm) return false;
-
-      lanes[i].bm = bm;
-      lanes[i].hdr = hdr;
+      if (!attach_lane(i, shardIdx)) return false;
       lanes[i].clear_buf();
       lanes[i].active = true;
 
@@ -1052,23 +3207,49 @@ int main(int argc, char** argv) {
   // Fill any empty lanes initially
   for (int i=0;i<(int)args.window;i++) if (!lanes[i].active) (void)try_fill_empty_lane(i);
 
-  const uint64_t need = args.limit + 1;
-  vector<uint64_t> out_vals;
+  // Set selection: values from earlier pages are re-indexed, so the page only adds new ones.
+  const bool by_edit = args.min_edit > 0;
+  const bool selecting = args.min_hamming > 0 || by_edit;
+  const int sel_d = max(args.min_hamming, args.min_edit);
+  HammingSelector<V> ham(kout, by_edit ? 1 : max(1, sel_d));
+  EditSelector<V> edit(kout, by_edit ? sel_d : 1);
+  const bool balancing = args.color_balance > 0;
+  ColorBalancer<V> bal(kout, balancing ? args.color_balance : 4, args.set_size, args.min_channel_share);
+  for (u128 x : cursor_selected) {
+    if (by_edit) edit.add((V)x); else if (selecting) ham.add((V)x);
+    if (balancing) bal.add((V)x);
+  }
+  const vector<V>& selected = by_edit ? edit.accepted : selecting ? ham.accepted : bal.accepted;
+  vector<uint8_t> balance_refill(args.window, 0);
+  const uint64_t set_left = args.set_size ? args.set_size - min<uint64_t>(args.set_size, selected.size())
+                                          : UINT64_MAX;
+  const uint64_t need = min<uint64_t>(args.limit, set_left);
+  vector<V> out_vals;
   out_vals.reserve((size_t)need);
+  // hasMore is decided by peeking: once the page is full, lanes keep refilling (without
+  // emitting) until one of them buffers a value or every lane runs dry.
+  bool hasMore = false;
 
   double scan_sec_total=0.0;
   uint64_t shards_loaded=0;
-  for (auto& ln : lanes) if (ln.bm) shards_loaded++;
+  for (auto& ln : lanes) if (ln.active) shards_loaded++;
+  atomic<bool> remote_error(false);
 
   auto t_scan0 = Clock::now();
 
-  while (out_vals.size() < need) {
+  while (true) {
     bool any_active=false;
     for (auto& ln : lanes) if (ln.active) { any_active=true; break; }
     if (!any_active) break;
 
     // Parallel refill of empty buffers
     {
+      // Lanes given up by colour balance refill under its current full bases.
+      LeafChecks<V> balance_leaf;
+      if (find(balance_refill.begin(), balance_refill.end(), 1) != balance_refill.end()) {
+        balance_leaf = leaf;
+        bal.add_position_masks(balance_leaf.pos_bad);
+      }
       atomic<int> idx(0);
       int T = min(args.threads, (int)args.window);
       vector<thread> pool;
@@ -1080,35 +3261,104 @@ int main(int argc, char** argv) {
             int i = idx.fetch_add(1);
             if (i >= (int)args.window) break;
             if (!lanes[i].active) continue;
-            if (lanes[i].buf_pos < lanes[i].buf.size()) continue;
-
-            refill_lane(lanes[i], k0, kout, args.gcMinPct, args.gcMaxPct,
-                        args.substring_set, patterns, args.refill_chunk,
-                        shard_starts, shard_ends);
+            if (!lanes[i].drained()) continue;
+            const LeafChecks<V>& lim = balance_refill[i] ? balance_leaf : leaf;
+            balance_refill[i] = 0;
+
+            if (!lanes[i].exhausted && !lanes[i].node.empty()) {
+              vector<uint64_t> shard_chunks;
+              if (use_chunks) {
+                auto r = shard_chunk_range(lanes[i].shardIdx);
+                shard_chunks.assign(r.first, r.second);
+              }
+              if (!refill_lane_remote(lanes[i], k0, kout, args.gcMinPct, args.gcMaxPct,
+                                      args.substring_set, patterns, lim, args.refill_chunk, filter,
+                                      shard_chunks, use_chunks ? chunk_bits : 0, args.both_strands_absent,
+                                      by_minimal, args.robust_d)) {
+                remote_error = true;
+                lanes[i].free_all();
+                continue;
+              }
+            } else if (!lanes[i].exhausted) {
+              refill_lane(lanes[i], k0, kout, args.gcMinPct, args.gcMaxPct,
+                          args.substring_set, patterns, lim, args.refill_chunk,
+                          shard_starts, shard_ends, use_chunks ? &cand_chunks : nullptr, chunk_bits,
+                          args.both_strands_absent ? &strands : nullptr, by_minimal ? &minimal : nullptr,
+                          args.robust_d ? &robust : nullptr, args.robust_d);
+            }
 
-            if (!lanes[i].active) {
+            // Hand the lane to the next shard only once its last buffer has been emitted.
+            if (lanes[i].done()) {
               lanes[i].free_all();
               (void)try_fill_empty_lane(i);
-              if (lanes[i].bm) shards_loaded++;
+              if (lanes[i].active) shards_loaded++;
             }
           }
         });
       }
       for (auto& th : pool) th.join();
     }
+    if (remote_error) {
+      for (auto& ln : lanes) ln.free_all();
+      return 1;
+    }
+    if (strand_failed) {
+      cerr << "Error: cannot load a shard for --both-strands-absent\n";
+      for (auto& ln : lanes) ln.free_all();
+      return 1;
+    }
+    if (sub_failed) {
+      cerr << "Error: cannot load a shard of " << sub.dir << " for --minimal-absent\n";
+      for (auto& ln : lanes) ln.free_all();
+      return 1;
+    }
+    if (robust_failed) {
+      cerr << "Error: cannot load a shard for --robust\n";
+      for (auto& ln : lanes) ln.free_all();
+      return 1;
+    }
+
+    if (out_vals.size() >= need) {
+      if (out_vals.size() >= set_left) break;  // the selected set is complete
+      for (auto& ln : lanes) if (ln.active && !ln.drained()) { hasMore=true; break; }
+      if (hasMore) break;
+      continue;
+    }
 
     // Round-robin emission
     bool emitted_any=false;
+    int waiting=-1;  // the lane held back by --color-balance with the lowest offending base
+    V waiting_bad=0;
     for (int i=0;i<(int)args.window && out_vals.size() < need; ++i) {
       if (!lanes[i].active) continue;
 
       uint16_t took=0;
       while (took < args.burst && out_vals.size() < need) {
         if (lanes[i].buf_pos >= lanes[i].buf.size()) break;
-        uint64_t v = lanes[i].buf[lanes[i].buf_pos++];
-
-        if (kout == k0) lanes[i].after = v;
-        // expand mode state is already updated during refill (anchor/child state)
+        // A value that would leave a full base dark may fit once the set has grown: the lane waits
+        // with it unconsumed while the other lanes emit.
+        if (balancing) {
+          const V bad = bal.violations(lanes[i].buf[lanes[i].buf_pos]);
+          if (bad) {
+            if (waiting < 0 || top_bit(bad) < top_bit(waiting_bad)) { waiting = i; waiting_bad = bad; }
+            break;
+          }
+        }
+        const size_t pos = lanes[i].buf_pos++;
+        V v = lanes[i].buf[pos];
+
+        if (kout == k0) {
+          lanes[i].after = v;
+        } else {
+          const auto& r = lanes[i].buf_resume[pos];
+          lanes[i].parent_anchor = r.parent_anchor;
+          lanes[i].child_present = r.child_present;
+          lanes[i].L = r.L;
+          lanes[i].left_idx = r.left_idx;
+          lanes[i].right_idx = r.right_idx;
+        }
+        if (selecting && !(by_edit ? edit.try_add(v) : ham.try_add(v))) continue;
+        if (balancing) bal.add(v);
 
         out_vals.push_back(v);
         took++;
@@ -1120,23 +3370,24 @@ int main(int argc, char** argv) {
       bool still=false;
       for (auto& ln : lanes) if (ln.active) { still=true; break; }
       if (!still) break;
+      // Every lane with values waits on colour balance, and the set cannot grow: the lane whose
+      // offending base is lowest drops its buffer and rescans from its resume point with the full
+      // bases as position classes, jumping past every prefix (or expansion layout) they rule out.
+      bool moving=false;
+      for (auto& ln : lanes) if (ln.active && ln.drained() && !ln.exhausted) { moving=true; break; }
+      if (waiting >= 0 && !moving) {
+        auto& ln = lanes[waiting];
+        bal.rejected += ln.buf.size() - ln.buf_pos;
+        ln.buf_pos = ln.buf.size();
+        ln.exhausted = false;
+        balance_refill[waiting] = 1;
+      }
     }
   }
 
   auto t_scan1 = Clock::now();
   scan_sec_total = chrono::duration_cast<Sec>(t_scan1 - t_scan0).count();
 
-  bool hasMore = false;
-  if (out_vals.size() > args.limit) { out_vals.resize((size_t)args.limit); hasMore=true; }
-  else {
-    for (auto& ln : lanes) {
-      if (!ln.active) continue;
-      if (ln.buf_pos < ln.buf.size()) { hasMore=true; break; }
-      if (kout > k0) { hasMore=true; break; }
-    }
-    if (!hasMore && next_perm_pos < numShards) hasMore=true;
-  }
-
   // Build next cursor
   string cursorStr;
   if (hasMore) {
@@ -1149,10 +3400,20 @@ int main(int argc, char** argv) {
     outc.window=args.window;
     outc.burst=args.burst;
     outc.lanes.resize(args.window);
+    if (selecting || balancing) {
+      outc.sel_metric = !selecting ? 'B' : by_edit ? 'E' : 'H';
+      outc.sel_d = (uint8_t)(selecting ? sel_d : 0);
+      outc.set_size = args.set_size;
+      outc.selected.assign(selected.begin(), selected.end());
+    }
+    if (balancing) {
+      outc.balance_channels = (uint8_t)args.color_balance;
+      outc.balance_share = (uint16_t)lround(args.min_channel_share * 1000);
+    }
 
     for (int i=0;i<(int)args.window;i++) {
       auto& st = outc.lanes[i];
-      if (!lanes[i].active) { st.active=false; continue; }
+      if (lanes[i].done()) { st.active=false; continue; }
       st.active=true;
       st.perm_pos=lanes[i].perm_pos;
       if (kout == k0) {
@@ -1175,7 +3436,7 @@ int main(int argc, char** argv) {
 
   // Emit
   cout << "__META__\t" << cursorStr << "\t" << (hasMore ? "1" : "0") << "\t" << out_vals.size() << "\t" << kout << "\n";
-  for (uint64_t v : out_vals) cout << decode_kmer(v, kout) << "\n";
+  for (const V& v : out_vals) cout << decode_kmer(v, kout) << "\n";
 
   // Cleanup
   for (auto& ln : lanes) ln.free_all();
@@ -1194,13 +3455,269 @@ int main(int argc, char** argv) {
   cerr << "[INFO] GC% range           : " << args.gcMinPct << "-" << args.gcMaxPct << "\n";
   cerr << "[INFO] Substring           : " << (args.substring_set ? args.substring : "(none)") << "\n";
   cerr << "[INFO] Reverse complement  : " << (args.reverse_complement ? "yes" : "no") << "\n";
+  if (!args.require.empty()) {
+    cerr << "[INFO] Require             : ";
+    for (size_t g = 0; g < args.require.size(); ++g) cerr << (g ? "; " : "") << join_csv(args.require[g]);
+    cerr << "\n";
+  }
+  if (!args.forbid.empty()) {
+    cerr << "[INFO] Forbid              : " << args.forbid.size() << " pattern(s)";
+    if (leaf.forbid_w) cerr << ", " << leaf.forbid_w << "-mer lookup table";
+    cerr << "\n";
+  }
+  if (args.leaf.max_homopolymer >= 0) cerr << "[INFO] Max homopolymer     : " << args.leaf.max_homopolymer << "\n";
+  if (args.leaf.max_dinuc_repeat >= 0) cerr << "[INFO] Max dinuc repeat    : " << args.leaf.max_dinuc_repeat << "\n";
+  if (args.leaf.max_self_rc_stem >= 0) cerr << "[INFO] Max self-RC stem    : " << args.leaf.max_self_rc_stem << "\n";
+  if (!args.position_class.empty()) cerr << "[INFO] Position classes    : " << args.position_class << "\n";
+  if (!args.base_count.empty()) cerr << "[INFO] Base counts         : " << args.base_count << "\n";
+  if (args.leaf.by_tm()) {
+    cerr << "[INFO] Tm window (NN)      : " << defaultfloat << args.leaf.tm_min << " - " << args.leaf.tm_max
+         << " C (" << args.leaf.na_mm << " mM Na+, " << args.leaf.oligo_nm << " nM oligo)\n" << fixed;
+  }
+  if (args.both_strands_absent) {
+    cerr << "[INFO] Both strands absent : yes (" << strand_cache.cache.size() << " shard bitmap(s) cached)\n";
+  }
+  if (by_minimal) {
+    cerr << "[INFO] Minimal absent      : k=" << sub.k << " set " << sub.dir << " (" << sub_cache.cache.size()
+         << " shard bitmap(s) cached)\n";
+  }
+  if (args.robust_d) {
+    cerr << "[INFO] Robust absence      : d=" << args.robust_d << " (" << strand_cache.cache.size()
+         << " shard bitmap(s) cached)\n";
+  }
+  if (by_range) {
+    cerr << "[INFO] Scan range          : " << decode_kmer(setup.scan_lo, k0) << " - "
+         << decode_kmer(setup.scan_hi, k0) << " (" << range_skipped.load() << " shard(s) outside)\n";
+  }
+  if (leaf.exclude) {
+    cerr << "[INFO] Exclude near        : " << leaf.exclude->values.size() << " barcode(s) of " << args.exclude_near
+         << " (>= " << args.exclude_d << " mismatches)\n";
+  }
+  if (!args.avoid_rc_with.empty()) {
+    cerr << "[INFO] Avoid RC with       : " << join_csv(args.avoid_rc_with) << " (stem <= " << args.max_adapter_stem << ")\n";
+  }
+  if (count_filter) cerr << "[INFO] Count range         : " << max(0, args.min_count) << "-"
+                         << (args.max_count < 0 ? string("inf") : to_string(args.max_count)) << "\n";
+  if (source_filter) {
+    cerr << "[INFO] Absent in           : " << args.absent_in.size() << " source(s)\n";
+    cerr << "[INFO] Present in          : " << args.present_in.size() << " source(s)\n";
+  }
+  if (selecting) {
+    cerr << (by_edit ? "[INFO] Min edit distance   : " : "[INFO] Min Hamming         : ") << sel_d
+         << " (" << selected.size() << " selected";
+    if (args.set_size) cerr << " of " << args.set_size;
+    cerr << ", " << (by_edit ? edit.rejected : ham.rejected) << " rejected this page)\n";
+  }
+  if (balancing) {
+    cerr << "[INFO] Colour balance      : " << (args.color_balance == 4 ? "four-colour" : "two-channel")
+         << ", each channel lit by >= " << bal.need
+         << " of " << args.set_size << " per position (" << bal.accepted.size() << " selected, "
+         << bal.rejected << " rejected this page)\n";
+  }
   cerr << "[INFO] Returned            : " << out_vals.size() << "\n";
   cerr << "[INFO] Has more            : " << (hasMore ? "yes" : "no") << "\n";
   cerr << "[INFO] Next cursor         : " << (cursorStr.empty() ? "(none)" : cursorStr) << "\n";
   cerr << "[INFO] Shards loaded        : " << shards_loaded << "\n";
-  cerr << "[INFO] GC hist load time    : " << chrono::duration_cast<Sec>(t_hist1 - t_hist0).count() << " s\n";
+  if (use_chunks) {
+    cerr << "[INFO] m-mer index          : " << cand_chunks.size() << " candidate chunks of 2^" << chunk_bits
+         << ", " << shards_skipped.load() << " shards skipped\n";
+  }
+  cerr << "[INFO] GC hist load time    : " << hist_sec << " s\n";
   cerr << "[INFO] Scan time            : " << scan_sec_total << " s\n";
   cerr << "[INFO] Peak RSS             : " << pk << " KB (" << (pk/1024.0) << " MB)\n";
 
   return 0;
 }
+
+int main(int argc, char** argv) {
+  ios::sync_with_stdio(false);
+  cin.tie(nullptr);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+
+  // Any shard set k0 <= 31 is scanned as-is; construct_k != k0 (expansion) needs k0 == 18.
+  const int requested_kout = (args.construct_k > 0) ? args.construct_k : -1;
+
+  unsigned numShards=0;
+  vector<string> shardFiles;
+  vector<vector<string>> shardDeltas;
+  vector<string> shardCounts;
+  vector<string> shardNodes;
+  vector<string> sources;
+  string mmerIndex;
+  uint64_t k_from_index=0;
+  uint64_t total_bits_index=0;
+  vector<uint64_t> shard_starts;
+  vector<uint64_t> shard_ends;
+  if (!read_index(args.shardsDir, numShards, shardFiles, shardDeltas, shardCounts, shardNodes, sources, mmerIndex, k_from_index,
+                  total_bits_index, shard_starts, shard_ends)) {
+    cerr << "Failed to read " << args.shardsDir << "/index.json\n";
+    return 1;
+  }
+
+  const int k_index = (int)k_from_index;
+  if (k_index <= 0 || k_index > 31) {
+    cerr << "Error: invalid k in index.json: " << k_index << "\n";
+    return 1;
+  }
+
+  // Decide the effective base-k (k0) and output-k (kout).
+  int k0 = k_index;
+
+  default_shard_ranges(numShards, total_bits_index, k0, shard_starts, shard_ends);
+
+  SubShardSet sub;
+  if (!args.minimal_absent.empty()) {
+    if (!read_sub_shards(args.minimal_absent, sub)) {
+      cerr << "Failed to read " << args.minimal_absent << "/index.json\n";
+      return 1;
+    }
+    if (sub.k != k0 - 1) {
+      cerr << "Error: --minimal-absent needs a k=" << (k0 - 1) << " shard set, got k=" << sub.k << "\n";
+      return 1;
+    }
+    for (const auto& node : sub.nodes) {
+      if (!node.empty()) { cerr << "Error: --minimal-absent shards must be local\n"; return 1; }
+    }
+  }
+
+  g_access_counts.open(args.shardsDir, numShards);
+  if (!args.serve.empty()) {
+    return serve_refills(args.shardsDir, shardFiles, shardDeltas, shardCounts, sources,
+                         shard_starts, shard_ends, args.serve, sub, k0, args.threads);
+  }
+
+  int kout = (requested_kout > 0) ? requested_kout : k0;
+  if (kout < k0) {
+    cerr << "Error: construct_k=" << kout << " is below the shard k=" << k0 << "; use the k=" << kout << " shards\n";
+    return 1;
+  }
+  if (kout > 64) { cerr << "Error: construct_k>64 not supported (128-bit encoding)\n"; return 1; }
+  if (args.min_hamming > kout || args.min_edit > kout || args.exclude_d > kout) {
+    cerr << "Error: --min-hamming/--min-edit/--exclude-d must be between 1 and " << kout << "\n";
+    return 1;
+  }
+
+  // Enforce: only 18-mer base allows expansion; any other base k must be scanned at its own k.
+  // (The web server will route to shards_18 automatically for kout>18.)
+  if (kout != k0 && k0 != 18) {
+    cerr << "Error: expansion is only supported from k=18 base shards. "
+         << "Got base k=" << k0 << "; use construct_k=" << k0 << ".\n";
+    return 1;
+  }
+
+  const bool source_filter = !args.absent_in.empty() || !args.present_in.empty();
+  if (source_filter) {
+    if (kout != k0) {
+      cerr << "Error: --absent-in/--present-in are only supported with construct_k == " << k0 << "\n";
+      return 1;
+    }
+    for (const auto* names : {&args.absent_in, &args.present_in}) {
+      for (const auto& src : *names) {
+        if (find(sources.begin(), sources.end(), src) == sources.end()) {
+          cerr << "Error: unknown source '" << src << "' (not in index.json \"sources\")\n";
+          return 1;
+        }
+      }
+    }
+  }
+  const bool count_filter = args.min_count >= 0 || args.max_count >= 0;
+  if (count_filter) {
+    if (source_filter) {
+      cerr << "Error: --min-count/--max-count cannot be combined with --absent-in/--present-in\n";
+      return 1;
+    }
+    for (size_t i = 0; i < shardCounts.size(); ++i) {
+      if (shardCounts[i].empty() && shardNodes[i].empty()) {
+        cerr << "Error: --min-count/--max-count need a count layer (run count_kmer_shards)\n";
+        return 1;
+      }
+    }
+  }
+  if (args.robust_d && kout != k0) {
+    cerr << "Error: --robust is only supported with construct_k == " << k0 << "\n";
+    return 1;
+  }
+  uint64_t scan_lo = 0, scan_hi = UINT64_MAX;
+  if (!args.start_after.empty() || !args.range.empty()) {
+    if (kout != k0) {
+      cerr << "Error: --start-after / --range are only supported with construct_k == " << k0 << "\n";
+      return 1;
+    }
+    const uint64_t top = (k0 == 32) ? UINT64_MAX : (1ULL << (2 * k0)) - 1;
+    scan_hi = top;
+    if (!args.range.empty()) {
+      const size_t colon = args.range.find(':');
+      uint64_t lo = 0, hi = 0;
+      if (colon == string::npos || !parse_kmer_prefix(args.range.substr(0, colon), k0, 0, lo) ||
+          !parse_kmer_prefix(args.range.substr(colon + 1), k0, 3, hi) || lo > hi) {
+        cerr << "Error: --range takes LO:HI, two A/C/G/T prefixes of at most " << k0 << " bases with LO <= HI\n";
+        return 1;
+      }
+      scan_lo = lo;
+      scan_hi = hi;
+    }
+    if (!args.start_after.empty()) {
+      uint64_t after = 0;
+      if ((int)args.start_after.size() != k0 || !parse_kmer_prefix(args.start_after, k0, 0, after)) {
+        cerr << "Error: --start-after takes a " << k0 << "-base A/C/G/T k-mer\n";
+        return 1;
+      }
+      if (after == top) { scan_lo = 1; scan_hi = 0; }  // nothing after the last k-mer
+      else scan_lo = max(scan_lo, after + 1);
+    }
+  }
+  if (!args.minimal_absent.empty()) {
+    if (kout != k0) {
+      cerr << "Error: --minimal-absent is only supported with construct_k == " << k0 << "\n";
+      return 1;
+    }
+    for (const auto* names : {&args.absent_in, &args.present_in}) {
+      for (const auto& src : *names) {
+        if (find(sub.sources.begin(), sub.sources.end(), src) == sub.sources.end()) {
+          cerr << "Error: source '" << src << "' is not in " << args.minimal_absent << "/index.json\n";
+          return 1;
+        }
+      }
+    }
+    if (count_filter) {
+      for (const auto& c : sub.counts) {
+        if (c.empty()) { cerr << "Error: --minimal-absent shards need a count layer\n"; return 1; }
+      }
+    }
+  }
+  int k_from_hist=0;
+  vector<vector<uint64_t>> gc_hists;
+  auto t_hist0 = Clock::now();
+  if (!load_gc_hist(args.gcHistPath, k_from_hist, gc_hists)) {
+    cerr << "Failed to load gc histogram json: " << args.gcHistPath << "\n";
+    return 1;
+  }
+  auto t_hist1 = Clock::now();
+
+  if (k_from_hist != k0) {
+    cerr << "GC hist k (" << k_from_hist << ") != index k (" << k0 << ")\n";
+    return 1;
+  }
+
+  StreamSetup setup;
+  setup.numShards = numShards;
+  setup.shardFiles = move(shardFiles);
+  setup.shardDeltas = move(shardDeltas);
+  setup.shardCounts = move(shardCounts);
+  setup.shardNodes = move(shardNodes);
+  setup.mmerIndex = mmerIndex;
+  setup.shard_starts = move(shard_starts);
+  setup.shard_ends = move(shard_ends);
+  setup.k0 = k0;
+  setup.kout = kout;
+  setup.source_filter = source_filter;
+  setup.count_filter = count_filter;
+  setup.sub = move(sub);
+  setup.scan_lo = scan_lo;
+  setup.scan_hi = scan_hi;
+  setup.hist_sec = chrono::duration_cast<Sec>(t_hist1 - t_hist0).count();
+  // k-mers longer than 32 bases no longer fit 2 bits per base in a uint64_t.
+  return kout > 32 ? run_stream<u128>(args, setup) : run_stream<uint64_t>(args, setup);
+}
@@ -0,0 +1,329 @@
+// tier_shards.cpp
+// Move rarely queried shards to a compressed cold tier and promote hot ones back.
+//
+// The query tools bump a per-shard counter in <shards>/access_counts (one native u64 per shard,
+// mmap'd shared) every time they load a shard. This tool creates that file on its first run and
+// afterwards, for every base shard file listed in index.json:
+//   - a plain shard (KBIT flags=2) with fewer than --cold-below accesses is rewritten as flags=3:
+//     the portable roaring payload zstd-compressed in independent --frame-kb frames behind a
+//     frame index
+//       raw_len u64 | frame_raw u64 | nframes u64 | nframes x compressed size u64 | frames
+//     (header fields other than flags and payload_len are kept as they are);
+//   - a compressed shard with at least --hot-at accesses is rewritten back as flags=2.
+// Both query tools (and the shard maintenance tools) decompress flags=3 payloads transparently, so
+// index.json is not touched. Files are replaced with tmp + rename; a shard that changed while it
+// was being rewritten (e.g. by compact_shard_layers) is left alone. Shards that still have delta
+// layers are skipped until they are compacted. Counters are then decayed (>> --decay-shift) so the
+// tiers follow recent traffic.
+//
+// Only base shard files are tiered; delta, colour and count layers keep their format.
+//
+// Compile:
+//   g++ -O3 -march=native -std=c++17 -pthread tier_shards.cpp -lroaring -lzstd -o tier_shards
+//
+// Example (e.g. nightly from cron):
+//   ./tier_shards --shards shards_18 --cold-below 1 --hot-at 32 --threads 4 --nice 19
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <roaring/roaring64.h>
+#include <zstd.h>
+
+#include "kbit_io.h"
+
+using Clock = std::chrono::steady_clock;
+using Sec   = std::chrono::duration<double>;
+
+static inline long peak_rss_kb() { rusage r; getrusage(RUSAGE_SELF, &r); return r.ru_maxrss; }
+
+struct Args {
+  std::string shards;
+  uint64_t cold_below = 1;  // compress plain shards with fewer accesses than this
+  uint64_t hot_at = 16;     // decompress cold shards with at least this many accesses
+  int level = 12;           // zstd level
+  int frame_kb = 1024;      // raw payload bytes per zstd frame
+  int decay_shift = 1;      // counters >>= shift after a run (0 = keep)
+  int threads = 1;
+  int nice = 10;
+};
+
+static void usage(const char* prog) {
+  std::cerr << "Usage: " << prog
+            << " --shards <dir> [--cold-below N] [--hot-at N] [--level L] [--frame-kb KB]"
+            << " [--decay-shift S] [--threads N] [--nice N]\n";
+}
+
+static bool parse_args(int argc, char** argv, Args& a) {
+  for (int i = 1; i < argc; ++i) {
+    std::string s(argv[i]);
+    if (s == "--shards" && i + 1 < argc) a.shards = argv[++i];
+    else if (s == "--cold-below" && i + 1 < argc) a.cold_below = std::strtoull(argv[++i], nullptr, 10);
+    else if (s == "--hot-at" && i + 1 < argc) a.hot_at = std::strtoull(argv[++i], nullptr, 10);
+    else if (s == "--level" && i + 1 < argc) a.level = std::atoi(argv[++i]);
+    else if (s == "--frame-kb" && i + 1 < argc) a.frame_kb = std::max(1, std::atoi(argv[++i]));
+    else if (s == "--decay-shift" && i + 1 < argc) a.decay_shift = std::min(63, std::max(0, std::atoi(argv[++i])));
+    else if (s == "--threads" && i + 1 < argc) a.threads = std::max(1, std::atoi(argv[++i]));
+    else if (s == "--nice" && i + 1 < argc) a.nice = std::atoi(argv[++i]);
+    else { std::cerr << "Unknown/invalid arg: " << s << "\n"; return false; }
+  }
+  if (a.shards.empty()) {
+    std::cerr << "Error: --shards is required\n";
+    return false;
+  }
+  if (a.hot_at < a.cold_below) {
+    std::cerr << "Error: --hot-at must be >= --cold-below\n";
+    return false;
+  }
+  return true;
+}
+
+// ---------------- KBITv1 ----------------
+static bool read_file(const std::string& path, std::vector<char>& out) {
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in) { std::perror(("open " + path).c_str()); return false; }
+  out.resize((size_t)in.tellg());
+  in.seekg(0);
+  in.read(out.data(), (std::streamsize)out.size());
+  return (bool)in;
+}
+
+// flags=2 payload -> frame index + independent zstd frames.
+static bool compress_frames(const char* raw, uint64_t raw_len, uint64_t frame_raw, int level,
+                            std::vector<char>& out) {
+  const uint64_t nframes = (raw_len + frame_raw - 1) / frame_raw;
+  out.assign(24 + 8 * nframes, 0);
+  unsigned char* fh = reinterpret_cast<unsigned char*>(out.data());
+  write_le64(fh, raw_len);
+  write_le64(fh + 8, frame_raw);
+  write_le64(fh + 16, nframes);
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  if (!cctx) return false;
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);  // loaders reject corrupted frames
+  std::vector<char> comp(ZSTD_compressBound(frame_raw));
+  bool ok = true;
+  for (uint64_t f = 0; ok && f < nframes; ++f) {
+    const uint64_t off = f * frame_raw, len = std::min(frame_raw, raw_len - off);
+    const size_t cs = ZSTD_compress2(cctx, comp.data(), comp.size(), raw + off, len);
+    if (ZSTD_isError(cs)) { ok = false; break; }
+    write_le64(reinterpret_cast<unsigned char*>(out.data()) + 24 + 8 * f, cs);
+    out.insert(out.end(), comp.data(), comp.data() + cs);
+  }
+  ZSTD_freeCCtx(cctx);
+  return ok;
+}
+
+// Frame index + frames -> flags=2 payload (same layout as read_zstd_frames in the query tools).
+static bool decompress_frames(const char* p, uint64_t len, std::vector<char>& out) {
+  if (len < 24) return false;
+  const unsigned char* fh = reinterpret_cast<const unsigned char*>(p);
+  const uint64_t raw_len = read_le64(fh), frame_raw = read_le64(fh + 8), nframes = read_le64(fh + 16);
+  if (frame_raw == 0 || nframes != (raw_len + frame_raw - 1) / frame_raw || nframes > (len - 24) / 8) return false;
+  // Every frame must fit in the payload, and no zstd block (3-byte header, at most
+  // ZSTD_BLOCKSIZE_MAX raw bytes) expands further, which bounds raw_len before allocating it.
+  uint64_t used = 24 + 8 * nframes;
+  for (uint64_t f = 0; f < nframes; ++f) {
+    const uint64_t cs = read_le64(fh + 24 + 8 * f);
+    const uint64_t want = std::min(frame_raw, raw_len - f * frame_raw);
+    if (cs > len - used || want > cs / 3 * ZSTD_BLOCKSIZE_MAX) return false;
+    used += cs;
+  }
+  out.resize(raw_len);
+  ZSTD_DCtx* dctx = ZSTD_createDCtx();
+  if (!dctx) return false;
+  uint64_t pos = 24 + 8 * nframes;
+  bool ok = true;
+  for (uint64_t f = 0; ok && f < nframes; ++f) {
+    const uint64_t cs = read_le64(fh + 24 + 8 * f);
+    const uint64_t off = f * frame_raw, want = std::min(frame_raw, raw_len - off);
+    if (cs > len - pos) { ok = false; break; }
+    const size_t r = ZSTD_decompressDCtx(dctx, out.data() + off, want, p + pos, cs);
+    ok = !ZSTD_isError(r) && r == want;
+    pos += cs;
+  }
+  ZSTD_freeDCtx(dctx);
+  return ok;
+}
+
+static bool same_file(const struct stat& a, const struct stat& b) {
+  return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size &&
+         a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+enum TierResult { TIER_KEPT, TIER_COMPRESSED, TIER_PROMOTED, TIER_FAILED };
+
+// Rewrites one shard file with the given target flags (2 or 3); bytes_out gets the new size.
+static TierResult retier_file(const std::string& path, uint64_t target_flags, const Args& args,
+                              uint64_t& bytes_in, uint64_t& bytes_out) {
+  struct stat before;
+  if (::stat(path.c_str(), &before) != 0) { std::perror(("stat " + path).c_str()); return TIER_FAILED; }
+  std::vector<char> file;
+  if (!read_file(path, file)) return TIER_FAILED;
+  bytes_in = bytes_out = file.size();
+  unsigned char* hdr = reinterpret_cast<unsigned char*>(file.data());
+  if (file.size() < 64 || std::memcmp(hdr, "KBITv1\0", 8) != 0) {
+    std::cerr << "Error: bad magic (not a KBITv1 file): " << path << "\n";
+    return TIER_FAILED;
+  }
+  const uint64_t flags = read_le64(hdr + 40), payload_len = read_le64(hdr + 48);
+  if (flags == target_flags) return TIER_KEPT;
+  if ((flags != 2 && flags != 3) || payload_len != file.size() - 64) {
+    std::cerr << "Error: unexpected flags/payload length in " << path << "\n";
+    return TIER_FAILED;
+  }
+
+  std::vector<char> payload;
+  const bool ok = (target_flags == 3)
+      ? compress_frames(file.data() + 64, payload_len, (uint64_t)args.frame_kb * 1024, args.level, payload)
+      : decompress_frames(file.data() + 64, payload_len, payload);
+  if (!ok) { std::cerr << "Error: zstd failed for " << path << "\n"; return TIER_FAILED; }
+  if (target_flags == 3 && payload.size() >= payload_len) return TIER_KEPT;  // incompressible
+
+  unsigned char out_hdr[64];
+  std::memcpy(out_hdr, hdr, 64);
+  write_le64(out_hdr + 40, target_flags);
+  write_le64(out_hdr + 48, payload.size());
+  const std::string tmp = path + ".tier.tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out) { std::perror(("open " + tmp).c_str()); return TIER_FAILED; }
+    out.write(reinterpret_cast<const char*>(out_hdr), 64);
+    out.write(payload.data(), (std::streamsize)payload.size());
+    if (!out) { std::cerr << "Error: short write to " << tmp << "\n"; return TIER_FAILED; }
+  }
+  struct stat now;
+  if (::stat(path.c_str(), &now) != 0 || !same_file(before, now)) {
+    std::remove(tmp.c_str());  // rewritten meanwhile; retry on the next run
+    return TIER_KEPT;
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) { std::perror(("rename " + path).c_str()); return TIER_FAILED; }
+  bytes_out = 64 + payload.size();
+  return target_flags == 3 ? TIER_COMPRESSED : TIER_PROMOTED;
+}
+
+// ---------------- Access counts ----------------
+// Maps <dir>/access_counts, creating it (zeroed) if needed. Returns nullptr on failure.
+static uint64_t* map_access_counts(const std::string& dir, size_t n, bool& created) {
+  const std::string path = dir + "/access_counts";
+  created = false;
+  int fd = ::open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0664);
+    if (fd < 0) { std::perror(("create " + path).c_str()); return nullptr; }
+    created = true;
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0) { std::perror(("stat " + path).c_str()); ::close(fd); return nullptr; }
+  if ((uint64_t)st.st_size != n * sizeof(uint64_t)) {
+    // New file, or the shard count changed: start counting afresh.
+    if (::ftruncate(fd, 0) != 0 || ::ftruncate(fd, (off_t)(n * sizeof(uint64_t))) != 0) {
+      std::perror(("resize " + path).c_str());
+      ::close(fd);
+      return nullptr;
+    }
+    created = true;
+  }
+  void* p = ::mmap(nullptr, n * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) { std::perror(("mmap " + path).c_str()); return nullptr; }
+  return static_cast<uint64_t*>(p);
+}
+
+int main(int argc, char** argv) {
+  std::ios::sync_with_stdio(false);
+
+  Args args;
+  if (!parse_args(argc, argv, args)) { usage(argv[0]); return 1; }
+  if (args.nice > 0 && ::nice(args.nice) == -1) std::perror("nice");
+
+  IndexLines index;
+  uint64_t k_index = 0;
+  std::vector<ShardInfo> shards;
+  if (!read_index_lines(args.shards, index, k_index, shards)) {
+    std::cerr << "Error: failed to read shards index: " << args.shards << "/index.json\n";
+    return 2;
+  }
+  bool created = false;
+  uint64_t* counts = map_access_counts(args.shards, shards.size(), created);
+  if (!counts) return 2;
+  if (created) {
+    std::cerr << "[INFO] Created " << args.shards << "/access_counts for " << shards.size()
+              << " shards; run again once queries have been recorded\n";
+    return 0;
+  }
+
+  // Snapshot the counters so every shard is judged on the same window.
+  std::vector<uint64_t> seen(shards.size());
+  for (size_t i = 0; i < shards.size(); ++i) seen[i] = __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+
+  auto t0 = Clock::now();
+  std::atomic<size_t> next(0);
+  std::atomic<uint64_t> n_compressed(0), n_promoted(0), n_skipped(0), bytes_before(0), bytes_after(0);
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> pool;
+  for (int t = 0; t < args.threads; ++t) {
+    pool.emplace_back([&]() {
+      while (true) {
+        const size_t i = next.fetch_add(1);
+        if (i >= shards.size() || failed) break;
+        if (!shards[i].deltas.empty()) { n_skipped++; continue; }
+        const std::string path = args.shards + "/" + shards[i].file;
+        uint64_t target = 0;
+        if (seen[i] < args.cold_below) target = 3;
+        else if (seen[i] >= args.hot_at) target = 2;
+        uint64_t in_bytes = 0, out_bytes = 0;
+        TierResult r = TIER_KEPT;
+        if (target != 0) {
+          r = retier_file(path, target, args, in_bytes, out_bytes);
+        } else {
+          struct stat st;
+          if (::stat(path.c_str(), &st) == 0) in_bytes = out_bytes = (uint64_t)st.st_size;
+        }
+        if (r == TIER_FAILED) { failed = true; break; }
+        if (r == TIER_COMPRESSED) n_compressed++;
+        if (r == TIER_PROMOTED) n_promoted++;
+        bytes_before += in_bytes;
+        bytes_after += out_bytes;
+      }
+    });
+  }
+  for (auto& th : pool) th.join();
+  if (failed) return 2;
+
+  // Decay by subtracting what we saw, so accesses recorded meanwhile are not lost.
+  if (args.decay_shift > 0) {
+    for (size_t i = 0; i < shards.size(); ++i) {
+      __atomic_fetch_sub(&counts[i], seen[i] - (seen[i] >> args.decay_shift), __ATOMIC_RELAXED);
+    }
+  }
+  ::munmap(counts, shards.size() * sizeof(uint64_t));
+  auto t1 = Clock::now();
+
+  long pk = peak_rss_kb();
+  std::cerr << std::fixed << std::setprecision(6);
+  std::cerr << "[INFO] Shards dir        : " << args.shards << " (" << shards.size() << " shards)\n";
+  std::cerr << "[INFO] Compressed        : " << n_compressed.load() << "\n";
+  std::cerr << "[INFO] Promoted          : " << n_promoted.load() << "\n";
+  std::cerr << "[INFO] Skipped (deltas)  : " << n_skipped.load() << "\n";
+  std::cerr << "[INFO] Shard bytes       : " << bytes_before.load() << " -> " << bytes_after.load() << "\n";
+  std::cerr << "[INFO] Tiering time      : " << std::chrono::duration_cast<Sec>(t1 - t0).count() << " s\n";
+  std::cerr << "[INFO] Peak RSS          : " << pk << " KB (" << (pk / 1024.0) << " MB)\n";
+  return 0;
+}
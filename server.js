@@ -39,10 +39,64 @@ function getShardsForK(k) {
   return { shards: SHARDS_18, gcHist: GC_HIST_18, baseK: 18 };
 }
 
+// Optional Hamming-1 dilation of a base set (dilate_shards): its absent k-mers are the robust=1 ones.
+function getDilatedForK(k) {
+  return {
+    shards: path.join(ROOT, `shards_${k}_d1`),
+    gcHist: path.join(ROOT, `gc_hist_shards_${k}_d1.json`),
+  };
+}
+
+// A dilated set is only used while it matches its base set: same shard ranges, no delta layers on
+// the base, and each base shard's "ones" equal to the "source_ones" dilate_shards recorded.
+// Cached on the mtimes of both index.json files.
+const dilationChecks = new Map();
+function isDilationCurrent(baseShards, dilatedShards) {
+  const baseIndex = path.join(baseShards, 'index.json');
+  const dilatedIndex = path.join(dilatedShards, 'index.json');
+  try {
+    const stamp = `${fs.statSync(baseIndex).mtimeMs}:${fs.statSync(dilatedIndex).mtimeMs}`;
+    const cached = dilationChecks.get(dilatedShards);
+    if (cached && cached.stamp === stamp) return cached.current;
+    const byStart = (a, b) => a.start - b.start;
+    const base = (JSON.parse(fs.readFileSync(baseIndex, 'utf8')).shards || []).slice().sort(byStart);
+    const dil = (JSON.parse(fs.readFileSync(dilatedIndex, 'utf8')).shards || []).slice().sort(byStart);
+    const current = base.length > 0 && base.length === dil.length && base.every((s, i) =>
+      !(s.deltas && s.deltas.length) && s.start === dil[i].start && s.end === dil[i].end &&
+      typeof s.ones === 'number' && s.ones === dil[i].source_ones);
+    dilationChecks.set(dilatedShards, { stamp, current });
+    return current;
+  } catch (e) {
+    return false;
+  }
+}
+
 function isDNA(s) {
   return /^[ACGTacgt]+$/.test(s);
 }
 
+// DNA with IUPAC degenerate codes (R, Y, S, W, K, M, B, D, H, V, N).
+function isIUPAC(s) {
+  return /^[ACGTRYSWKMBDHVNacgtryswkmbdhvn]+$/.test(s);
+}
+
+// Source names from index.json "sources" (colour layers); optional array or comma-separated string.
+function parseSources(v) {
+  if (v === null || v === undefined || v === '') return [];
+  const list = Array.isArray(v) ? v : String(v).split(',');
+  return list.map((s) => String(s).trim()).filter((s) => s);
+}
+function isSourceName(s) {
+  return /^[A-Za-z0-9_.-]+$/.test(s);
+}
+
+// Optional count-layer threshold (count_kmer_shards); null when absent.
+function parseCount(v) {
+  if (v === null || v === undefined || String(v).trim() === '') return null;
+  const n = Math.floor(Number(v));
+  return (Number.isFinite(n) && n >= 0) ? n : NaN;
+}
+
 function gcContent(seq) {
   if (!seq || seq.length === 0) return 0;
   let gc = 0;
@@ -155,7 +209,18 @@ app.post('/api/query-kmer', upload.single('kmersFile'), async (req, res) => {
     fs.writeFileSync(tmpFile, uniq.join('\n'));
 
     const { shards: shardsDir } = getShardsForK(kReq);
+    const withColors = req.body.colors === true || req.body.colors === 'true' || req.body.colors === '1';
+    const withCounts = req.body.counts === true || req.body.counts === 'true' || req.body.counts === '1';
+    const minCount = parseCount(req.body.minCount);
+    const maxCount = parseCount(req.body.maxCount);
+    if (Number.isNaN(minCount) || Number.isNaN(maxCount)) {
+      return res.status(400).json({ error: 'minCount/maxCount must be non-negative integers' });
+    }
     const args = ['--shards', shardsDir, '--k', String(kReq), '--kmers', tmpFile];
+    if (withCounts) args.push('--counts');
+    if (minCount !== null) args.push('--min-count', String(minCount));
+    if (maxCount !== null) args.push('--max-count', String(maxCount));
+    if (withColors) args.push('--colors');
     const { stdout } = await runBinary(BIN_QUERY_KMER, args, { timeoutMs: 120000 });
     fs.unlink(tmpFile, () => {});
 
@@ -163,10 +228,15 @@ app.post('/api/query-kmer', upload.single('kmersFile'), async (req, res) => {
     let foundCount = 0;
     for (const line of stdout.split(/\r?\n/)) {
       if (!line) continue;
-      const [kmer, hit] = line.split('\t');
+      const cols = line.split('\t');
+      const [kmer, hit] = cols;
       const present = hit === '1';
       if (present) foundCount++;
-      results.push({ kmer, present, gc: gcContent(kmer), comp: ntComp(kmer) });
+      const r = { kmer, present, gc: gcContent(kmer), comp: ntComp(kmer) };
+      if (withCounts) r.count = Number(cols[2]) || 0;
+      const colors = cols[withCounts ? 3 : 2];
+      if (withColors) r.sources = (colors && colors !== '-') ? colors.split(',') : [];
+      results.push(r);
     }
 
     res.json({
@@ -197,12 +267,12 @@ app.post('/api/query-substring', async (req, res) => {
     // ConstructK: optional; if empty/null => defaults to base-k (see below)
     const constructKRaw = (body.constructK === null || body.constructK === undefined) ? '' : String(body.constructK).trim();
     const constructK = constructKRaw ? Math.floor(Number(constructKRaw)) : null;
-    if (constructKRaw && (!Number.isFinite(constructK) || constructK < 16 || constructK > 32)) {
-      return res.status(400).json({ error: 'constructK must be an integer between 16 and 32' });
+    if (constructKRaw && (!Number.isFinite(constructK) || constructK < 16 || constructK > 64)) {
+      return res.status(400).json({ error: 'constructK must be an integer between 16 and 64' });
     }
 
-    if (substring && !isDNA(substring)) {
-      return res.status(400).json({ error: 'substring must be A/C/G/T only' });
+    if (substring && !isIUPAC(substring)) {
+      return res.status(400).json({ error: 'substring must be A/C/G/T or IUPAC codes' });
     }
     const kOut = constructK ?? 18;
     const maxSubLen = kOut;
@@ -221,6 +291,118 @@ app.post('/api/query-substring', async (req, res) => {
 
     const cursorUsed = (typeof body.cursor === 'string' && body.cursor.trim()) ? body.cursor.trim() : '';
 
+    // Optional source filters (colour layers); base-k only
+    const absentIn = parseSources(body.absentIn);
+    const presentIn = parseSources(body.presentIn);
+    for (const s of absentIn.concat(presentIn)) {
+      if (!isSourceName(s)) return res.status(400).json({ error: `Invalid source name: ${s}` });
+    }
+    if ((absentIn.length || presentIn.length) && kOut > 18) {
+      return res.status(400).json({ error: 'absentIn/presentIn require constructK <= 18' });
+    }
+
+    // Optional count thresholds: k-mers seen fewer than minCount times are treated as absent
+    const minCount = parseCount(body.minCount);
+    const maxCount = parseCount(body.maxCount);
+    if (Number.isNaN(minCount) || Number.isNaN(maxCount)) {
+      return res.status(400).json({ error: 'minCount/maxCount must be non-negative integers' });
+    }
+
+    // Optional low-complexity limits: longest homopolymer run, most copies of a dinucleotide unit
+    const maxHomopolymer = parseCount(body.maxHomopolymer);
+    const maxDinucRepeat = parseCount(body.maxDinucRepeat);
+    if (Number.isNaN(maxHomopolymer) || Number.isNaN(maxDinucRepeat) ||
+        maxHomopolymer === 0 || maxDinucRepeat === 0) {
+      return res.status(400).json({ error: 'maxHomopolymer/maxDinucRepeat must be positive integers' });
+    }
+
+    // Optional nearest-neighbour Tm window (degrees C) with Na+ (mM) and oligo (nM) concentrations
+    const parseNum = (v) => ((v === null || v === undefined || String(v).trim() === '') ? null : Number(v));
+    const tmMin = parseNum(body.tmMin);
+    const tmMax = parseNum(body.tmMax);
+    const naMM = parseNum(body.naMM);
+    const oligoNM = parseNum(body.oligoNM);
+    if ([tmMin, tmMax, naMM, oligoNM].some((x) => x !== null && !Number.isFinite(x)) ||
+        (tmMin !== null && tmMax !== null && tmMin > tmMax) ||
+        (naMM !== null && naMM <= 0) || (oligoNM !== null && oligoNM <= 0)) {
+      return res.status(400).json({ error: 'tmMin must be <= tmMax; naMM and oligoNM must be positive' });
+    }
+
+    // Optional self-complementarity limits: longest stem pairing within the k-mer, and with the
+    // reverse complement of any adapter in avoidRcWith (maxAdapterStem defaults to maxSelfRcStem)
+    const maxSelfRcStem = parseCount(body.maxSelfRcStem);
+    const avoidRcWith = parseSources(body.avoidRcWith).map((a) => a.toUpperCase());
+    const maxAdapterStem = parseCount(body.maxAdapterStem);
+    if (Number.isNaN(maxSelfRcStem) || Number.isNaN(maxAdapterStem) ||
+        maxSelfRcStem === 0 || maxAdapterStem === 0) {
+      return res.status(400).json({ error: 'maxSelfRcStem/maxAdapterStem must be positive integers' });
+    }
+    for (const a of avoidRcWith) {
+      if (!isDNA(a)) return res.status(400).json({ error: `Invalid adapter: ${a}` });
+    }
+    if (avoidRcWith.length && maxAdapterStem === null && maxSelfRcStem === null) {
+      return res.status(400).json({ error: 'avoidRcWith needs maxAdapterStem or maxSelfRcStem' });
+    }
+
+    // Optional IUPAC constraints: positionClass "P:C,P1-P2:C" (1-based) and per-class base counts
+    // baseCount "C:lo-hi" (C an IUPAC code, or * for every base)
+    const positionClass = String(body.positionClass || '').trim().toUpperCase();
+    const baseCount = String(body.baseCount || '').trim().toUpperCase();
+    if (positionClass && !/^\d+(-\d+)?:[ACGTRYSWKMBDHVN](,\d+(-\d+)?:[ACGTRYSWKMBDHVN])*$/.test(positionClass)) {
+      return res.status(400).json({ error: `Invalid positionClass: ${positionClass}` });
+    }
+    if (baseCount && !/^[ACGTRYSWKMBDHVN*]:\d*(-\d*)?(,[ACGTRYSWKMBDHVN*]:\d*(-\d*)?)*$/.test(baseCount)) {
+      return res.status(400).json({ error: `Invalid baseCount: ${baseCount}` });
+    }
+
+    // Optional substring sets: require is a list of groups (each an array or comma-separated string
+    // of alternatives, one of which must occur); forbid lists patterns none of which may occur
+    const requireRaw = Array.isArray(body.require) ? body.require : (body.require ? [body.require] : []);
+    const requireSets = requireRaw.map((g) => parseSources(g).map((p) => p.toUpperCase())).filter((g) => g.length);
+    const forbid = parseSources(body.forbid).map((p) => p.toUpperCase());
+    for (const p of [...requireSets.flat(), ...forbid]) {
+      if (!isIUPAC(p) || p.length > kOut) {
+        return res.status(400).json({ error: `Invalid require/forbid pattern: ${p}` });
+      }
+    }
+
+    // Optional barcode set selection: pairwise Hamming (minHamming) or edit (minEdit) distance,
+    // up to setSize; colorBalance (2 = two-channel, 4 = four-colour Illumina) keeps each channel lit
+    // by minChannelShare of the set at every position
+    const minHamming = parseCount(body.minHamming);
+    const minEdit = parseCount(body.minEdit);
+    const setSize = parseCount(body.setSize);
+    const colorBalance = parseCount(body.colorBalance);
+    const minChannelShare = parseNum(body.minChannelShare);
+    if (Number.isNaN(minHamming) || Number.isNaN(minEdit) || Number.isNaN(setSize) ||
+        minHamming === 0 || minHamming > kOut || minEdit === 0 || minEdit > kOut ||
+        (minHamming !== null && minEdit !== null) ||
+        (setSize !== null && minHamming === null && minEdit === null && colorBalance === null)) {
+      return res.status(400).json({
+        error: `minHamming or minEdit must be between 1 and ${kOut}; setSize needs one of them`,
+      });
+    }
+    if ((colorBalance !== null && (![2, 4].includes(colorBalance) || setSize === null || setSize < 2)) ||
+        (minChannelShare !== null && (colorBalance === null || !(minChannelShare > 0 && minChannelShare <= 0.5)))) {
+      return res.status(400).json({
+        error: 'colorBalance must be 2 or 4 with setSize >= 2; minChannelShare must be in (0, 0.5]',
+      });
+    }
+
+    // Optional existing panel: drop candidates within excludeD-1 mismatches of any excludeNear
+    // barcode (array or newline/comma-separated string, each kOut bases)
+    const excludeNear = (Array.isArray(body.excludeNear) ? body.excludeNear : String(body.excludeNear || '').split(/[\s,]+/))
+      .map((b) => String(b).trim().toUpperCase()).filter((b) => b);
+    const excludeD = parseCount(body.excludeD);
+    if (excludeNear.length && (excludeD === null || Number.isNaN(excludeD) || excludeD < 1 || excludeD > kOut)) {
+      return res.status(400).json({ error: `excludeD must be between 1 and ${kOut}` });
+    }
+    for (const b of excludeNear) {
+      if (!isDNA(b) || b.length !== kOut) {
+        return res.status(400).json({ error: `Invalid excludeNear barcode (need ${kOut} bases): ${b}` });
+      }
+    }
+
     // Decide shard base.
     // Rules:
     // - For requested kOut in {16,17,18} => use that exact shard set.
@@ -231,13 +413,50 @@ app.post('/api/query-substring', async (req, res) => {
     }
     const { shards: shardsDir, gcHist: gcHist } = getShardsForK(baseK);
 
-    if (!fs.existsSync(gcHist)) {
-      return res.status(500).json({ error: `GC histogram not found: ${gcHist}` });
+    // Minimal absent words: both (k-1)-mers must be present, looked up in the k-1 shard set
+    // (shards_17 for k=18, shards_16 for k=17)
+    const minimalAbsent = !!body.minimalAbsent;
+    if (minimalAbsent && (kOut !== baseK || baseK === 16)) {
+      return res.status(400).json({ error: 'minimalAbsent is only supported for k=17 and k=18' });
+    }
+
+    // Robust absence: every k-mer within `robust` mismatches must be absent too (base k only)
+    const robust = parseCount(body.robust);
+    if (robust !== null && (Number.isNaN(robust) || robust < 1 || robust > 3 || kOut !== baseK)) {
+      return res.status(400).json({ error: 'robust must be 1, 2 or 3 and needs kOut equal to the base k' });
+    }
+    // Lexicographic window: only k-mers after startAfter and/or between the prefixes range = "LO:HI"
+    const startAfter = body.startAfter ? String(body.startAfter).trim().toUpperCase() : '';
+    const range = body.range ? String(body.range).trim().toUpperCase() : '';
+    if ((startAfter || range) && kOut !== baseK) {
+      return res.status(400).json({ error: 'startAfter/range need kOut equal to the base k' });
+    }
+    if (startAfter && (!isDNA(startAfter) || startAfter.length !== kOut)) {
+      return res.status(400).json({ error: `startAfter must be a ${kOut}-base A/C/G/T k-mer` });
+    }
+    const rangeParts = range ? range.split(':') : [];
+    if (range && (rangeParts.length !== 2 || !rangeParts.every((x) => isDNA(x) && x.length <= kOut))) {
+      return res.status(400).json({ error: `range must be LO:HI, A/C/G/T prefixes of at most ${kOut} bases` });
+    }
+
+    // robust=1 scans the dilated set directly when it is installed, still matches the base set
+    // and no filter needs the base set's source or count layers (or its plain presence, as the
+    // strand checks do)
+    const dilated = getDilatedForK(baseK);
+    const useDilated = robust === 1 && !absentIn.length && !presentIn.length && minCount === null &&
+      maxCount === null && !body.bothStrandsAbsent && !minimalAbsent &&
+      fs.existsSync(dilated.shards) && fs.existsSync(dilated.gcHist) &&
+      isDilationCurrent(shardsDir, dilated.shards);
+    const scanShards = useDilated ? dilated.shards : shardsDir;
+    const scanGcHist = useDilated ? dilated.gcHist : gcHist;
+
+    if (!fs.existsSync(scanGcHist)) {
+      return res.status(500).json({ error: `GC histogram not found: ${scanGcHist}` });
     }
 
     const args = [
-      '--shards', shardsDir,
-      '--gc-hist', gcHist,
+      '--shards', scanShards,
+      '--gc-hist', scanGcHist,
       '--limit', String(pageSize),
       '--threads', String(threads),
       '--gc-min', String(gcMin),
@@ -248,8 +467,49 @@ app.post('/api/query-substring', async (req, res) => {
     if (substring) args.push('--substring', substring);
     if (cursorUsed) args.push('--cursor', cursorUsed);
     if (body.reverse_complement) args.push('--reverse_complement');
+    if (body.bothStrandsAbsent) args.push('--both-strands-absent');
+    if (minimalAbsent) args.push('--minimal-absent', getShardsForK(baseK - 1).shards);
+    if (robust !== null && !useDilated) args.push('--robust', String(robust));
+    if (startAfter) args.push('--start-after', startAfter);
+    if (range) args.push('--range', range);
+    if (tmMin !== null) args.push('--tm-min', String(tmMin));
+    if (tmMax !== null) args.push('--tm-max', String(tmMax));
+    if (naMM !== null) args.push('--na-mm', String(naMM));
+    if (oligoNM !== null) args.push('--oligo-nm', String(oligoNM));
+    if (absentIn.length) args.push('--absent-in', absentIn.join(','));
+    if (presentIn.length) args.push('--present-in', presentIn.join(','));
+    if (minCount !== null) args.push('--min-count', String(minCount));
+    if (maxCount !== null) args.push('--max-count', String(maxCount));
+    if (maxHomopolymer !== null) args.push('--max-homopolymer', String(maxHomopolymer));
+    if (maxDinucRepeat !== null) args.push('--max-dinuc-repeat', String(maxDinucRepeat));
+    if (maxSelfRcStem !== null) args.push('--max-self-rc-stem', String(maxSelfRcStem));
+    if (avoidRcWith.length) args.push('--avoid-rc-with', avoidRcWith.join(','));
+    if (maxAdapterStem !== null) args.push('--max-adapter-stem', String(maxAdapterStem));
+    if (positionClass) args.push('--position-class', positionClass);
+    if (baseCount) args.push('--base-count', baseCount);
+    for (const g of requireSets) args.push('--require', g.join(','));
+    if (forbid.length) args.push('--forbid', forbid.join(','));
+    if (minHamming !== null) args.push('--min-hamming', String(minHamming));
+    if (minEdit !== null) args.push('--min-edit', String(minEdit));
+    if (setSize) args.push('--set-size', String(setSize));
+    if (colorBalance !== null) args.push('--color-balance', String(colorBalance));
+    if (minChannelShare !== null) args.push('--min-channel-share', String(minChannelShare));
+
+    // Each request gets its own directory, so concurrent requests never share the list file.
+    let excludeDir = null;
+    if (excludeNear.length) {
+      excludeDir = fs.mkdtempSync(path.join(uploadsDir, 'exclude_'));
+      const excludeFile = path.join(excludeDir, 'near.txt');
+      fs.writeFileSync(excludeFile, excludeNear.join('\n'));
+      args.push('--exclude-near', excludeFile, '--exclude-d', String(excludeD));
+    }
 
-    const { stdout } = await runBinary(BIN_QUERY_SUBSTR, args, { timeoutMs: 2 * 60 * 1000 });
+    let stdout;
+    try {
+      ({ stdout } = await runBinary(BIN_QUERY_SUBSTR, args, { timeoutMs: 2 * 60 * 1000 }));
+    } finally {
+      if (excludeDir) fs.rm(excludeDir, { recursive: true, force: true }, () => {});
+    }
     const parsed = parseSubstringStdout(stdout);
 
     const results = parsed.kmers.map((kmer) => ({
@@ -272,6 +532,36 @@ app.post('/api/query-substring', async (req, res) => {
       threads,
       constructK: kOut,
       baseK,
+      absentIn,
+      presentIn,
+      minCount,
+      maxCount,
+      maxHomopolymer,
+      maxDinucRepeat,
+      maxSelfRcStem,
+      avoidRcWith,
+      maxAdapterStem,
+      bothStrandsAbsent: !!body.bothStrandsAbsent,
+      minimalAbsent,
+      robust,
+      robustDilated: useDilated,
+      startAfter: startAfter || null,
+      range: range || null,
+      tmMin,
+      tmMax,
+      naMM,
+      oligoNM,
+      positionClass,
+      baseCount,
+      require: requireSets,
+      forbid,
+      minHamming,
+      minEdit,
+      setSize,
+      colorBalance,
+      minChannelShare,
+      excludeCount: excludeNear.length,
+      excludeD,
 
       results,
     });